@@ -0,0 +1,278 @@
+/**********************************************************************************************************************
+ *
+ * xorscura audit
+ *
+ *	How long does a ciphertext hold out, given a little of its plaintext? This tries every seed (or a range of
+ *	them) with xorscura_seed_search(), on a thread per cpu, and reports progress as it goes.
+ *
+ *	The seed space is handed out to the threads in AUDIT_CHUNK sized pieces. Each seed found goes to stdout as it
+ *	turns up. Progress goes to stderr once a second, and a summary goes to stdout at the end with the throughput,
+ *	and what that makes the time for all 2^32 seeds.
+ *
+ **********************************************************************************************************************/
+
+
+#include "libxorscura.h"
+
+
+void usage(){
+	fprintf(stderr, "Usage: %s [-h] [-e] [-a ALGORITHM] [-t THREADS] [-f FIRST] [-l LAST] -p PLAINTEXT -c CIPHERTEXT\n", program_invocation_short_name);
+	fprintf(stderr, "\t-h\t:\tHelp!\n");
+	fprintf(stderr, "\t-e\t:\tExhaustive. Keep going after the first seed found, and report them all.\n");
+	fprintf(stderr, "\t-a\t:\tKeystream ALGORITHM. (random_r or chacha8. Default is random_r.)\n");
+	fprintf(stderr, "\t-t\t:\tNumber of THREADS. (Default is one per cpu.)\n");
+	fprintf(stderr, "\t-f\t:\tFIRST seed to try. (Default is 0.)\n");
+	fprintf(stderr, "\t-l\t:\tLAST seed to try. (Default is 4294967295.)\n");
+	fprintf(stderr, "\t-p\t:\tKnown PLAINTEXT, from the start of the data.\n");
+	fprintf(stderr, "\t-c\t:\tCIPHERTEXT, at least as long as PLAINTEXT. Only that much of it is used.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "PLAINTEXT and CIPHERTEXT are \"postscript continuous hexdump style\". (man xxd) Four bytes or more\n");
+	fprintf(stderr, "is enough to pick out the seed used.\n");
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+
+// Seeds per piece of work a thread takes.
+#define AUDIT_CHUNK	(1 << 24)
+
+struct audit {
+	unsigned char algorithm;
+	unsigned char *plain;
+	unsigned char *cipher;
+	size_t count;
+
+	uint64_t first;
+	uint64_t last;
+	int exhaustive;
+
+	uint64_t next;	// Offset from first of the next chunk to hand out.
+	uint64_t done;	// Seeds tried.
+	uint64_t found;	// Seeds found.
+	int stop;
+	unsigned int running;	// Threads still going.
+};
+
+void *audit_worker(void *arg);
+
+int hex_decode(char *hex, unsigned char **bin);
+double now();
+
+
+
+int main(int argc, char **argv){
+
+	struct audit audit;
+	pthread_t *tids;
+	unsigned int threads = 0;
+	unsigned int started, i;
+	char *cli_plaintext = NULL;
+	char *cli_ciphertext = NULL;
+	int plain_count, cipher_count;
+
+	uint64_t total, done;
+	double start, elapsed, last_report;
+	struct timespec tick = {0, 100 * 1000 * 1000};
+
+	int opt;
+
+
+	memset(&audit, 0, sizeof(struct audit));
+	audit.algorithm = XORSCURA_ALG_RANDOM_R;
+	audit.last = UINT32_MAX;
+
+	while((opt = getopt(argc, argv, "hea:t:f:l:p:c:")) != -1){
+		switch(opt){
+			case 'e':
+				audit.exhaustive = 1;
+				break;
+
+			case 'a':
+				if(!strcmp(optarg, "random_r")){
+					audit.algorithm = XORSCURA_ALG_RANDOM_R;
+				}else if(!strcmp(optarg, "chacha8")){
+					audit.algorithm = XORSCURA_ALG_CHACHA8;
+				}else{
+					usage();
+				}
+				break;
+
+			case 't':
+				threads = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'f':
+				audit.first = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'l':
+				audit.last = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'p':
+				cli_plaintext = optarg;
+				break;
+
+			case 'c':
+				cli_ciphertext = optarg;
+				break;
+
+			default:
+				usage();
+		}
+	}
+
+	if(!cli_plaintext || !cli_ciphertext || optind != argc || audit.last > UINT32_MAX || audit.first > audit.last){
+		usage();
+	}
+
+	if((plain_count = hex_decode(cli_plaintext, &audit.plain)) < 1 || (cipher_count = hex_decode(cli_ciphertext, &audit.cipher)) < plain_count){
+		fprintf(stderr, "Error: PLAINTEXT has to be hex, and CIPHERTEXT hex at least as long.\n");
+		usage();
+	}
+	audit.count = (size_t) plain_count;
+
+	if(!threads){
+		threads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(!threads){
+		threads = 1;
+	}
+
+	if((tids = (pthread_t *) calloc(threads, sizeof(pthread_t))) == NULL){
+		error(-1, errno, "calloc(%u, %d)", threads, (int) sizeof(pthread_t));
+	}
+
+	total = audit.last - audit.first + 1;
+	printf("# threads: %u\n", threads);
+	printf("# seeds: %llu\n", (unsigned long long) total);
+	fflush(stdout);
+
+	start = now();
+	audit.running = threads;
+	for(started = 0; started < threads; started++){
+		if(pthread_create(tids + started, NULL, audit_worker, &audit)){
+			error(-1, errno, "pthread_create(%lx, NULL, %lx, %lx)", (unsigned long) (tids + started), (unsigned long) audit_worker, (unsigned long) &audit);
+		}
+	}
+
+	// Report once a second until the threads are done.
+	last_report = start;
+	while(__atomic_load_n(&audit.running, __ATOMIC_ACQUIRE)){
+		nanosleep(&tick, NULL);
+
+		if(now() - last_report < 1.0){
+			continue;
+		}
+		last_report = now();
+
+		done = __atomic_load_n(&audit.done, __ATOMIC_RELAXED);
+		elapsed = last_report - start;
+		fprintf(stderr, "progress: %.1f%%\tseeds: %llu\trate: %.1f Mseeds/s\teta: %.0fs\n",
+				100.0 * done / total,
+				(unsigned long long) done,
+				done / elapsed / 1e6,
+				done ? (total - done) * elapsed / done : 0.0);
+	}
+
+	for(i = 0; i < started; i++){
+		pthread_join(tids[i], NULL);
+	}
+
+	elapsed = now() - start;
+	done = audit.done;
+	printf("# searched: %llu seeds in %.3fs\n", (unsigned long long) done, elapsed);
+	printf("# rate: %.1f Mseeds/s\n", done / elapsed / 1e6);
+	printf("# all 2^32 seeds: %.1fs\n", done ? 4294967296.0 * elapsed / done : 0.0);
+	if(!audit.found){
+		printf("# no seed found\n");
+	}
+
+	free(audit.plain);
+	free(audit.cipher);
+	free(tids);
+
+	return(audit.found ? 0 : 1);
+}
+
+
+void *audit_worker(void *arg){
+
+	struct audit *audit = (struct audit *) arg;
+	uint64_t offset;
+	uint64_t next, last;
+	unsigned int seed;
+	int retval;
+
+
+	while(!__atomic_load_n(&audit->stop, __ATOMIC_RELAXED)){
+		if((offset = __atomic_fetch_add(&audit->next, AUDIT_CHUNK, __ATOMIC_RELAXED)) > audit->last - audit->first){
+			break;
+		}
+
+		next = audit->first + offset;
+		last = next + AUDIT_CHUNK - 1 < audit->last ? next + AUDIT_CHUNK - 1 : audit->last;
+
+		// Past a seed that's found, the rest of the chunk is still worth searching when exhaustive.
+		while(next <= last){
+			if((retval = xorscura_seed_search(audit->algorithm, audit->plain, audit->cipher, audit->count, (unsigned int) next, (unsigned int) last, &seed)) == -1){
+				error(-1, errno, "xorscura_seed_search(%d, %lx, %lx, %lu, %llu, %llu, %lx)", (int) audit->algorithm, (unsigned long) audit->plain, (unsigned long) audit->cipher, (unsigned long) audit->count, (unsigned long long) next, (unsigned long long) last, (unsigned long) &seed);
+			}
+
+			if(retval){
+				__atomic_fetch_add(&audit->done, last - next + 1, __ATOMIC_RELAXED);
+				break;
+			}
+
+			__atomic_fetch_add(&audit->done, seed - next + 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&audit->found, 1, __ATOMIC_RELAXED);
+			printf("seed: %u\n", seed);
+			fflush(stdout);
+
+			if(!audit->exhaustive){
+				__atomic_store_n(&audit->stop, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			next = (uint64_t) seed + 1;
+		}
+	}
+
+	__atomic_fetch_sub(&audit->running, 1, __ATOMIC_RELEASE);
+
+	return(NULL);
+}
+
+
+// Returns the size of the newly malloc()d bin, or -1 if hex isn't an even number of hex digits.
+int hex_decode(char *hex, unsigned char **bin){
+
+	size_t count, i;
+	unsigned int byte;
+
+
+	count = strlen(hex);
+	if(count % 2 || strspn(hex, "0123456789abcdefABCDEF") != count){
+		return(-1);
+	}
+	count /= 2;
+
+	if((*bin = (unsigned char *) malloc(count + 1)) == NULL){
+		return(-1);
+	}
+
+	for(i = 0; i < count; i++){
+		sscanf(hex + 2 * i, "%2x", &byte);
+		(*bin)[i] = (unsigned char) byte;
+	}
+
+	return((int) count);
+}
+
+double now(){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
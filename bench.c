@@ -0,0 +1,384 @@
+/**********************************************************************************************************************
+ *
+ * xorscura bench
+ *
+ *	Throughput numbers for libxorscura, to keep an eye on regressions from one release to the next.
+ *
+ *	Every case is timed until it has run for at least the minimum time (and at least once), then reported as one
+ *	tab separated line under a header row. Lines starting with '#' describe the run itself.
+ *
+ *	allocs_per_op counts calls to malloc(), calloc(), and realloc(). The Makefile links this with
+ *	-Wl,--wrap for each of them, so the calls libxorscura makes get counted too.
+ *
+ *	cycles_per_byte is in time stamp counter ticks, on x86 only. It's 0 elsewhere.
+ *
+ **********************************************************************************************************************/
+
+
+#include "libxorscura.h"
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+void usage(){
+	fprintf(stderr, "Usage: %s [-h] [-m MIN] [-M MAX] [-t SECONDS]\n", program_invocation_short_name);
+	fprintf(stderr, "\t-h\t:\tHelp!\n");
+	fprintf(stderr, "\t-m\t:\tSmallest buffer, in bytes. (Default is 8.)\n");
+	fprintf(stderr, "\t-M\t:\tLargest buffer, in bytes. (Default is 1073741824.)\n");
+	fprintf(stderr, "\t-t\t:\tMinimum time to spend on each case, in SECONDS. (Default is 0.2.)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Sizes go up by a factor of 8 from MIN to MAX, with MAX always included.\n");
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+
+// Set by the --wrap'd allocators.
+size_t alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size){
+	alloc_count++;
+	return(__real_malloc(size));
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){
+	alloc_count++;
+	return(__real_calloc(nmemb, size));
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+	alloc_count++;
+	return(__real_realloc(ptr, size));
+}
+
+
+// What a case works on. The plaintext, and the encrypt output that decrypt and compare start from. The encrypt
+// output is only made after the encrypt case has run, which keeps the peak memory of a 1GB run down to four buffers.
+struct fixture {
+	unsigned char *plaintext_buf;
+	unsigned char *ciphertext_buf;
+	unsigned char *key_buf;
+	unsigned int seed;
+	unsigned char algorithm;
+	size_t buf_count;
+};
+
+#define MODE_KEY	0
+#define MODE_SEED	1
+
+// One operation on the fixture. Returns -1 on error.
+typedef int (*bench_op)(struct fixture *fixture, int mode);
+
+int op_encrypt(struct fixture *fixture, int mode);
+int op_decrypt(struct fixture *fixture, int mode);
+int op_compare(struct fixture *fixture, int mode);
+
+struct bench_case {
+	char *name;
+	bench_op op;
+	int mode;
+};
+
+int fixture_init(struct fixture *fixture, size_t buf_count, unsigned char algorithm);
+int fixture_encrypt(struct fixture *fixture);
+void fixture_free(struct fixture *fixture);
+int run_case(struct bench_case *bench_case, struct fixture *fixture, double min_seconds);
+
+double now();
+unsigned long long ticks();
+
+
+
+int main(int argc, char **argv){
+
+	struct bench_case cases[] = {
+		{"encrypt", op_encrypt, MODE_SEED},
+		{"decrypt", op_decrypt, MODE_KEY},
+		{"decrypt", op_decrypt, MODE_SEED},
+		{"compare", op_compare, MODE_KEY},
+		{"compare", op_compare, MODE_SEED},
+		{NULL, NULL, 0}
+	};
+	unsigned char algorithms[] = {XORSCURA_ALG_RANDOM_R, XORSCURA_ALG_CHACHA8};
+
+	struct fixture fixture;
+
+	size_t min_count = 8;
+	size_t max_count = 1024 * 1024 * 1024;
+	size_t buf_count;
+	double min_seconds = 0.2;
+
+	unsigned int i, j;
+	int opt;
+
+
+	while((opt = getopt(argc, argv, "hm:M:t:")) != -1){
+		switch(opt){
+			case 'm':
+				min_count = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'M':
+				max_count = strtoul(optarg, NULL, 10);
+				break;
+
+			case 't':
+				min_seconds = strtod(optarg, NULL);
+				break;
+
+			default:
+				usage();
+		}
+	}
+
+	if(!min_count || min_count > max_count){
+		usage();
+	}
+
+	printf("# kernel: %s\n", xorscura_kernel());
+	printf("op\tmode\talgorithm\tbytes\titerations\tns_per_op\tgb_per_s\tallocs_per_op\tcycles_per_byte\n");
+	fflush(stdout);
+
+	buf_count = min_count;
+	while(1){
+
+		// Key mode doesn't care about the algorithm, so it only gets run the once.
+		for(i = 0; i < sizeof(algorithms); i++){
+
+			if(fixture_init(&fixture, buf_count, algorithms[i]) == -1){
+				printf("# skipped %lu bytes: %s\n", (unsigned long) buf_count, strerror(errno));
+				break;
+			}
+
+			for(j = 0; cases[j].name; j++){
+				if(i && cases[j].mode == MODE_KEY){
+					continue;
+				}
+
+				if(cases[j].op != op_encrypt && !fixture.ciphertext_buf && fixture_encrypt(&fixture) == -1){
+					printf("# skipped %lu bytes: %s\n", (unsigned long) buf_count, strerror(errno));
+					break;
+				}
+
+				if(run_case(cases + j, &fixture, min_seconds) == -1){
+					error(-1, errno, "run_case(%lx, %lx, %f)", (unsigned long) (cases + j), (unsigned long) &fixture, min_seconds);
+				}
+			}
+
+			fixture_free(&fixture);
+		}
+
+		if(buf_count == max_count){
+			break;
+		}
+
+		buf_count = buf_count > max_count / 8 ? max_count : buf_count * 8;
+	}
+
+	return(0);
+}
+
+
+// Time one case, and print its line.
+int run_case(struct bench_case *bench_case, struct fixture *fixture, double min_seconds){
+
+	size_t iterations, i;
+	size_t allocs;
+	double start, elapsed;
+	unsigned long long start_ticks, elapsed_ticks;
+	double ns_per_op;
+
+
+	// Once to warm up (and fault in whatever it allocates), then in doubling batches until it's run long enough.
+	if(bench_case->op(fixture, bench_case->mode) == -1){
+		return(-1);
+	}
+
+	iterations = 0;
+	allocs = alloc_count;
+	start = now();
+	start_ticks = ticks();
+	i = 1;
+	do{
+		while(i--){
+			if(bench_case->op(fixture, bench_case->mode) == -1){
+				return(-1);
+			}
+			iterations++;
+		}
+		i = iterations;
+		elapsed = now() - start;
+	}while(elapsed < min_seconds);
+
+	elapsed_ticks = ticks() - start_ticks;
+	allocs = alloc_count - allocs;
+
+	ns_per_op = elapsed * 1e9 / iterations;
+	printf("%s\t%s\t%s\t%lu\t%lu\t%.1f\t%.3f\t%.2f\t%.3f\n",
+			bench_case->name,
+			bench_case->mode == MODE_KEY ? "key" : "seed",
+			bench_case->mode == MODE_KEY ? "-" : (fixture->algorithm == XORSCURA_ALG_CHACHA8 ? "chacha8" : "random_r"),
+			(unsigned long) fixture->buf_count,
+			(unsigned long) iterations,
+			ns_per_op,
+			fixture->buf_count / ns_per_op,
+			(double) allocs / iterations,
+			(double) elapsed_ticks / iterations / fixture->buf_count);
+	fflush(stdout);
+
+	return(0);
+}
+
+
+int op_encrypt(struct fixture *fixture, int mode){
+
+	struct xod data;
+
+	(void) mode;
+
+	memset(&data, 0, sizeof(struct xod));
+	data.plaintext_buf = fixture->plaintext_buf;
+	data.buf_count = fixture->buf_count;
+	data.algorithm = fixture->algorithm;
+
+	if(xorscura_encrypt(&data) == -1){
+		return(-1);
+	}
+
+	data.plaintext_buf = NULL;
+	xorscura_free_xod(&data);
+
+	return(0);
+}
+
+int op_decrypt(struct fixture *fixture, int mode){
+
+	struct xod data;
+
+	memset(&data, 0, sizeof(struct xod));
+	data.ciphertext_buf = fixture->ciphertext_buf;
+	data.buf_count = fixture->buf_count;
+	data.seed = fixture->seed;
+	data.algorithm = fixture->algorithm;
+	if(mode == MODE_KEY){
+		data.key_buf = fixture->key_buf;
+	}
+
+	if(xorscura_decrypt(&data) == -1){
+		return(-1);
+	}
+
+	xorscura_free_xod(&data);
+
+	return(0);
+}
+
+int op_compare(struct fixture *fixture, int mode){
+
+	struct xod data;
+	int retval;
+
+	memset(&data, 0, sizeof(struct xod));
+	data.plaintext_buf = fixture->plaintext_buf;
+	data.ciphertext_buf = fixture->ciphertext_buf;
+	data.buf_count = fixture->buf_count;
+	data.seed = fixture->seed;
+	data.algorithm = fixture->algorithm;
+	if(mode == MODE_KEY){
+		data.key_buf = fixture->key_buf;
+	}
+
+	// A match is the slow case, since nothing stops early. Anything else is a bug.
+	if((retval = xorscura_compare(&data))){
+		if(retval == 1){
+			fprintf(stderr, "op_compare(): No match!\n");
+			errno = EINVAL;
+		}
+		return(-1);
+	}
+
+	return(0);
+}
+
+
+// Plaintext of buf_count pseudo random bytes.
+int fixture_init(struct fixture *fixture, size_t buf_count, unsigned char algorithm){
+
+	size_t i;
+
+
+	memset(fixture, 0, sizeof(struct fixture));
+
+	if((fixture->plaintext_buf = (unsigned char *) malloc(buf_count)) == NULL){
+		return(-1);
+	}
+
+	for(i = 0; i < buf_count; i++){
+		fixture->plaintext_buf[i] = (unsigned char) (i * 2654435761u >> 13);
+	}
+
+	fixture->algorithm = algorithm;
+	fixture->buf_count = buf_count;
+
+	return(0);
+}
+
+// Encrypt the plaintext, once, for the decrypt and compare cases.
+int fixture_encrypt(struct fixture *fixture){
+
+	struct xod data;
+
+
+	memset(&data, 0, sizeof(struct xod));
+	data.plaintext_buf = fixture->plaintext_buf;
+	data.buf_count = fixture->buf_count;
+	data.algorithm = fixture->algorithm;
+
+	if(xorscura_encrypt(&data) == -1){
+		free(data.ciphertext_buf);
+		free(data.key_buf);
+		return(-1);
+	}
+
+	// The fixture owns these now.
+	fixture->ciphertext_buf = data.ciphertext_buf;
+	fixture->key_buf = data.key_buf;
+	fixture->seed = data.seed;
+
+	return(0);
+}
+
+void fixture_free(struct fixture *fixture){
+
+	free(fixture->plaintext_buf);
+	free(fixture->ciphertext_buf);
+	free(fixture->key_buf);
+	memset(fixture, 0, sizeof(struct fixture));
+}
+
+
+double now(){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+unsigned long long ticks(){
+
+#if defined(__x86_64__) || defined(__i386__)
+	return(__rdtsc());
+#else
+	return(0);
+#endif
+}
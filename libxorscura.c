@@ -9,385 +9,5350 @@
  *	A library to simplify string obfuscation with xor.
  *
  *	Note: libobscura will malloc() it's own data for responses. It will then free() these automatically when the 
- *	xorscura_free_xod() function is called.
+ *	xorscura_free_xod() function is called. (Or take them from xod->arena, and give them back there instead.)
  *
  **********************************************************************************************************************/
 
 #include "libxorscura.h"
 
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// initstate_r() with PRNG_STATELEN bytes of state gives us glibc's TYPE_4 generator. These are its parameters.
+#define PRNG_DEG	XORSCURA_PRNG_DEG
+#define PRNG_DISCARD	(10 * PRNG_DEG)
+#define PRNG_MODULUS	2147483647
+
+// Bytes of keystream produced by each call to prng_next().
+#define PRNG_BLOCKLEN	(PRNG_DEG * sizeof(uint32_t))
+
+// Past this many blocks it's cheaper for prng_seek() to jump than to step.
+#define PRNG_JUMP_BLOCKS	2048
+
+static void prng_seed(struct xorscura_prng *prng, unsigned int seed);
+static void prng_next(struct xorscura_prng *prng, uint32_t *block);
+static size_t prng_seek(struct xorscura_prng *prng, unsigned int seed, size_t offset);
+
+// prng_batch() runs this many seeds at once, for xods of up to BATCH_MAX_COUNT bytes.
+#define BATCH_LANES	8
+#define BATCH_MAX_COUNT	1024
+
+// XORSCURA_ALG_CHACHA8 turns out CHACHA_LANES blocks of CHACHA_BLOCKLEN bytes at a time. (chacha_next() spells
+// out the lanes when it builds its input, so changing CHACHA_LANES means changing that too.)
+#define CHACHA_BLOCKLEN	64
+#define CHACHA_LANES	4
+
+// Largest chunk of keystream any algorithm hands back from one keystream_next(), in 32 bit words. That's the
+// CHACHA_LANES * CHACHA_BLOCKLEN bytes of XORSCURA_ALG_CHACHA8, which is also more than PRNG_DEG.
+#define KEYSTREAM_WORDS	XORSCURA_KEYSTREAM_WORDS
+
+// The public constants are set by hand in libxorscura.h, so make sure they still cover the algorithms. (_Static_assert
+// is C11. __extension__ keeps -pedantic quiet about it under gnu99.)
+__extension__ _Static_assert(KEYSTREAM_WORDS * 4 >= CHACHA_LANES * CHACHA_BLOCKLEN, "KEYSTREAM_WORDS is too small for CHACHA_LANES chacha blocks");
+__extension__ _Static_assert(KEYSTREAM_WORDS >= PRNG_DEG, "KEYSTREAM_WORDS is too small for a PRNG_DEG block");
+
+static int keystream_seek(struct xorscura_keystream *ks, unsigned char algorithm, unsigned int seed, size_t offset, size_t *skip);
+static size_t keystream_next(struct xorscura_keystream *ks, uint32_t *block);
+static int keystream_xor(unsigned char algorithm, unsigned int seed, size_t offset, unsigned char *dst, const unsigned char *src, size_t count);
+static int keystream_cmp(unsigned char algorithm, unsigned int seed, size_t offset, const unsigned char *plain, const unsigned char *cipher, size_t count);
+
+// A short key is repeated out to a whole number of copies, up to CYCLE_WIDE bytes, before it's run over the data.
+#define CYCLE_WIDE	(2 * XORSCURA_KEY_MAX)
+
+// Parallel mode defaults. Threads start at 1, which keeps everything on the calling thread until the caller opts in.
+#define PARALLEL_CHUNK_SIZE	(4 * 1024 * 1024)
+#define PARALLEL_THRESHOLD	(16 * 1024 * 1024)
+#define PARALLEL_THREADS_MAX	256
+
+// The largest window xorscura_decrypt_window() will put on the stack.
+#define WINDOW_MAX	(64 * 1024)
+
+// Anonymous images at least this big get aligned to it, for transparent huge pages.
+#define IMAGE_HUGE	(2 * 1024 * 1024)
+
+static int parallel_xor(unsigned char algorithm, unsigned int seed, const unsigned char *key, size_t key_count, size_t offset, unsigned char *dst, const unsigned char *src, size_t count);
+
+// Marks, next to ALLOC_PLAINTEXT and friends in alloc_flag, the buffers that came from xod->arena.
+#define ALLOC_ARENA(flag)	((flag) << 3)
+
+static unsigned char *xod_alloc(struct xod *data, size_t count, unsigned char flag);
+static void xod_free(struct xod *data, unsigned char *buf, unsigned char flag);
+
+// Per-thread stats. STATS_OP() goes last in a function's declarations. It times the function from there to whichever
+// return it leaves by, and books it as one op of count bytes. (A function that only knows its count as it goes can
+// add to stats_timer.bytes.)
+// STATS_ADD() adds to one of the calling thread's counters. Both come down to a relaxed load while stats are off.
+static int stats_enabled = 0;
+
+#define STATS_ON()	__builtin_expect(__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED), 0)
+
+struct stats_thread;
+
+struct stats_timer {
+	struct stats_thread *self;
+	int op;
+	size_t bytes;
+	uint64_t start;
+};
+
+#define STATS_OP(op, count)	struct stats_timer stats_timer __attribute__((cleanup(stats_end))) = stats_begin((op), (count))
+#define STATS_ADD(field, count)	do{ if(STATS_ON()){ stats_count(offsetof(struct xorscura_stats, field), (count)); } }while(0)
+
+static inline struct stats_timer stats_begin(int op, size_t bytes);
+static inline void stats_end(struct stats_timer *timer);
+static void stats_start(struct stats_timer *timer);
+static void stats_stop(struct stats_timer *timer);
+static void stats_count(size_t offset, uint64_t count);
+
+
+
+/**********************************************************************************************************************
+ *
+ * xor kernels
+ *
+ *	All of the bulk xor work goes through xor_bytes() and cmp_bytes(). The widest kernel the cpu supports is picked
+ *	the first time either one is called, and stays picked for the life of the process. The scalar kernels are the
+ *	fallback for everything else.
+ *
+ *	xor_bytes(dst, a, b, count) sets dst[i] = a[i] ^ b[i]. dst may be the same buffer as a or b, but it must not
+ *	partially overlap either of them.
+ *
+ *	cmp_bytes(plain, a, b, count) returns 0 if plain[i] == (a[i] ^ b[i]) for every byte, 1 otherwise. The decrypted
+ *	bytes only ever live in a register, one vector at a time, and are never written back to memory.
+ *
+ **********************************************************************************************************************/
+
+static void xor_bytes_scalar(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i;
+
+	for(i = 0; i < count; i++){
+		dst[i] = a[i] ^ b[i];
+	}
+}
+
+static int cmp_bytes_scalar(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i;
+
+	for(i = 0; i < count; i++){
+		if(plain[i] != (unsigned char) (a[i] ^ b[i])){
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void xor_bytes_sse2(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i = 0;
+	__m128i va, vb;
+
+	for(; i + 16 <= count; i += 16){
+		va = _mm_loadu_si128((const __m128i *) (a + i));
+		vb = _mm_loadu_si128((const __m128i *) (b + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(va, vb));
+	}
+
+	xor_bytes_scalar(dst + i, a + i, b + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static int cmp_bytes_sse2(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i = 0;
+	__m128i vx;
+
+	for(; i + 16 <= count; i += 16){
+		vx = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		vx = _mm_cmpeq_epi8(vx, _mm_loadu_si128((const __m128i *) (plain + i)));
+		if(_mm_movemask_epi8(vx) != 0xffff){
+			return(1);
+		}
+	}
+
+	return(cmp_bytes_scalar(plain + i, a + i, b + i, count - i));
+}
+
+__attribute__((target("avx2")))
+static void xor_bytes_avx2(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i = 0;
+	__m256i va0, va1, va2, va3;
+
+	// Four vectors per pass to keep both load ports busy.
+	for(; i + 128 <= count; i += 128){
+		va0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i)));
+		va1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i + 32)), _mm256_loadu_si256((const __m256i *) (b + i + 32)));
+		va2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i + 64)), _mm256_loadu_si256((const __m256i *) (b + i + 64)));
+		va3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i + 96)), _mm256_loadu_si256((const __m256i *) (b + i + 96)));
+		_mm256_storeu_si256((__m256i *) (dst + i), va0);
+		_mm256_storeu_si256((__m256i *) (dst + i + 32), va1);
+		_mm256_storeu_si256((__m256i *) (dst + i + 64), va2);
+		_mm256_storeu_si256((__m256i *) (dst + i + 96), va3);
+	}
+
+	for(; i + 32 <= count; i += 32){
+		va0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i)));
+		_mm256_storeu_si256((__m256i *) (dst + i), va0);
+	}
+
+	xor_bytes_scalar(dst + i, a + i, b + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static int cmp_bytes_avx2(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i = 0;
+	__m256i vx;
+
+	for(; i + 32 <= count; i += 32){
+		vx = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i)));
+		vx = _mm256_xor_si256(vx, _mm256_loadu_si256((const __m256i *) (plain + i)));
+		if(!_mm256_testz_si256(vx, vx)){
+			return(1);
+		}
+	}
+
+	return(cmp_bytes_scalar(plain + i, a + i, b + i, count - i));
+}
+
+__attribute__((target("avx512f")))
+static void xor_bytes_avx512(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i = 0;
+	__m512i va0, va1;
+
+	for(; i + 128 <= count; i += 128){
+		va0 = _mm512_xor_si512(_mm512_loadu_si512((const void *) (a + i)), _mm512_loadu_si512((const void *) (b + i)));
+		va1 = _mm512_xor_si512(_mm512_loadu_si512((const void *) (a + i + 64)), _mm512_loadu_si512((const void *) (b + i + 64)));
+		_mm512_storeu_si512((void *) (dst + i), va0);
+		_mm512_storeu_si512((void *) (dst + i + 64), va1);
+	}
+
+	for(; i + 64 <= count; i += 64){
+		va0 = _mm512_xor_si512(_mm512_loadu_si512((const void *) (a + i)), _mm512_loadu_si512((const void *) (b + i)));
+		_mm512_storeu_si512((void *) (dst + i), va0);
+	}
+
+	xor_bytes_scalar(dst + i, a + i, b + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+static int cmp_bytes_avx512(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count){
+
+	size_t i = 0;
+	__m512i vx;
+
+	for(; i + 64 <= count; i += 64){
+		vx = _mm512_xor_si512(_mm512_loadu_si512((const void *) (a + i)), _mm512_loadu_si512((const void *) (b + i)));
+		vx = _mm512_xor_si512(vx, _mm512_loadu_si512((const void *) (plain + i)));
+		if(_mm512_test_epi64_mask(vx, vx)){
+			return(1);
+		}
+	}
+
+	return(cmp_bytes_scalar(plain + i, a + i, b + i, count - i));
+}
+
+#endif
+
+static void xor_bytes_resolve(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count);
+static int cmp_bytes_resolve(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count);
+
+static void (*xor_bytes_kernel)(unsigned char *, const unsigned char *, const unsigned char *, size_t) = xor_bytes_resolve;
+static int (*cmp_bytes_kernel)(const unsigned char *, const unsigned char *, const unsigned char *, size_t) = cmp_bytes_resolve;
+static const char *kernel_name = "scalar";
+
+// Pick the widest kernels this cpu can run. Every thread that races through here stores the same answer.
+static void select_kernels(void){
+
+	void (*xor_kernel)(unsigned char *, const unsigned char *, const unsigned char *, size_t) = xor_bytes_scalar;
+	int (*cmp_kernel)(const unsigned char *, const unsigned char *, const unsigned char *, size_t) = cmp_bytes_scalar;
+	const char *name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("sse2")){
+		xor_kernel = xor_bytes_sse2;
+		cmp_kernel = cmp_bytes_sse2;
+		name = "sse2";
+	}
+
+	if(__builtin_cpu_supports("avx2")){
+		xor_kernel = xor_bytes_avx2;
+		cmp_kernel = cmp_bytes_avx2;
+		name = "avx2";
+	}
+
+	if(__builtin_cpu_supports("avx512f")){
+		xor_kernel = xor_bytes_avx512;
+		cmp_kernel = cmp_bytes_avx512;
+		name = "avx512f";
+	}
+#endif
+
+	__atomic_store_n(&kernel_name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&cmp_bytes_kernel, cmp_kernel, __ATOMIC_RELAXED);
+	__atomic_store_n(&xor_bytes_kernel, xor_kernel, __ATOMIC_RELAXED);
+}
+
+static void xor_bytes_resolve(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count){
+	select_kernels();
+	xor_bytes_kernel(dst, a, b, count);
+}
+
+static int cmp_bytes_resolve(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count){
+	select_kernels();
+	return(cmp_bytes_kernel(plain, a, b, count));
+}
+
+static inline void xor_bytes(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t count){
+	__atomic_load_n(&xor_bytes_kernel, __ATOMIC_RELAXED)(dst, a, b, count);
+}
+
+static inline int cmp_bytes(const unsigned char *plain, const unsigned char *a, const unsigned char *b, size_t count){
+	return(__atomic_load_n(&cmp_bytes_kernel, __ATOMIC_RELAXED)(plain, a, b, count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * cyclic keys
+ *
+ *	A short key (xod->key_count) is repeated over the data, so key[(offset + i) % key_count] goes with byte i. Run
+ *	over the data key_count bytes at a time, a 16 byte key would spend all of its time in call overhead. Instead the
+ *	key is broadcast out to as many whole copies as fit in CYCLE_WIDE bytes on the stack, starting from the right
+ *	phase, by doubling memcpy()s. That buffer then lines up with the data every wide_count bytes, and goes through
+ *	xor_bytes() and cmp_bytes() in full vector runs like any other key.
+ *
+ *	key_count must be from 1 to XORSCURA_KEY_MAX. The broadcast copy is wiped before returning.
+ *
+ **********************************************************************************************************************/
+
+// Fill wide with the key repeated from phase on, for min(count, a whole number of copies that fit in CYCLE_WIDE)
+// bytes. Returns how many.
+static size_t cycle_fill(unsigned char *wide, const unsigned char *key, size_t key_count, size_t phase, size_t count){
+
+	size_t wide_count;
+	size_t filled, n;
+
+
+	wide_count = CYCLE_WIDE / key_count * key_count;
+	if(wide_count > count){
+		wide_count = count;
+	}
+
+	// One copy, rotated to start at phase.
+	filled = key_count - phase < wide_count ? key_count - phase : wide_count;
+	memcpy(wide, key + phase, filled);
+	n = phase < wide_count - filled ? phase : wide_count - filled;
+	memcpy(wide + filled, key, n);
+	filled += n;
+
+	// Then double it up. filled stays a whole number of copies until the last, short, memcpy().
+	while(filled < wide_count){
+		n = filled < wide_count - filled ? filled : wide_count - filled;
+		memcpy(wide + filled, wide, n);
+		filled += n;
+	}
+
+	return(wide_count);
+}
+
+// dst = src ^ the key repeated, from byte offset of the repeat on. If src is NULL, dst gets the repeated key.
+static void cycle_xor(unsigned char *dst, const unsigned char *src, const unsigned char *key, size_t key_count, size_t offset, size_t count){
+
+	unsigned char wide[CYCLE_WIDE];
+	size_t wide_count;
+	size_t done, block_count;
+
+
+	wide_count = cycle_fill(wide, key, key_count, offset % key_count, count);
+
+	for(done = 0; done < count; done += block_count){
+		block_count = count - done < wide_count ? count - done : wide_count;
+
+		if(src){
+			xor_bytes(dst + done, src + done, wide, block_count);
+		}else{
+			memcpy(dst + done, wide, block_count);
+		}
+	}
+
+	explicit_bzero(wide, wide_count);
+}
+
+// Returns 0 if plain == cipher ^ the key repeated, from byte offset of the repeat on, 1 otherwise.
+static int cycle_cmp(const unsigned char *plain, const unsigned char *cipher, const unsigned char *key, size_t key_count, size_t offset, size_t count){
+
+	unsigned char wide[CYCLE_WIDE];
+	size_t wide_count;
+	size_t done, block_count;
+	int retval;
+
+
+	wide_count = cycle_fill(wide, key, key_count, offset % key_count, count);
+
+	retval = 0;
+	for(done = 0; !retval && done < count; done += block_count){
+		block_count = count - done < wide_count ? count - done : wide_count;
+		retval = cmp_bytes(plain + done, cipher + done, wide, block_count);
+	}
+
+	explicit_bzero(wide, wide_count);
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * keystream generator
+ *
+ *	This is a block-at-a-time reimplementation of glibc's random_r() for the state initstate_r() builds from a
+ *	PRNG_STATELEN of 256 bytes. That is the TYPE_4 additive feedback generator: 63 words of state, a separation of 1,
+ *	and 630 outputs thrown away after seeding. Every value it hands back is bit-identical to the matching random_r()
+ *	call, so seeds and ciphertexts from older builds keep working.
+ *
+ *	Treating the sequence of state words as y[], each new word is:
+ *
+ *		y[k] = y[k - 63] + y[k - 1]	(mod 2^32)
+ *
+ *	and random_r() returns y[k] >> 1. Since the lag is exactly the state length, the next 63 words can be built
+ *	in place over the last 63 with a single running sum, and the 630 discarded outputs are exactly 10 such blocks.
+ *
+ **********************************************************************************************************************/
+
+// 16807^i mod (2^31 - 1), for i = 1 .. PRNG_DEG - 1.
+static const uint32_t prng_powers[PRNG_DEG - 1] = {
+	     16807,  282475249, 1622650073,  984943658, 1144108930,  470211272,
+	 101027544, 1457850878, 1458777923, 2007237709,  823564440, 1115438165,
+	1784484492,   74243042,  114807987, 1137522503, 1441282327,   16531729,
+	 823378840,  143542612,  896544303, 1474833169, 1264817709, 1998097157,
+	1817129560, 1131570933,  197493099, 1404280278,  893351816, 1505795335,
+	1954899097, 1636807826,  563613512,  101929267, 1580723810,  704877633,
+	1358580979, 1624379149, 2128236579,  784558821,  530511967, 2110010672,
+	1551901393, 1617819336, 1399125485,  156091745, 1356425228, 1899894091,
+	 585640194,  937186357, 1646035001, 1025921153,  510616708,  590357944,
+	 771515668,  357571490, 1044788124, 1927702196, 1952509530,  130060903,
+	1942727722, 1083454666
+};
+
+// a * b mod (2^31 - 1), for a and b under 2^31. Branch free, so a loop of them vectorizes.
+static inline uint32_t prng_mulmod(uint32_t a, uint32_t b){
+
+	uint64_t product = (uint64_t) a * b;
+	uint32_t sum;
+
+	// Fold the high bits down twice (2^31 = 1), leaving at most PRNG_MODULUS + 1, then take out the last PRNG_MODULUS
+	// if it's there.
+	sum = (uint32_t) (product & PRNG_MODULUS) + (uint32_t) (product >> 31);
+	sum = (sum & PRNG_MODULUS) + (sum >> 31);
+
+	return((sum + ((sum + 1) >> 31)) & PRNG_MODULUS);
+}
+
+// Load window with the state srandom_r() builds from seed, before any outputs are discarded.
+static void prng_fill(uint32_t *window, unsigned int seed){
+
+	int64_t residue;
+	int i;
+
+
+	// srandom_r() fills the state with Park-Miller steps, word = 16807 * word mod (2^31 - 1), using Schrage's method
+	// on the int32 value of the seed. That lands on the true residue even for negative seeds, so word i is just the
+	// seed times 16807^i. No step waits on the one before it.
+	if(!seed){
+		seed = 1;
+	}
+
+	residue = (int32_t) seed % (int64_t) PRNG_MODULUS;
+	if(residue < 0){
+		residue += PRNG_MODULUS;
+	}
+
+	// srandom_r() starts its front pointer at state[1] and its rear pointer at state[0]. Laid out oldest first,
+	// that makes the window state[1] .. state[62], state[0]. state[0] is the seed itself, unreduced.
+	for(i = 0; i < PRNG_DEG - 1; i++){
+		window[i] = prng_mulmod((uint32_t) residue, prng_powers[i]);
+	}
+	window[PRNG_DEG - 1] = seed;
+}
+
+static void prng_seed(struct xorscura_prng *prng, unsigned int seed){
+
+	int i;
+
+
+	prng_fill(prng->window, seed);
+
+	STATS_ADD(prng_words, PRNG_DISCARD);
+	for(i = 0; i < PRNG_DISCARD / PRNG_DEG; i++){
+		prng_next(prng, NULL);
+	}
+}
+
+// Advance the generator by PRNG_DEG words. If block isn't NULL, it gets the matching random_r() results.
+static void prng_next(struct xorscura_prng *prng, uint32_t *block){
+
+	uint32_t prev;
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i carry, x;
+
+
+	// Four words at a time: a two step prefix sum inside the vector, plus the carry from the last word written.
+	carry = _mm_set1_epi32((int) prng->window[PRNG_DEG - 1]);
+	for(; i + 4 <= PRNG_DEG; i += 4){
+		x = _mm_loadu_si128((const __m128i *) (prng->window + i));
+		x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi32(x, carry);
+		_mm_storeu_si128((__m128i *) (prng->window + i), x);
+		if(block){
+			_mm_storeu_si128((__m128i *) (block + i), _mm_srli_epi32(x, 1));
+		}
+		carry = _mm_shuffle_epi32(x, 0xff);
+	}
+	prev = (uint32_t) _mm_cvtsi128_si32(carry);
+#else
+	prev = prng->window[PRNG_DEG - 1];
+#endif
+
+	for(; i < PRNG_DEG; i++){
+		prev += prng->window[i];
+		prng->window[i] = prev;
+		if(block){
+			block[i] = prev >> 1;
+		}
+	}
+}
+
+/**********************************************************************************************************************
+ *
+ * keystream batches
+ *
+ *	Short strings spend nearly all of their time in prng_seed(), and most of that is the 630 discarded outputs: a
+ *	chain of dependent adds that a single seed can't spread out. A batch runs BATCH_LANES seeds side by side
+ *	instead, one seed per vector lane, so each add in that chain advances every seed in the batch at once.
+ *
+ **********************************************************************************************************************/
+
+// The lanes live in BATCH_VECS vectors of four. Keeping each vector's running sum separate gives every step of the
+// chain BATCH_VECS independent adds, and four lanes fit the sse2 registers the library is built for.
+#define BATCH_VEC_LANES	4
+#define BATCH_VECS	(BATCH_LANES / BATCH_VEC_LANES)
+
+typedef uint32_t batch_vec __attribute__((vector_size(BATCH_VEC_LANES * sizeof(uint32_t))));
+
+// One xod's share of a batch. Decrypts set out, compares set plain and get diff back.
+struct batch_lane {
+
+	unsigned int seed;
+	const unsigned char *cipher;
+	size_t count;
+
+	unsigned char *out;
+
+	const unsigned char *plain;
+	int diff;
+
+	size_t index;
+};
+
+// Run the random_r keystream for each lane over its ciphertext. lane_count is at most BATCH_LANES, and no lane has
+// more than BATCH_MAX_COUNT bytes.
+static void prng_batch(struct batch_lane *lanes, size_t lane_count){
+
+	uint32_t fill[BATCH_LANES][PRNG_DEG];
+	uint32_t key[BATCH_MAX_COUNT / sizeof(uint32_t)][BATCH_LANES];
+
+	batch_vec window[PRNG_DEG][BATCH_VECS];
+	batch_vec prev[BATCH_VECS];
+
+	size_t word_count;
+	size_t full;
+	size_t i, j, v, w;
+	uint32_t word, in, diff;
+	unsigned char byte;
+	int k;
+
+
+	word_count = 0;
+	for(j = 0; j < lane_count; j++){
+		prng_fill(fill[j], lanes[j].seed);
+		if(lanes[j].count > word_count * sizeof(uint32_t)){
+			word_count = (lanes[j].count + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		}
+	}
+
+	// Lanes past lane_count just run on zeros.
+	for(; j < BATCH_LANES; j++){
+		memset(fill[j], 0, sizeof(fill[j]));
+	}
+
+	for(i = 0; i < PRNG_DEG; i++){
+		for(j = 0; j < BATCH_LANES; j++){
+			window[i][j / BATCH_VEC_LANES][j % BATCH_VEC_LANES] = fill[j][i];
+		}
+	}
+
+	STATS_ADD(prng_words, lane_count * (PRNG_DISCARD + word_count));
+
+	// The same running sum as prng_next(), a lane per seed.
+	for(v = 0; v < BATCH_VECS; v++){
+		prev[v] = window[PRNG_DEG - 1][v];
+	}
+
+	for(k = 0; k < PRNG_DISCARD / PRNG_DEG; k++){
+		for(i = 0; i < PRNG_DEG; i++){
+			for(v = 0; v < BATCH_VECS; v++){
+				prev[v] += window[i][v];
+				window[i][v] = prev[v];
+			}
+		}
+	}
+
+	for(w = 0, i = 0; w < word_count; w++){
+		for(v = 0; v < BATCH_VECS; v++){
+			prev[v] += window[i][v];
+			window[i][v] = prev[v];
+		}
+		memcpy(key[w], prev, sizeof(key[w]));
+
+		if(++i == PRNG_DEG){
+			i = 0;
+		}
+	}
+
+	// Then back out to each lane's bytes. key[w][j] >> 1 is the w'th random_r() result for lane j.
+	for(j = 0; j < lane_count; j++){
+		full = lanes[j].count / sizeof(uint32_t);
+		diff = 0;
+
+		for(w = 0; w < full; w++){
+			word = key[w][j] >> 1;
+			memcpy(&in, lanes[j].cipher + w * sizeof(uint32_t), sizeof(uint32_t));
+			in ^= word;
+
+			if(lanes[j].out){
+				memcpy(lanes[j].out + w * sizeof(uint32_t), &in, sizeof(uint32_t));
+			}else{
+				memcpy(&word, lanes[j].plain + w * sizeof(uint32_t), sizeof(uint32_t));
+				diff |= word ^ in;
+			}
+		}
+
+		word = full < word_count ? key[full][j] >> 1 : 0;
+		for(i = full * sizeof(uint32_t); i < lanes[j].count; i++){
+			byte = lanes[j].cipher[i] ^ ((unsigned char *) &word)[i % sizeof(uint32_t)];
+
+			if(lanes[j].out){
+				lanes[j].out[i] = byte;
+			}else{
+				diff |= byte ^ lanes[j].plain[i];
+			}
+		}
+
+		lanes[j].diff = diff != 0;
+	}
+}
+
+/**********************************************************************************************************************
+ *
+ * keystream jump ahead
+ *
+ *	The recurrence is linear, so it can be run forward n words without producing the words in between. With
+ *
+ *		x^n = c[0] + c[1] x + ... + c[62] x^62	(mod x^63 - x^62 - 1, coefficients mod 2^32)
+ *
+ *	we get y[m + n] = c[0] y[m] + ... + c[62] y[m + 62] for any m. x^n comes from square and multiply, so a jump
+ *	costs O(log n) polynomial products no matter how far into the keystream it lands.
+ *
+ **********************************************************************************************************************/
+
+// r = a * b, reduced. r may be the same as a or b.
+static void poly_mulmod(uint32_t *r, const uint32_t *a, const uint32_t *b){
+
+	uint32_t t[2 * PRNG_DEG - 1];
+	int i, j;
+
+
+	memset(t, 0, sizeof(t));
+	for(i = 0; i < PRNG_DEG; i++){
+		for(j = 0; j < PRNG_DEG; j++){
+			t[i + j] += a[i] * b[j];
+		}
+	}
+
+	// x^d = x^(d - 1) + x^(d - 63), working down from the top.
+	for(i = 2 * PRNG_DEG - 2; i >= PRNG_DEG; i--){
+		t[i - 1] += t[i];
+		t[i - PRNG_DEG] += t[i];
+	}
+
+	memcpy(r, t, PRNG_DEG * sizeof(uint32_t));
+}
+
+// Run the generator forward by words without producing them.
+static void prng_jump(struct xorscura_prng *prng, uint64_t words){
+
+	uint32_t poly[PRNG_DEG];
+	uint32_t span[2 * PRNG_DEG];
+	uint32_t top, sum;
+	int bit, i, j;
+
+	struct xorscura_prng tmp;
+
+
+	// poly = x^words
+	memset(poly, 0, sizeof(poly));
+	poly[0] = 1;
+
+	// Squaring 1 gets us nowhere, so start at the top set bit.
+	for(bit = 63; bit >= 0 && !((words >> bit) & 1); bit--){
+	}
+
+	for(; bit >= 0; bit--){
+		poly_mulmod(poly, poly, poly);
+
+		if((words >> bit) & 1){
+			top = poly[PRNG_DEG - 1];
+			memmove(poly + 1, poly, (PRNG_DEG - 1) * sizeof(uint32_t));
+			poly[0] = top;
+			poly[PRNG_DEG - 1] += top;
+		}
+	}
+
+	// The new window needs y[m] .. y[m + 125], which is the current window and the block after it.
+	tmp = *prng;
+	prng_next(&tmp, NULL);
+	memcpy(span, prng->window, PRNG_DEG * sizeof(uint32_t));
+	memcpy(span + PRNG_DEG, tmp.window, PRNG_DEG * sizeof(uint32_t));
+
+	for(j = 0; j < PRNG_DEG; j++){
+		sum = 0;
+		for(i = 0; i < PRNG_DEG; i++){
+			sum += poly[i] * span[i + j];
+		}
+		prng->window[j] = sum;
+	}
+}
+
+// Seed the generator and position it so the next prng_next() returns the block holding keystream byte offset.
+// Returns how far into that block offset is.
+static size_t prng_seek(struct xorscura_prng *prng, unsigned int seed, size_t offset){
+
+	size_t blocks = offset / PRNG_BLOCKLEN;
+
+
+	prng_seed(prng, seed);
+
+	if(blocks > PRNG_JUMP_BLOCKS){
+		prng_jump(prng, (uint64_t) blocks * PRNG_DEG);
+	}else{
+		STATS_ADD(prng_words, blocks * PRNG_DEG);
+		while(blocks--){
+			prng_next(prng, NULL);
+		}
+	}
+
+	return(offset % PRNG_BLOCKLEN);
+}
+
+
+
+
+/**********************************************************************************************************************
+ *
+ * XORSCURA_ALG_CHACHA8
+ *
+ *	A counter based keystream: the ChaCha block function cut down to 8 rounds, keyed with the seed, with the 64 bit
+ *	block number as the counter. Any block can be computed on its own, so seeking is O(1) and chunks of a buffer can
+ *	be worked on independently. CHACHA_LANES blocks are computed side by side, one block per vector lane.
+ *
+ *	The output words are stored in host byte order, same as the random_r() keystream.
+ *
+ **********************************************************************************************************************/
+
+typedef uint32_t chacha_vec __attribute__((vector_size(CHACHA_LANES * sizeof(uint32_t))));
+
+#define CHACHA_ROTL(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA_QUARTER(a, b, c, d) do { \
+	a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+	c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+	a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+	c += d; b ^= c; b = CHACHA_ROTL(b, 7); \
+} while(0)
+
+// Fill block with CHACHA_LANES consecutive keystream blocks, starting with block number counter.
+static void chacha_next(unsigned int seed, uint64_t counter, uint32_t *block){
+
+	chacha_vec in[16];
+	chacha_vec x[16];
+	uint32_t lanes[16][CHACHA_LANES];
+	int i, j;
+
+
+	// "expand 32-byte k", then the key (the seed followed by zeros), then the block number, then a zero nonce.
+	// Built as whole vectors so the compiler can keep them in registers.
+	in[0] = (chacha_vec) {0x61707865, 0x61707865, 0x61707865, 0x61707865};
+	in[1] = (chacha_vec) {0x3320646e, 0x3320646e, 0x3320646e, 0x3320646e};
+	in[2] = (chacha_vec) {0x79622d32, 0x79622d32, 0x79622d32, 0x79622d32};
+	in[3] = (chacha_vec) {0x6b206574, 0x6b206574, 0x6b206574, 0x6b206574};
+	in[4] = (chacha_vec) {seed, seed, seed, seed};
+	for(i = 5; i < 12; i++){
+		in[i] = (chacha_vec) {0, 0, 0, 0};
+	}
+	in[12] = (chacha_vec) {(uint32_t) counter, (uint32_t) (counter + 1), (uint32_t) (counter + 2), (uint32_t) (counter + 3)};
+	in[13] = (chacha_vec) {(uint32_t) (counter >> 32), (uint32_t) ((counter + 1) >> 32), (uint32_t) ((counter + 2) >> 32), (uint32_t) ((counter + 3) >> 32)};
+	in[14] = (chacha_vec) {0, 0, 0, 0};
+	in[15] = (chacha_vec) {0, 0, 0, 0};
+
+	memcpy(x, in, sizeof(x));
+
+	for(i = 0; i < 8; i += 2){
+		CHACHA_QUARTER(x[0], x[4], x[8], x[12]);
+		CHACHA_QUARTER(x[1], x[5], x[9], x[13]);
+		CHACHA_QUARTER(x[2], x[6], x[10], x[14]);
+		CHACHA_QUARTER(x[3], x[7], x[11], x[15]);
+		CHACHA_QUARTER(x[0], x[5], x[10], x[15]);
+		CHACHA_QUARTER(x[1], x[6], x[11], x[12]);
+		CHACHA_QUARTER(x[2], x[7], x[8], x[13]);
+		CHACHA_QUARTER(x[3], x[4], x[9], x[14]);
+	}
+
+	// Lane j holds word i of block j.
+	for(i = 0; i < 16; i++){
+		x[i] += in[i];
+		memcpy(lanes[i], &(x[i]), sizeof(lanes[i]));
+	}
+
+	for(i = 0; i < 16; i++){
+		for(j = 0; j < CHACHA_LANES; j++){
+			block[j * 16 + i] = lanes[i][j];
+		}
+	}
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * keystream
+ *
+ *	The algorithm neutral layer over prng_*() and chacha_next(). Everything above this point deals in the algorithm's
+ *	own block sizes. Everything below it just asks for keystream bytes [offset, offset + count) of a given
+ *	(algorithm, seed) pair.
+ *
+ **********************************************************************************************************************/
+
+// Set up ks so the next keystream_next() returns the chunk holding keystream byte offset. *skip is set to how far
+// into that chunk offset is. Returns 0 on success, -1 (EINVAL) if the algorithm is unknown.
+static int keystream_seek(struct xorscura_keystream *ks, unsigned char algorithm, unsigned int seed, size_t offset, size_t *skip){
+
+	switch(algorithm){
+
+		case XORSCURA_ALG_RANDOM_R:
+			*skip = prng_seek(&(ks->prng), seed, offset);
+			break;
+
+		case XORSCURA_ALG_CHACHA8:
+			ks->counter = offset / CHACHA_BLOCKLEN;
+			*skip = offset % CHACHA_BLOCKLEN;
+			break;
+
+		default:
+#ifdef DEBUG
+			fprintf(stderr, "keystream_seek(): Unknown algorithm %d!\n", (int) algorithm);
+#endif
+			errno = EINVAL;
+			return(-1);
+	}
+
+	ks->algorithm = algorithm;
+	ks->seed = seed;
+
+	return(0);
+}
+
+// Fill block with the next chunk of keystream. Returns the chunk length in bytes. (At most KEYSTREAM_WORDS words.)
+static size_t keystream_next(struct xorscura_keystream *ks, uint32_t *block){
+
+	if(ks->algorithm == XORSCURA_ALG_CHACHA8){
+		STATS_ADD(prng_words, CHACHA_LANES * CHACHA_BLOCKLEN / sizeof(uint32_t));
+		chacha_next(ks->seed, ks->counter, block);
+		ks->counter += CHACHA_LANES;
+		return(CHACHA_LANES * CHACHA_BLOCKLEN);
+	}
+
+	STATS_ADD(prng_words, PRNG_DEG);
+	prng_next(&(ks->prng), block);
+	return(PRNG_BLOCKLEN);
+}
+
+// dst = src ^ keystream, for keystream bytes [offset, offset + count). If src is NULL, dst gets the raw keystream.
+// Returns 0 on success, -1 on error.
+static int keystream_xor(unsigned char algorithm, unsigned int seed, size_t offset, unsigned char *dst, const unsigned char *src, size_t count){
+
+	size_t skip;
+	size_t done;
+	size_t block_count;
+
+	struct xorscura_keystream ks;
+	uint32_t block[KEYSTREAM_WORDS];
+
+
+	if(keystream_seek(&ks, algorithm, seed, offset, &skip) == -1){
+		return(-1);
+	}
+
+	done = 0;
+	while(done < count){
+		block_count = keystream_next(&ks, block) - skip;
+		if(block_count > count - done){
+			block_count = count - done;
+		}
+
+		if(src){
+			xor_bytes(dst + done, src + done, (unsigned char *) block + skip, block_count);
+		}else{
+			memcpy(dst + done, (unsigned char *) block + skip, block_count);
+		}
+
+		done += block_count;
+		skip = 0;
+	}
+
+	return(0);
+}
+
+// Returns 0 if plain == cipher ^ keystream for keystream bytes [offset, offset + count), 1 otherwise, -1 on error.
+static int keystream_cmp(unsigned char algorithm, unsigned int seed, size_t offset, const unsigned char *plain, const unsigned char *cipher, size_t count){
+
+	size_t skip;
+	size_t done;
+	size_t block_count;
+
+	struct xorscura_keystream ks;
+	uint32_t block[KEYSTREAM_WORDS];
+
+
+	if(keystream_seek(&ks, algorithm, seed, offset, &skip) == -1){
+		return(-1);
+	}
+
+	done = 0;
+	while(done < count){
+		block_count = keystream_next(&ks, block) - skip;
+		if(block_count > count - done){
+			block_count = count - done;
+		}
+
+		if(cmp_bytes(plain + done, cipher + done, (unsigned char *) block + skip, block_count)){
+			return(1);
+		}
+
+		done += block_count;
+		skip = 0;
+	}
+
+	return(0);
+}
+
+// Returns 0 if plain == cipher ^ key, 1 otherwise, -1 on error. The key is key, or the keystream for (algorithm, seed)
+// if key is NULL. If key_count is set, only its first key_count bytes are used, repeated. (See cycle_cmp().)
+static int key_cmp(unsigned char algorithm, unsigned int seed, const unsigned char *key, size_t key_count, const unsigned char *plain, const unsigned char *cipher, size_t count){
+
+	unsigned char cycle[XORSCURA_KEY_MAX];
+	int retval;
+
+
+	if(!key_count){
+		return(key ? cmp_bytes(plain, cipher, key, count) : keystream_cmp(algorithm, seed, 0, plain, cipher, count));
+	}
+
+	if(key_count > XORSCURA_KEY_MAX){
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if(key){
+		return(cycle_cmp(plain, cipher, key, key_count, 0, count));
+	}
+
+	if(keystream_xor(algorithm, seed, 0, cycle, NULL, key_count) == -1){
+		return(-1);
+	}
+	retval = cycle_cmp(plain, cipher, cycle, key_count, 0, count);
+	explicit_bzero(cycle, key_count);
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * parallel
+ *
+ *	Large buffers can be split across threads. The buffer is cut into chunk_size pieces and each thread takes one
+ *	contiguous run of them, the calling thread included. In seed mode every thread seeks its own keystream straight
+ *	to the start of its run (a jump for random_r, a counter for chacha8) so no thread waits on another's prng.
+ *
+ *	Parallel mode is off until xorscura_parallel_set() turns it on. Buffers under the threshold always stay on the
+ *	calling thread, where starting threads would cost more than it saves.
+ *
+ **********************************************************************************************************************/
+
+struct parallel_job {
+
+	unsigned char algorithm;
+	unsigned int seed;
+
+	// key_buf mode if key is set, otherwise the keystream for (algorithm, seed). Either way, starting at offset. A
+	// key_count means key is that long, and repeats.
+	const unsigned char *key;
+	size_t key_count;
+	size_t offset;
+
+	unsigned char *dst;
+	const unsigned char *src;
+	size_t count;
+
+	int retval;
+};
+
+static unsigned int parallel_threads = 1;
+static size_t parallel_chunk_size = PARALLEL_CHUNK_SIZE;
+static size_t parallel_threshold = PARALLEL_THRESHOLD;
+
+static int parallel_run(struct parallel_job *job){
+
+	if(job->key && job->key_count){
+		cycle_xor(job->dst, job->src, job->key, job->key_count, job->offset, job->count);
+		return(0);
+	}
+
+	if(job->key){
+		xor_bytes(job->dst, job->src, job->key + job->offset, job->count);
+		return(0);
+	}
+
+	return(keystream_xor(job->algorithm, job->seed, job->offset, job->dst, job->src, job->count));
+}
+
+static void *parallel_worker(void *arg){
+
+	struct parallel_job *job = (struct parallel_job *) arg;
+
+	job->retval = parallel_run(job);
+
+	return(NULL);
+}
+
+// keystream_xor(), or a key_buf xor if key is set, spread over the configured number of threads. dst and src start
+// at keystream byte offset, key at byte 0. With a key_count, the key is repeated every key_count bytes, and comes
+// from the start of the keystream if key isn't set. Returns 0 on success, -1 on error.
+static int parallel_xor(unsigned char algorithm, unsigned int seed, const unsigned char *key, size_t key_count, size_t offset, unsigned char *dst, const unsigned char *src, size_t count){
+
+	struct parallel_job jobs[PARALLEL_THREADS_MAX];
+	pthread_t tids[PARALLEL_THREADS_MAX];
+	int started[PARALLEL_THREADS_MAX];
+	unsigned char cycle[XORSCURA_KEY_MAX];
+
+	size_t threads;
+	size_t chunk_size;
+	size_t chunk_count;
+	size_t start, end;
+	size_t i;
+	long cpus;
+	int retval;
+
+
+	threads = __atomic_load_n(&parallel_threads, __ATOMIC_RELAXED);
+	chunk_size = __atomic_load_n(&parallel_chunk_size, __ATOMIC_RELAXED);
+
+	if(!threads){
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (size_t) cpus : 1;
+	}
+	if(threads > PARALLEL_THREADS_MAX){
+		threads = PARALLEL_THREADS_MAX;
+	}
+
+	chunk_count = count / chunk_size + (count % chunk_size != 0);
+	if(threads > chunk_count){
+		threads = chunk_count;
+	}
+
+	if(key_count > XORSCURA_KEY_MAX){
+#ifdef DEBUG
+		fprintf(stderr, "parallel_xor(): key_count %lu is over XORSCURA_KEY_MAX!\n", (unsigned long) key_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	// A short key from the seed is made once, up front, for every job to share.
+	if(key_count && !key){
+		if(keystream_xor(algorithm, seed, 0, cycle, NULL, key_count) == -1){
+			return(-1);
+		}
+		key = cycle;
+	}
+
+	jobs[0].algorithm = algorithm;
+	jobs[0].seed = seed;
+	jobs[0].key = key;
+	jobs[0].key_count = key_count;
+	jobs[0].offset = offset;
+	jobs[0].dst = dst;
+	jobs[0].src = src;
+	jobs[0].count = count;
+
+	if(threads < 2 || count < __atomic_load_n(&parallel_threshold, __ATOMIC_RELAXED)){
+		retval = parallel_run(jobs);
+		goto CLEANUP;
+	}
+
+	// Deal the chunks out as evenly as they'll go. The last chunk may be short.
+	for(i = 0; i < threads; i++){
+		start = chunk_count * i / threads * chunk_size;
+		end = chunk_count * (i + 1) / threads * chunk_size;
+		if(end > count){
+			end = count;
+		}
+
+		jobs[i] = jobs[0];
+		jobs[i].offset = offset + start;
+		jobs[i].dst = dst + start;
+		jobs[i].src = src ? src + start : NULL;
+		jobs[i].count = end - start;
+		jobs[i].retval = 0;
+	}
+
+	// Job 0 is ours. If a thread won't start, we take its job on as well.
+	for(i = 1; i < threads; i++){
+		if(!(started[i] = !pthread_create(tids + i, NULL, parallel_worker, jobs + i))){
+#ifdef DEBUG
+			fprintf(stderr, "parallel_xor(): pthread_create() failed. Running job %lu here.\n", (unsigned long) i);
+#endif
+		}
+	}
+
+	retval = parallel_run(jobs);
+
+	for(i = 1; i < threads; i++){
+		if(started[i]){
+			pthread_join(tids[i], NULL);
+		}else{
+			jobs[i].retval = parallel_run(jobs + i);
+		}
+
+		if(jobs[i].retval == -1){
+			retval = -1;
+		}
+	}
+
+CLEANUP:
+	if(key == cycle){
+		explicit_bzero(cycle, key_count);
+	}
+
+	return(retval);
+}
+
+
+
+// Fill buf with count bytes straight from /dev/urandom. Returns 0 on success, -1 on error.
+static int urandom_read(unsigned char *buf, size_t count){
+
+	size_t read_count;
+
+	ssize_t retval;
+	int tmp_fd;
+
+
+	if((tmp_fd = open("/dev/urandom", O_RDONLY)) == -1){
+#ifdef DEBUG
+		fprintf(stderr, "urandom_read(): open(\"/dev/urandom\")\n");
+#endif
+		return(-1);
+	}
+
+	read_count = 0;
+	while(read_count < count){
+		if((retval = read(tmp_fd, buf + read_count, count - read_count)) <= 0){
+#ifdef DEBUG
+			fprintf(stderr, "urandom_read(): read(%d, 0x%lx, %d)\n", tmp_fd, (unsigned long) (buf + read_count), (int) (count - read_count));
+#endif
+			close(tmp_fd);
+			return(-1);
+		}
+		read_count += retval;
+	}
+	close(tmp_fd);
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_seed()
+ *
+ *	Input: A pointer to the xod data structure.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->seed will have a fresh prng seed, straight from /dev/urandom.
+ *
+ *	Purpose: Pick the seed for a new encryption. xorscura_encrypt() calls this itself. Call it directly when setting
+ *	up a stream for encryption.
+ *
+ **********************************************************************************************************************/
+int xorscura_seed(struct xod *data){
+
+	return(urandom_read((unsigned char *) &(data->seed), sizeof(data->seed)));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_encrypt()
+ *
+ *	Input: A pointer to the xod data structure.
+ *		xod->plaintext_buf should have a pointer to the data to encrypt.
+ *		xod->buf_count should contain the number of bytes in xod->plaintext_buf.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->ciphertext_buf will have a pointer to the ciphertext data.
+ *		xod->key will have a pointer to the key data.
+ *		xod->seed will have the prng seed to generate the key.
+ *
+ *	Note: xod->algorithm picks the keystream the seed drives. Leave it 0 (XORSCURA_ALG_RANDOM_R) for the classic
+ *	random_r() keystream.
+ *
+ *	Purpose: Encrypt the data pointed to in the plaintext_buf buffer.
+ *
+ **********************************************************************************************************************/
+int xorscura_encrypt(struct xod *data){
+
+	size_t key_count;
+	STATS_OP(XORSCURA_STATS_ENCRYPT, data ? data->buf_count : 0);
+
+
+	if(!data){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_encrypt(): No data!\n");
+#endif
+		return(-1);
+	}
+
+	if(data->key_count > XORSCURA_KEY_MAX){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_encrypt(): key_count %lu is over XORSCURA_KEY_MAX!\n", (unsigned long) data->key_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	// Initialize prng seed straight from urandom.
+	if(xorscura_seed(data) == -1){
+		return(-1);
+	}
+
+	// Initialize the buffers we plan to fill.
+	if((data->ciphertext_buf = xod_alloc(data, data->buf_count, ALLOC_CIPHERTEXT)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_encrypt(): xod_alloc(%lx, %d, ALLOC_CIPHERTEXT)\n", (unsigned long) data, (int) data->buf_count);
+#endif
+		return(-1);
+	}
+
+	// A short key is only key_count bytes, however long the data.
+	key_count = data->key_count ? data->key_count : data->buf_count;
+
+  if((data->key_buf = xod_alloc(data, key_count, ALLOC_KEY)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_encrypt(): xod_alloc(%lx, %d, ALLOC_KEY)\n", (unsigned long) data, (int) key_count);
+#endif
+    return(-1);
+  }
+
+	// Fill the key from the prng.
+	if(parallel_xor(data->algorithm, data->seed, NULL, 0, 0, data->key_buf, NULL, key_count) == -1){
+		return(-1);
+	}
+
+	// Create the cipher.
+	parallel_xor(data->algorithm, data->seed, data->key_buf, data->key_count, 0, data->ciphertext_buf, data->plaintext_buf, data->buf_count);
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt()
+ *
+ *	Input: A pointer to the xod data structure.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
+ *		xod->key should have a pointer to the key data *OR*
+ *		xod->seed should have the prng seed needed to generate the key.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->plaintext_buf will have a pointer to the unencrypted data.
+ *
+ *	Purpose: Decrypt the data pointed to in the ciphertext_buf buffer.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt(struct xod *data){
+
+	STATS_OP(XORSCURA_STATS_DECRYPT, data->buf_count);
+
+
+	// Check if we have the prng case, or straight xor of arrays.
+	if(!data->key_buf){
+		return(xorscura_decrypt_prng(data));
+	}
+
+	// Making the plaintext buf one char bigger because the common case will be a string. This allows for implicit null termination.
+	// As a result, most of the string functions should work fine against the resulting plaintext.
+	if((data->plaintext_buf = xod_alloc(data, data->buf_count + 1, ALLOC_PLAINTEXT)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt(): xod_alloc(%lx, %d, ALLOC_PLAINTEXT)\n", (unsigned long) data, (int) data->buf_count + 1);
+#endif
+		return(-1);
+	}
+
+	// Decrypt.
+	if(parallel_xor(data->algorithm, data->seed, data->key_buf, data->key_count, 0, data->plaintext_buf, data->ciphertext_buf, data->buf_count) == -1){
+		return(-1);
+	}
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_prng()
+ *
+ *	Input: A pointer to the xod data structure.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
+ *		xod->seed should have the prng seed needed to generate the key.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->plaintext_buf will have a pointer to the unencrypted data.
+ *
+ *	Purpose: Decrypt the data pointed to in the ciphertext_buf buffer.
+ *
+ *	Note: This function is called inside of xorscura_decrypt_prng() after a seed check. There shouldn't be any reason
+ *	to call this directly, unless you know what you're doing.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_prng(struct xod *data){
+
+	STATS_OP(XORSCURA_STATS_DECRYPT, data->buf_count);
+
+
+	// Initialize plaintext buffer. Again, +1 to cover the general case of it being a string, allowing for string
+	// functions to be called directly on the buf by the caller.	
+	if((data->plaintext_buf = xod_alloc(data, data->buf_count + 1, ALLOC_PLAINTEXT)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_prng(): xod_alloc(%lx, %d, ALLOC_PLAINTEXT)\n", (unsigned long) data, (int) data->buf_count + 1);
+#endif
+		return(-1);
+	}
+
+	// Run the keystream over the ciphertext, into the plaintext.
+	if(parallel_xor(data->algorithm, data->seed, NULL, data->key_count, 0, data->plaintext_buf, data->ciphertext_buf, data->buf_count) == -1){
+		return(-1);
+	}
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_range()
+ *
+ *	Input: A pointer to the xod data structure, plus the offset and count of the bytes wanted.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
+ *		xod->key should have a pointer to the key data *OR*
+ *		xod->seed should have the prng seed needed to generate the key.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->plaintext_buf will have a pointer to the unencrypted bytes [offset, offset + count), plus a null
+ *		terminator. Note that this is count bytes long, not buf_count.
+ *
+ *	Purpose: Decrypt just a piece of a larger ciphertext.
+ *
+ *	Note: In the seed case, the keystream jumps straight to offset rather than generating everything before it. The
+ *	cost of getting there grows with log(offset), so pulling the last kilobyte out of a large blob is cheap.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_range(struct xod *data, size_t offset, size_t count){
+
+	unsigned char *tmp_buf;
+	STATS_OP(XORSCURA_STATS_DECRYPT, count);
+
+
+	if(offset > data->buf_count || count > data->buf_count - offset){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_range(): Range [%lu, %lu) is past buf_count %lu!\n", (unsigned long) offset, (unsigned long) (offset + count), (unsigned long) data->buf_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if((tmp_buf = xod_alloc(data, count + 1, ALLOC_PLAINTEXT)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_range(): xod_alloc(%lx, %d, ALLOC_PLAINTEXT)\n", (unsigned long) data, (int) count + 1);
+#endif
+		return(-1);
+	}
+
+	if(xorscura_decrypt_range_into(data, offset, count, tmp_buf) == -1){
+		xod_free(data, tmp_buf, ALLOC_PLAINTEXT);
+		return(-1);
+	}
+
+	data->plaintext_buf = tmp_buf;
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_range_into()
+ *
+ *	Input: A pointer to the xod data structure, the offset and count of the bytes wanted, and an output buffer.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
+ *		xod->key should have a pointer to the key data *OR*
+ *		xod->seed should have the prng seed needed to generate the key.
+ *		out should have room for count bytes.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		out will hold the unencrypted bytes [offset, offset + count). No null terminator is added.
+ *
+ *	Purpose: Decrypt without allocating anything. The xod is left untouched, and the keystream state lives on the
+ *	stack, so this is safe to call on the same xod from several threads at once.
+ *
+ *	Note: out may be ciphertext_buf + offset itself, which decrypts that range in place.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_range_into(struct xod *data, size_t offset, size_t count, unsigned char *out){
+
+	STATS_OP(XORSCURA_STATS_DECRYPT, count);
+
+
+	if(offset > data->buf_count || count > data->buf_count - offset){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_range_into(): Range [%lu, %lu) is past buf_count %lu!\n", (unsigned long) offset, (unsigned long) (offset + count), (unsigned long) data->buf_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	return(parallel_xor(data->algorithm, data->seed, data->key_buf, data->key_count, offset, out, data->ciphertext_buf + offset, count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_into()
+ *
+ *	Input: A pointer to the xod data structure, and an output buffer with room for xod->buf_count bytes.
+ *		(Same xod requirements as xorscura_decrypt().)
+ *
+ *	Output: 0 on success, -1 on error.
+ *		out will hold the unencrypted data. No null terminator is added, so size out at buf_count + 1 and
+ *		terminate it yourself if you want a string.
+ *
+ *	Purpose: xorscura_decrypt() without the calloc(). See xorscura_decrypt_range_into().
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_into(struct xod *data, unsigned char *out){
+
+	return(xorscura_decrypt_range_into(data, 0, data->buf_count, out));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_inplace()
+ *
+ *	Input: A pointer to the xod data structure. (Same requirements as xorscura_decrypt().)
+ *		xod->ciphertext_buf must be writable.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->ciphertext_buf now holds the unencrypted data, and xod->plaintext_buf points at it too.
+ *
+ *	Purpose: Decrypt over the top of the ciphertext, allocating nothing.
+ *
+ *	Note: The ciphertext is gone afterwards, and there is no room for a null terminator. Ownership doesn't change:
+ *	if libxorscura allocated ciphertext_buf, xorscura_free_xod() still frees it, once. Any plaintext_buf that
+ *	libxorscura allocated earlier is wiped and freed first.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_inplace(struct xod *data){
+
+	if(xorscura_decrypt_range_into(data, 0, data->buf_count, data->ciphertext_buf) == -1){
+		return(-1);
+	}
+
+	// A plaintext from an earlier xorscura_decrypt() would otherwise leak, and be freed again through the alias.
+	xod_free(data, data->plaintext_buf, ALLOC_PLAINTEXT);
+	data->plaintext_buf = data->ciphertext_buf;
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_compare()
+ *
+ *	Input: A pointer to the xod data structure.
+ *		xod->plaintext_buf should have a pointer to the unencrypted data.
+ *		xod->buf_count should contain the number of bytes in xod->plaintext_buf.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->key should have a pointer to the key data *OR*
+ *		xod->seed should have the prng seed needed to generate the key.
+ *
+ *	Output: 0 on match, 1 on non-match, -1 on error.
+ *
+ *	Purpose: Compare the plaintext and ciphertext strings in a way that won't leave the secret exposed in memory.
+ *
+ *	Note: 0 on match is a behavior we chose in an attempt to mimic the behavior of the strcmp() function.
+ *
+ **********************************************************************************************************************/
+int xorscura_compare(struct xod *data){
+
+	STATS_OP(XORSCURA_STATS_COMPARE, data->buf_count);
+
+
+	// Check if we have the prng case, or straight xor of arrays.
+	if(!data->key_buf){
+		return(xorscura_compare_prng(data));
+	}
+
+	// Compare.
+	return(key_cmp(data->algorithm, data->seed, data->key_buf, data->key_count, data->plaintext_buf, data->ciphertext_buf, data->buf_count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_compare_prng()
+ *
+ *	Input: A pointer to the xod data structure.
+ *		xod->plaintext_buf should have a pointer to the unencrypted data.
+ *		xod->buf_count should contain the number of bytes in xod->plaintext_buf.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->seed should have the prng seed needed to generate the key.
+ *
+ *	Output: 0 on match, 1 on non-match, -1 on error.
+ *
+ *	Purpose: Compare the plaintext and ciphertext strings in a way that won't leave the secret exposed in memory.
+ *
+ *	Note: 0 on match is a behavior we chose in an attempt to mimic the behavior of the strcmp() function.
+ *
+ *	Note: This function is called inside of xorscura_compare_prng() after a seed check. There shouldn't be any reason
+ *	to call this directly, unless you know what you're doing.
+ *
+ **********************************************************************************************************************/
+int xorscura_compare_prng(struct xod *data){
+
+	STATS_OP(XORSCURA_STATS_COMPARE, data->buf_count);
+
+
+	// Generate the key a block at a time, and compare each decrypted block of cipher with the plaintext.
+	return(key_cmp(data->algorithm, data->seed, NULL, data->key_count, data->plaintext_buf, data->ciphertext_buf, data->buf_count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_batch()
+ *
+ *	Input: An array of n xod data structures, each set up as for xorscura_decrypt().
+ *
+ *	Output: 0 on success, -1 if any of them failed.
+ *		Each xod->plaintext_buf will have a pointer to its unencrypted data, as with xorscura_decrypt().
+ *
+ *	Purpose: Decrypt a whole table of short strings in one go. The random_r seeds among them are run BATCH_LANES at
+ *	a time, which takes a fraction of the time of seeding each one on its own.
+ *
+ *	Note: Key mode, short keys, chacha8, and anything over BATCH_MAX_COUNT bytes are passed on to xorscura_decrypt()
+ *	one at a time. A failure doesn't stop the rest of the batch.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_batch(struct xod *arr, size_t n){
+
+	struct batch_lane lanes[BATCH_LANES];
+	size_t lane_count;
+	size_t i;
+
+	struct xod *data;
+	int retval;
+	STATS_OP(XORSCURA_STATS_DECRYPT, 0);
+
+
+	retval = 0;
+	lane_count = 0;
+	for(i = 0; i < n; i++){
+		data = arr + i;
+		stats_timer.bytes += data->buf_count;
+
+		if(data->key_buf || data->key_count || data->algorithm != XORSCURA_ALG_RANDOM_R || data->buf_count > BATCH_MAX_COUNT){
+			if(xorscura_decrypt(data) == -1){
+				retval = -1;
+			}
+			continue;
+		}
+
+		// Again, +1 for the implicit null termination.
+		if((data->plaintext_buf = xod_alloc(data, data->buf_count + 1, ALLOC_PLAINTEXT)) == NULL){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_decrypt_batch(): xod_alloc(%lx, %d, ALLOC_PLAINTEXT)\n", (unsigned long) data, (int) data->buf_count + 1);
+#endif
+			retval = -1;
+			continue;
+		}
+
+		lanes[lane_count].seed = data->seed;
+		lanes[lane_count].cipher = data->ciphertext_buf;
+		lanes[lane_count].count = data->buf_count;
+		lanes[lane_count].out = data->plaintext_buf;
+
+		if(++lane_count == BATCH_LANES){
+			prng_batch(lanes, lane_count);
+			lane_count = 0;
+		}
+	}
+
+	if(lane_count){
+		prng_batch(lanes, lane_count);
+	}
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_compare_batch()
+ *
+ *	Input: An array of n xod data structures, each set up as for xorscura_compare(), and an array of n results.
+ *
+ *	Output: 0 on success, -1 if any of the compares failed.
+ *		results[i] will hold what xorscura_compare() would have returned for arr[i]: 0 on match, 1 on non-match,
+ *		-1 on error.
+ *
+ *	Purpose: xorscura_compare() over a whole table, with the random_r seeds run BATCH_LANES at a time. (See
+ *	xorscura_decrypt_batch().)
+ *
+ **********************************************************************************************************************/
+int xorscura_compare_batch(struct xod *arr, size_t n, int *results){
+
+	struct batch_lane lanes[BATCH_LANES];
+	size_t lane_count;
+	size_t i, j;
+
+	struct xod *data;
+	int retval;
+	STATS_OP(XORSCURA_STATS_COMPARE, 0);
+
+
+	retval = 0;
+	lane_count = 0;
+	for(i = 0; i < n; i++){
+		data = arr + i;
+		stats_timer.bytes += data->buf_count;
+
+		if(data->key_buf || data->key_count || data->algorithm != XORSCURA_ALG_RANDOM_R || data->buf_count > BATCH_MAX_COUNT){
+			if((results[i] = xorscura_compare(data)) == -1){
+				retval = -1;
+			}
+			continue;
+		}
+
+		lanes[lane_count].seed = data->seed;
+		lanes[lane_count].cipher = data->ciphertext_buf;
+		lanes[lane_count].count = data->buf_count;
+		lanes[lane_count].out = NULL;
+		lanes[lane_count].plain = data->plaintext_buf;
+		lanes[lane_count].index = i;
+
+		if(++lane_count == BATCH_LANES){
+			prng_batch(lanes, lane_count);
+			for(j = 0; j < lane_count; j++){
+				results[lanes[j].index] = lanes[j].diff;
+			}
+			lane_count = 0;
+		}
+	}
+
+	if(lane_count){
+		prng_batch(lanes, lane_count);
+		for(j = 0; j < lane_count; j++){
+			results[lanes[j].index] = lanes[j].diff;
+		}
+	}
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_secret
+ *
+ *	A read only descriptor for one obfuscated secret, for sharing between threads. Everything else here takes a
+ *	struct xod, and most of it writes back into one (plaintext_buf, alloc_flag), so threads sharing an xod need a
+ *	lock. The functions below take the secret as const and write only to the caller's own buffers, and the keystream
+ *	state lives on the caller's stack. Any number of threads can use the same secret at once.
+ *
+ *	struct xorscura_secret is cache line aligned, so a table of them never shares a line with anything that gets
+ *	written.
+ *
+ *	Note: The secret points at the ciphertext and key, rather than copying them. They have to outlive it, and stay
+ *	unchanged while it's in use.
+ *
+ **********************************************************************************************************************/
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_secret_init()
+ *
+ *	Input: A pointer to the secret to fill in, and a pointer to the xod data structure describing it.
+ *		xod->ciphertext_buf should have a pointer to the ciphertext data.
+ *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
+ *		xod->key should have a pointer to the key data *OR*
+ *		xod->seed (and xod->algorithm) should have the keystream needed to generate the key.
+ *
+ *	Output: 0 on success, -1 on error.
+ *
+ *	Purpose: Set up a secret. The xod isn't needed once this returns. Its buffers are.
+ *
+ **********************************************************************************************************************/
+int xorscura_secret_init(struct xorscura_secret *secret, const struct xod *data){
+
+	if(!data->ciphertext_buf && data->buf_count){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_secret_init(): No ciphertext!\n");
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if(!data->key_buf && data->algorithm != XORSCURA_ALG_RANDOM_R && data->algorithm != XORSCURA_ALG_CHACHA8){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_secret_init(): Unknown algorithm %d!\n", (int) data->algorithm);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if(data->key_count > XORSCURA_KEY_MAX){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_secret_init(): key_count %lu is over XORSCURA_KEY_MAX!\n", (unsigned long) data->key_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	memset(secret, 0, sizeof(struct xorscura_secret));
+	secret->ciphertext_buf = data->ciphertext_buf;
+	secret->key_buf = data->key_buf;
+	secret->key_count = data->key_count;
+	secret->buf_count = data->buf_count;
+	secret->seed = data->seed;
+	secret->algorithm = data->algorithm;
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_secret_decrypt_range()
+ *
+ *	Input: A pointer to the secret, the offset and count of the bytes wanted, and an output buffer with room for
+ *		count bytes.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		out will hold the unencrypted bytes [offset, offset + count). No null terminator is added.
+ *
+ *	Purpose: Decrypt some or all of a shared secret, without locking.
+ *
+ **********************************************************************************************************************/
+int xorscura_secret_decrypt_range(const struct xorscura_secret *secret, size_t offset, size_t count, unsigned char *out){
+
+	STATS_OP(XORSCURA_STATS_DECRYPT, count);
+
+
+	if(offset > secret->buf_count || count > secret->buf_count - offset){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_secret_decrypt_range(): Range [%lu, %lu) is past buf_count %lu!\n", (unsigned long) offset, (unsigned long) (offset + count), (unsigned long) secret->buf_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	return(parallel_xor(secret->algorithm, secret->seed, secret->key_buf, secret->key_count, offset, out, secret->ciphertext_buf + offset, count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_secret_decrypt()
+ *
+ *	Input: A pointer to the secret, and an output buffer with room for its buf_count bytes.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		out will hold the unencrypted data. No null terminator is added.
+ *
+ *	Purpose: xorscura_secret_decrypt_range() of the whole secret.
+ *
+ **********************************************************************************************************************/
+int xorscura_secret_decrypt(const struct xorscura_secret *secret, unsigned char *out){
+
+	return(xorscura_secret_decrypt_range(secret, 0, secret->buf_count, out));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_secret_compare()
+ *
+ *	Input: A pointer to the secret, and a candidate plaintext of count bytes.
+ *
+ *	Output: 0 on match, 1 on non-match, -1 on error.
+ *
+ *	Purpose: xorscura_compare() against a shared secret, without locking. As there, the secret is never decrypted
+ *	into memory.
+ *
+ *	Note: A candidate of a different length is a non-match, found without generating any keystream.
+ *
+ **********************************************************************************************************************/
+int xorscura_secret_compare(const struct xorscura_secret *secret, const unsigned char *plain, size_t count){
+
+	STATS_OP(XORSCURA_STATS_COMPARE, count);
+
+
+	if(count != secret->buf_count){
+		return(1);
+	}
+
+	return(key_cmp(secret->algorithm, secret->seed, secret->key_buf, secret->key_count, plain, secret->ciphertext_buf, count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_stream_init()
+ *
+ *	Input: A pointer to the stream to set up, a pointer to the xod data structure, and a starting offset.
+ *		xod->key should have a pointer to the key data *OR*
+ *		xod->seed (and xod->algorithm) should describe the keystream.
+ *		xod->key_count, if set, makes either one a short key.
+ *		The xod buffers and buf_count aren't used, and the xod isn't needed once this returns. (Except for the
+ *		key data itself, which the stream keeps pointing at.)
+ *
+ *	Output: 0 on success, -1 on error.
+ *
+ *	Purpose: Start processing a keystream in pieces, from byte offset on. Feed the data through
+ *	xorscura_stream_update() (or xorscura_stream_compare()) a chunk at a time, in order, then call
+ *	xorscura_stream_final().
+ *
+ *	Note: The stream is plain old data on the caller's side. Nothing is allocated, so there is nothing to leak if
+ *	final is skipped, but final also wipes the keystream state.
+ *
+ *	Note: A short key made from the seed is kept in the stream itself, and the stream points at it. Don't copy a
+ *	stream once it's set up.
+ *
+ **********************************************************************************************************************/
+int xorscura_stream_init(struct xorscura_stream *stream, struct xod *data, size_t offset){
+
+	size_t skip;
+
+
+	// All but the cycle buffer, which only ever gets used as far as key_count.
+	memset(stream, 0, offsetof(struct xorscura_stream, cycle));
+	stream->offset = offset;
+
+	if(data->key_count > XORSCURA_KEY_MAX){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_stream_init(): key_count %lu is over XORSCURA_KEY_MAX!\n", (unsigned long) data->key_count);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+	stream->key_count = data->key_count;
+
+	if(data->key_buf){
+		stream->key_buf = data->key_buf;
+		return(0);
+	}
+
+	// A short key from the seed is made once, here, and the keystream isn't needed after that.
+	if(data->key_count){
+		stream->key_buf = stream->cycle;
+		return(keystream_xor(data->algorithm, data->seed, 0, stream->cycle, NULL, data->key_count));
+	}
+
+	if(keystream_seek(&(stream->ks), data->algorithm, data->seed, offset, &skip) == -1){
+		return(-1);
+	}
+
+	stream->block_count = keystream_next(&(stream->ks), stream->block);
+	stream->block_pos = skip;
+
+	return(0);
+}
+
+// Hand back up to count bytes of the stream's keystream, generating more if needed. Returns how many bytes *key
+// points at.
+static size_t stream_key(struct xorscura_stream *stream, size_t count, const unsigned char **key){
+
+	if(stream->key_buf){
+		*key = stream->key_buf + stream->offset;
+	}else{
+		if(stream->block_pos == stream->block_count){
+			stream->block_count = keystream_next(&(stream->ks), stream->block);
+			stream->block_pos = 0;
+		}
+
+		*key = (unsigned char *) stream->block + stream->block_pos;
+		if(count > stream->block_count - stream->block_pos){
+			count = stream->block_count - stream->block_pos;
+		}
+		stream->block_pos += count;
+	}
+
+	stream->offset += count;
+
+	return(count);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_stream_update()
+ *
+ *	Input: A pointer to the stream, the input and output buffers, and the number of bytes to process.
+ *
+ *	Output: 0 on success, -1 on error.
+ *		out[i] = in[i] ^ the next count bytes of keystream. If in is NULL, out gets the raw keystream instead,
+ *		which is how an encrypt produces its key.
+ *
+ *	Purpose: Encrypt or decrypt the next chunk of a stream. (Being xor, they're the same thing.)
+ *
+ *	Note: in and out may be the same buffer.
+ *
+ **********************************************************************************************************************/
+int xorscura_stream_update(struct xorscura_stream *stream, const unsigned char *in, unsigned char *out, size_t count){
+
+	const unsigned char *key;
+	size_t key_count;
+	size_t done;
+	STATS_OP(XORSCURA_STATS_STREAM, count);
+
+
+	if(stream->key_count){
+		cycle_xor(out, in, stream->key_buf, stream->key_count, stream->offset, count);
+		stream->offset += count;
+		return(0);
+	}
+
+	done = 0;
+	while(done < count){
+		key_count = stream_key(stream, count - done, &key);
+
+		if(in){
+			xor_bytes(out + done, in + done, key, key_count);
+		}else{
+			memcpy(out + done, key, key_count);
+		}
+
+		done += key_count;
+	}
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_stream_compare()
+ *
+ *	Input: A pointer to the stream, the next count bytes of plaintext and of ciphertext, and count.
+ *
+ *	Output: 0 if this chunk matches, 1 if it doesn't.
+ *
+ *	Purpose: xorscura_compare(), a chunk at a time. A mismatch leaves the stream mid chunk, so there is no
+ *	continuing after one.
+ *
+ **********************************************************************************************************************/
+int xorscura_stream_compare(struct xorscura_stream *stream, const unsigned char *plain, const unsigned char *cipher, size_t count){
+
+	const unsigned char *key;
+	size_t key_count;
+	size_t done;
+	STATS_OP(XORSCURA_STATS_STREAM, count);
+
+
+	if(stream->key_count){
+		stream->offset += count;
+		return(cycle_cmp(plain, cipher, stream->key_buf, stream->key_count, stream->offset - count, count));
+	}
+
+	done = 0;
+	while(done < count){
+		key_count = stream_key(stream, count - done, &key);
+
+		if(cmp_bytes(plain + done, cipher + done, key, key_count)){
+			return(1);
+		}
+
+		done += key_count;
+	}
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_stream_final()
+ *
+ *	Input: A pointer to the stream.
+ *	Output: None.
+ *
+ *	Purpose: Wipe the stream's keystream state.
+ *
+ **********************************************************************************************************************/
+void xorscura_stream_final(struct xorscura_stream *stream){
+
+	explicit_bzero(stream->cycle, stream->key_count);
+	explicit_bzero(stream, offsetof(struct xorscura_stream, cycle));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_window()
+ *
+ *	Input: A pointer to the xod data structure, a window size in bytes, a sink, and an argument for the sink.
+ *		(Same xod requirements as xorscura_decrypt().)
+ *		A window of 0, or over WINDOW_MAX (64KiB), gets WINDOW_MAX.
+ *
+ *	Output: 0 on success, -1 on error. If the sink returns -1, so does this, without going any further.
+ *
+ *	Purpose: Decrypt without ever holding the whole plaintext. The plaintext is decrypted a window at a time into a
+ *	buffer on the stack, and each window is handed to sink(buf, count, arg) in order. The window is wiped after each
+ *	call, whether or not the sink failed.
+ *
+ *	Note: The sink must be done with buf when it returns. Anything it wants to keep, it copies.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_window(struct xod *data, size_t window, xorscura_sink sink, void *arg){
+
+	unsigned char window_buf[WINDOW_MAX];
+	struct xorscura_stream stream;
+	size_t done, count;
+	int retval;
+	STATS_OP(XORSCURA_STATS_DECRYPT, data->buf_count);
+
+
+	if(!window || window > WINDOW_MAX){
+		window = WINDOW_MAX;
+	}
+
+	if(xorscura_stream_init(&stream, data, 0) == -1){
+		return(-1);
+	}
+
+	retval = 0;
+	for(done = 0; done < data->buf_count; done += count){
+		count = data->buf_count - done;
+		if(count > window){
+			count = window;
+		}
+
+		xorscura_stream_update(&stream, data->ciphertext_buf + done, window_buf, count);
+		retval = sink(window_buf, count, arg);
+		explicit_bzero(window_buf, count);
+
+		if(retval == -1){
+			break;
+		}
+	}
+
+	xorscura_stream_final(&stream);
+
+	return(retval == -1 ? -1 : 0);
+}
+
+// The sink behind xorscura_decrypt_fd(). arg points at the fd.
+static int window_write(const unsigned char *buf, size_t count, void *arg){
+
+	ssize_t retval;
+	int fd;
+
+
+	fd = *(int *) arg;
+
+	while(count){
+		if((retval = write(fd, buf, count)) == -1){
+			if(errno == EINTR){
+				continue;
+			}
+#ifdef DEBUG
+			fprintf(stderr, "window_write(): write(%d, %lx, %lu)\n", fd, (unsigned long) buf, (unsigned long) count);
+#endif
+			return(-1);
+		}
+
+		buf += retval;
+		count -= retval;
+	}
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_fd()
+ *
+ *	Input: A pointer to the xod data structure, and a file descriptor open for writing.
+ *		(Same xod requirements as xorscura_decrypt().)
+ *
+ *	Output: 0 on success, -1 on error.
+ *
+ *	Purpose: Decrypt straight to fd, a WINDOW_MAX window at a time. See xorscura_decrypt_window().
+ *
+ *	Note: On error, fd will have taken some prefix of the plaintext. Pipes, sockets, and files all work, and a
+ *	partial write() just gets the rest written after it.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_fd(struct xod *data, int fd){
+
+	return(xorscura_decrypt_window(data, WINDOW_MAX, window_write, &fd));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_image_load()
+ *
+ *	Input: A pointer to the xod data structure, zero or more XORSCURA_IMAGE_* flags or'd together, and the image to
+ *		fill in.
+ *		(Same xod requirements as xorscura_decrypt().)
+ *
+ *	Output: 0 on success, -1 on error.
+ *		image->addr will have a read only mapping of the plaintext (read and execute, with XORSCURA_IMAGE_EXEC).
+ *		image->fd will have a memfd holding exactly the plaintext (with XORSCURA_IMAGE_FD), or -1.
+ *
+ *	Purpose: Unpack a payload straight into the memory it will run from. The plaintext is decrypted once, directly
+ *	into a fresh mapping, so it never passes through the heap. Release it with xorscura_image_unload().
+ *
+ *	Note: Anonymous images of IMAGE_HUGE or more are aligned to it and marked MADV_HUGEPAGE, so transparent huge
+ *	pages can back them. memfd images use normal pages, since a hugetlb memfd can't be truncated to the exact size
+ *	that fexecve() needs.
+ *	Note: The memfd is close on exec. That's fine for fexecve() of an ELF binary, but a #! script can't be run that
+ *	way, since its interpreter would need to open the fd after the exec.
+ *
+ **********************************************************************************************************************/
+int xorscura_image_load(struct xod *data, int flags, struct xorscura_image *image){
+
+	unsigned char *map;
+	size_t page_size, align;
+	size_t map_size, head;
+	int saved_errno;
+
+
+	memset(image, 0, sizeof(struct xorscura_image));
+	image->fd = -1;
+
+	if(flags & ~(XORSCURA_IMAGE_EXEC | XORSCURA_IMAGE_FD)){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_image_load(): Bad flags: %x\n", flags);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	// mmap() won't take a size of 0.
+	page_size = sysconf(_SC_PAGESIZE);
+	if(data->buf_count > SIZE_MAX - IMAGE_HUGE){
+		errno = ENOMEM;
+		return(-1);
+	}
+	image->size = data->buf_count ? (data->buf_count + page_size - 1) & ~(page_size - 1) : page_size;
+	image->count = data->buf_count;
+
+	if(flags & XORSCURA_IMAGE_FD){
+
+		if((image->fd = memfd_create("xorscura", MFD_CLOEXEC)) == -1){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_image_load(): memfd_create(\"xorscura\", MFD_CLOEXEC)\n");
+#endif
+			return(-1);
+		}
+
+		if(ftruncate(image->fd, data->buf_count) == -1){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_image_load(): ftruncate(%d, %lu)\n", image->fd, (unsigned long) data->buf_count);
+#endif
+			goto CLEANUP;
+		}
+
+		if((map = (unsigned char *) mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0)) == MAP_FAILED){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_image_load(): mmap(NULL, %lu, PROT_READ | PROT_WRITE, MAP_SHARED, %d, 0)\n", (unsigned long) image->size, image->fd);
+#endif
+			goto CLEANUP;
+		}
+
+	}else{
+
+		// Big enough for huge pages, so over map by one, and trim it back to a huge page boundary.
+		align = image->size >= IMAGE_HUGE ? IMAGE_HUGE : page_size;
+		if(align > page_size){
+			image->size = (image->size + align - 1) & ~(align - 1);
+		}
+		map_size = image->size + align - page_size;
+
+		if((map = (unsigned char *) mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_image_load(): mmap(NULL, %lu, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)\n", (unsigned long) map_size);
+#endif
+			return(-1);
+		}
+
+		head = (align - ((uintptr_t) map & (align - 1))) & (align - 1);
+		if(head){
+			munmap(map, head);
+		}
+		if(map_size - head > image->size){
+			munmap(map + head + image->size, map_size - head - image->size);
+		}
+		map += head;
+
+		// Only a hint. Without transparent huge pages, it's normal pages as usual.
+		if(align > page_size){
+			madvise(map, image->size, MADV_HUGEPAGE);
+		}
+	}
+
+	image->addr = map;
+
+	if(xorscura_decrypt_into(data, map) == -1){
+		goto CLEANUP;
+	}
+
+	if(flags & XORSCURA_IMAGE_EXEC){
+		__builtin___clear_cache((char *) map, (char *) map + data->buf_count);
+	}
+
+	if(mprotect(map, image->size, PROT_READ | ((flags & XORSCURA_IMAGE_EXEC) ? PROT_EXEC : 0)) == -1){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_image_load(): mprotect(%lx, %lu, %s)\n", (unsigned long) map, (unsigned long) image->size, (flags & XORSCURA_IMAGE_EXEC) ? "PROT_READ | PROT_EXEC" : "PROT_READ");
+#endif
+		goto CLEANUP;
+	}
+
+	return(0);
+
+CLEANUP:
+	saved_errno = errno;
+	xorscura_image_unload(image);
+	errno = saved_errno;
+
+	return(-1);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_image_unload()
+ *
+ *	Input: A pointer to an image from xorscura_image_load().
+ *	Output: None.
+ *
+ *	Purpose: Wipe the image, unmap it, and close its memfd.
+ *
+ *	Note: Safe on an image that failed to load, or has already been unloaded.
+ *
+ **********************************************************************************************************************/
+void xorscura_image_unload(struct xorscura_image *image){
+
+	if(image->addr){
+		// Wiping through a memfd's mapping wipes the file too.
+		if(mprotect(image->addr, image->size, PROT_READ | PROT_WRITE) == 0){
+			explicit_bzero(image->addr, image->count);
+		}
+		munmap(image->addr, image->size);
+	}
+
+	if(image->fd != -1){
+		close(image->fd);
+	}
+
+	memset(image, 0, sizeof(struct xorscura_image));
+	image->fd = -1;
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * lz
+ *
+ *	A small LZ77 codec, in the LZ4 mould, for compressing before obfuscating. The format is the plaintext's length as
+ *	a LEB128 varint, then a run of sequences, each of them:
+ *
+ *		token	: High nibble is the literal count, low nibble is the match length - LZ_MATCH_MIN. 15 in either
+ *			  means more of it follows as bytes of 255, ending with a byte under 255.
+ *		literals: That many bytes, copied straight out.
+ *		offset	: Two bytes, little endian. How far back the match starts, 1 to LZ_OFFSET_MAX.
+ *		match	: The rest of the match length, if the token's low nibble was 15.
+ *
+ *	The last sequence stops after its literals, which is how the decoder knows when it's done: the output is full.
+ *
+ *	The compressor is greedy, with one candidate per hash of the next four bytes, and skips ahead faster the longer
+ *	it goes without a match. Incompressible input grows by about 1 in 255.
+ *
+ *	The decoder never trusts the stream. Every length and offset is checked against the output, so a bad key or seed
+ *	gives an error rather than a write out of bounds.
+ *
+ **********************************************************************************************************************/
+
+#define LZ_MATCH_MIN	4
+#define LZ_OFFSET_MAX	65535
+#define LZ_HASH_BITS	13
+
+// Compressed bytes decrypted at a time by the decoder.
+#define LZ_WINDOW	4096
+
+static inline uint32_t lz_hash(const unsigned char *p){
+
+	uint32_t word;
+
+	memcpy(&word, p, sizeof(word));
+
+	return((word * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+static unsigned char *lz_put_length(unsigned char *out, size_t length){
+
+	while(length >= 255){
+		*(out++) = 255;
+		length -= 255;
+	}
+	*(out++) = (unsigned char) length;
+
+	return(out);
+}
+
+static unsigned char *lz_put_sequence(unsigned char *out, const unsigned char *literals, size_t literal_count, size_t offset, size_t match_count){
+
+	unsigned char *token;
+
+
+	token = out++;
+	*token = 0;
+
+	if(literal_count >= 15){
+		*token = 15 << 4;
+		out = lz_put_length(out, literal_count - 15);
+	}else{
+		*token = (unsigned char) (literal_count << 4);
+	}
+
+	// Empty input has no literals, and maybe no buffer either.
+	if(literal_count){
+		memcpy(out, literals, literal_count);
+		out += literal_count;
+	}
+
+	// Only the last sequence has no match.
+	if(!match_count){
+		return(out);
+	}
+
+	*(out++) = (unsigned char) offset;
+	*(out++) = (unsigned char) (offset >> 8);
+
+	match_count -= LZ_MATCH_MIN;
+	if(match_count >= 15){
+		*token |= 15;
+		out = lz_put_length(out, match_count - 15);
+	}else{
+		*token |= (unsigned char) match_count;
+	}
+
+	return(out);
+}
+
+// Pulls the compressed stream through a small window, decrypting as it goes.
+struct lz_reader {
+	struct xorscura_stream stream;
+
+	const unsigned char *cipher;
+	size_t cipher_count;
+	size_t cipher_pos;
+
+	unsigned char window[LZ_WINDOW];
+	size_t window_count;
+	size_t window_pos;
+};
+
+static int lz_fill(struct lz_reader *reader){
+
+	size_t count;
+
+
+	if(reader->cipher_pos == reader->cipher_count){
+		errno = EINVAL;
+		return(-1);
+	}
+
+	count = reader->cipher_count - reader->cipher_pos;
+	if(count > LZ_WINDOW){
+		count = LZ_WINDOW;
+	}
+
+	xorscura_stream_update(&(reader->stream), reader->cipher + reader->cipher_pos, reader->window, count);
+	reader->cipher_pos += count;
+	reader->window_count = count;
+	reader->window_pos = 0;
+
+	return(0);
+}
+
+// The next byte, or -1 if the stream has run out.
+static inline int lz_byte(struct lz_reader *reader){
+
+	if(reader->window_pos == reader->window_count && lz_fill(reader) == -1){
+		return(-1);
+	}
+
+	return(reader->window[reader->window_pos++]);
+}
+
+static int lz_read(struct lz_reader *reader, unsigned char *out, size_t count){
+
+	size_t chunk;
+
+
+	while(count){
+		if(reader->window_pos == reader->window_count && lz_fill(reader) == -1){
+			return(-1);
+		}
+
+		chunk = reader->window_count - reader->window_pos;
+		if(chunk > count){
+			chunk = count;
+		}
+
+		memcpy(out, reader->window + reader->window_pos, chunk);
+		reader->window_pos += chunk;
+		out += chunk;
+		count -= chunk;
+	}
+
+	return(0);
+}
+
+// The rest of a length that started as 15 in the token. -1 on a short stream, or a length past limit.
+static int lz_get_length(struct lz_reader *reader, size_t *length, size_t limit){
+
+	int byte;
+
+
+	do{
+		if((byte = lz_byte(reader)) == -1){
+			return(-1);
+		}
+		*length += (size_t) byte;
+
+		if(*length > limit){
+			errno = EINVAL;
+			return(-1);
+		}
+	}while(byte == 255);
+
+	return(0);
+}
+
+// Decode the whole stream into out, which holds exactly out_count bytes.
+static int lz_decode(struct lz_reader *reader, unsigned char *out, size_t out_count){
+
+	size_t pos, literal_count, match_count, offset, i, chunk;
+	unsigned char *copy;
+	int token, low, high;
+
+
+	pos = 0;
+	while(1){
+		if((token = lz_byte(reader)) == -1){
+			return(-1);
+		}
+
+		literal_count = (size_t) token >> 4;
+		if(literal_count == 15 && lz_get_length(reader, &literal_count, out_count - pos) == -1){
+			return(-1);
+		}
+
+		if(literal_count > out_count - pos){
+			errno = EINVAL;
+			return(-1);
+		}
+
+		if(lz_read(reader, out + pos, literal_count) == -1){
+			return(-1);
+		}
+		pos += literal_count;
+
+		if(pos == out_count){
+			return(0);
+		}
+
+		if((low = lz_byte(reader)) == -1 || (high = lz_byte(reader)) == -1){
+			return(-1);
+		}
+		offset = (size_t) low | (size_t) high << 8;
+
+		match_count = ((size_t) token & 15) + LZ_MATCH_MIN;
+		if(match_count == 15 + LZ_MATCH_MIN && lz_get_length(reader, &match_count, out_count - pos) == -1){
+			return(-1);
+		}
+
+		if(!offset || offset > pos || match_count > out_count - pos){
+			errno = EINVAL;
+			return(-1);
+		}
+
+		// An offset shorter than the match repeats the bytes it has just written. Everything from the match's start
+		// on has a period of offset, so copying from the start again works, with the gap (and the copy) doubling.
+		copy = out + pos - offset;
+		pos += match_count;
+		for(i = pos - match_count; i < pos; i += chunk){
+			chunk = (size_t) (out + i - copy);
+			if(chunk > pos - i){
+				chunk = pos - i;
+			}
+			memcpy(out + i, copy, chunk);
+		}
+	}
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_compress_bound()
+ *
+ *	Input: A plaintext size, in bytes.
+ *	Output: The most bytes xorscura_compress() can produce from that much plaintext.
+ *
+ **********************************************************************************************************************/
+size_t xorscura_compress_bound(size_t count){
+
+	return(count + count / 255 + 16);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_compress()
+ *
+ *	Input: The plaintext and its size, and an output buffer of at least xorscura_compress_bound(count) bytes.
+ *	Output: The number of bytes written to out.
+ *
+ *	Purpose: Compress, ready for encrypting. xorscura_encrypt_lz() does both. This is for callers that feed the
+ *	compressed bytes into something else, like a stream.
+ *
+ *	Note: Allocates nothing. The match table lives on the stack, and is wiped before returning.
+ *
+ **********************************************************************************************************************/
+size_t xorscura_compress(const unsigned char *in, size_t count, unsigned char *out){
+
+	size_t table[1 << LZ_HASH_BITS];
+	unsigned char *out_start;
+	size_t pos, anchor, candidate, match_count;
+	size_t misses;
+	uint32_t hash;
+
+
+	out_start = out;
+
+	// The plaintext length, as a varint.
+	pos = count;
+	while(pos >= 0x80){
+		*(out++) = (unsigned char) (pos | 0x80);
+		pos >>= 7;
+	}
+	*(out++) = (unsigned char) pos;
+
+	// 0 is empty. Positions go in one up.
+	memset(table, 0, sizeof(table));
+
+	anchor = 0;
+	pos = 0;
+	misses = 0;
+	while(count >= LZ_MATCH_MIN && pos <= count - LZ_MATCH_MIN){
+
+		hash = lz_hash(in + pos);
+		candidate = table[hash];
+		table[hash] = pos + 1;
+
+		if(!candidate || pos - (candidate - 1) > LZ_OFFSET_MAX || memcmp(in + pos, in + candidate - 1, LZ_MATCH_MIN)){
+			pos += 1 + (misses++ >> 6);
+			continue;
+		}
+		candidate--;
+		misses = 0;
+
+		match_count = LZ_MATCH_MIN;
+		while(pos + match_count < count && in[pos + match_count] == in[candidate + match_count]){
+			match_count++;
+		}
+
+		out = lz_put_sequence(out, in + anchor, pos - anchor, pos - candidate, match_count);
+		pos += match_count;
+		anchor = pos;
+	}
+
+	// Whatever's left goes out as literals.
+	out = lz_put_sequence(out, in + anchor, count - anchor, 0, 0);
+
+	explicit_bzero(table, sizeof(table));
+
+	return((size_t) (out - out_start));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_encrypt_lz()
+ *
+ *	Input: A pointer to the xod data structure. (Same requirements as xorscura_encrypt().)
+ *
+ *	Output: 0 on success, -1 on error.
+ *		As xorscura_encrypt(), except that the ciphertext and key are of the compressed plaintext.
+ *		xod->buf_count will be updated to the ciphertext's length. On error, it's left as it was.
+ *
+ *	Purpose: Compress, then encrypt. Store the ciphertext and seed (or key) as usual, and bring it back with
+ *	xorscura_decrypt_lz().
+ *
+ **********************************************************************************************************************/
+int xorscura_encrypt_lz(struct xod *data){
+
+	unsigned char *plaintext_buf;
+	size_t plaintext_count;
+	unsigned char *tmp_buf;
+	size_t tmp_count;
+	int retval;
+	STATS_OP(XORSCURA_STATS_ENCRYPT, data->buf_count);
+
+
+	tmp_count = xorscura_compress_bound(data->buf_count);
+	if(tmp_count < data->buf_count){
+		errno = ENOMEM;
+		return(-1);
+	}
+
+	if((tmp_buf = (unsigned char *) malloc(tmp_count)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_encrypt_lz(): malloc(%lu)\n", (unsigned long) tmp_count);
+#endif
+		return(-1);
+	}
+
+	// Encrypt the compressed bytes in place of the plaintext.
+	plaintext_buf = data->plaintext_buf;
+	plaintext_count = data->buf_count;
+	data->plaintext_buf = tmp_buf;
+	data->buf_count = xorscura_compress(plaintext_buf, data->buf_count, tmp_buf);
+
+	retval = xorscura_encrypt(data);
+
+	explicit_bzero(tmp_buf, data->buf_count);
+	free(tmp_buf);
+
+	data->plaintext_buf = plaintext_buf;
+	if(retval == -1){
+		data->buf_count = plaintext_count;
+	}
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_decrypt_lz()
+ *
+ *	Input: A pointer to the xod data structure, and somewhere to put the plaintext's length.
+ *		(Same xod requirements as xorscura_decrypt(), for a ciphertext from xorscura_encrypt_lz().)
+ *
+ *	Output: 0 on success, -1 on error. EINVAL if the data doesn't decompress, which is usually the wrong key or seed.
+ *		xod->plaintext_buf will have a pointer to the unencrypted, uncompressed data, and *count its length.
+ *
+ *	Purpose: Decrypt and decompress in one pass. The compressed stream is decrypted LZ_WINDOW bytes at a time, on
+ *	the stack, straight into the decoder. The only buffer that gets allocated is the plaintext itself.
+ *
+ **********************************************************************************************************************/
+int xorscura_decrypt_lz(struct xod *data, size_t *count){
+
+	struct lz_reader reader;
+	size_t plain_count;
+	unsigned int shift;
+	int byte;
+	STATS_OP(XORSCURA_STATS_DECRYPT, data->buf_count);
+
+
+	memset(&reader, 0, sizeof(struct lz_reader));
+	if(xorscura_stream_init(&(reader.stream), data, 0) == -1){
+		return(-1);
+	}
+	reader.cipher = data->ciphertext_buf;
+	reader.cipher_count = data->buf_count;
+
+	// The plaintext length.
+	plain_count = 0;
+	shift = 0;
+	do{
+		if((byte = lz_byte(&reader)) == -1 || shift >= 8 * sizeof(size_t)){
+			errno = EINVAL;
+			goto CLEANUP;
+		}
+		plain_count |= (size_t) (byte & 0x7f) << shift;
+		shift += 7;
+	}while(byte & 0x80);
+
+	// No sequence expands to more than 255 times its own size, so anything more is a bad stream, not a big one.
+	if(plain_count / 255 > data->buf_count || plain_count == SIZE_MAX){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_lz(): Bad length: %lu\n", (unsigned long) plain_count);
+#endif
+		errno = EINVAL;
+		goto CLEANUP;
+	}
+
+	if((data->plaintext_buf = xod_alloc(data, plain_count + 1, ALLOC_PLAINTEXT)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_lz(): xod_alloc(%lx, %lu, ALLOC_PLAINTEXT)\n", (unsigned long) data, (unsigned long) plain_count + 1);
+#endif
+		goto CLEANUP;
+	}
+
+	if(lz_decode(&reader, data->plaintext_buf, plain_count) == -1){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_decrypt_lz(): Bad stream.\n");
+#endif
+		xod_free(data, data->plaintext_buf, ALLOC_PLAINTEXT);
+		data->plaintext_buf = NULL;
+		goto CLEANUP;
+	}
+
+	explicit_bzero(&reader, sizeof(struct lz_reader));
+	*count = plain_count;
+
+	return(0);
+
+CLEANUP:
+	byte = errno;
+	explicit_bzero(&reader, sizeof(struct lz_reader));
+	errno = byte;
+
+	return(-1);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive
+ *
+ *	A file of many secrets, built to be used straight from a read only mapping. The layout, all little endian:
+ *
+ *		header	: struct xorscura_archive_header. Magic, version, entry count, and where the other two parts start.
+ *		table	: entry_count of struct xorscura_archive_entry, sorted by id, with no duplicates.
+ *		data	: Every ciphertext, back to back. Entries point into here by offset and count.
+ *
+ *	Opening one checks the header and that the table fits, and nothing else. There's no parse step, however many
+ *	entries there are. A lookup is a binary search of the table, and a bounds check of the entry it lands on. The xod
+ *	it fills in points into the mapping, so nothing is copied until the decrypt.
+ *
+ *	Only seeds are stored, never keys.
+ *
+ **********************************************************************************************************************/
+
+#define ARCHIVE_MAGIC	"XORSCURA"
+#define ARCHIVE_VERSION	1
+
+static int archive_cmp(const void *a, const void *b){
+
+	uint64_t id_a, id_b;
+
+
+	id_a = ((const struct xorscura_archive_item *) a)->id;
+	id_b = ((const struct xorscura_archive_item *) b)->id;
+
+	return((id_a > id_b) - (id_a < id_b));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive_id()
+ *
+ *	Input: A name.
+ *	Output: Its id. (64 bit FNV-1a.)
+ *
+ *	Purpose: Name entries, rather than number them. Whatever builds the archive and whatever reads it just have to
+ *	agree on the names.
+ *
+ **********************************************************************************************************************/
+uint64_t xorscura_archive_id(const char *name){
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	while(*name){
+		hash ^= (unsigned char) *(name++);
+		hash *= 0x100000001b3ull;
+	}
+
+	return(hash);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive_write()
+ *
+ *	Input: A file descriptor open for writing, an array of items, and how many there are.
+ *		Each item's xod should have ciphertext_buf, buf_count, seed, and algorithm set, as xorscura_encrypt()
+ *		leaves them. item->flags is stored as is. (XORSCURA_ARCHIVE_LZ for an xorscura_encrypt_lz() ciphertext.)
+ *
+ *	Output: 0 on success, -1 on error. EEXIST if two items share an id. EINVAL if an item has a key_count.
+ *
+ *	Purpose: Write an archive.
+ *
+ *	Note: The items are sorted by id, in place.
+ *
+ **********************************************************************************************************************/
+int xorscura_archive_write(int fd, struct xorscura_archive_item *items, size_t n){
+
+	struct xorscura_archive_header header;
+	struct xorscura_archive_entry *table;
+	uint64_t offset;
+	size_t i;
+	int retval;
+
+
+	if(n > UINT32_MAX || n > SIZE_MAX / sizeof(struct xorscura_archive_entry)){
+		errno = EINVAL;
+		return(-1);
+	}
+
+	qsort(items, n, sizeof(struct xorscura_archive_item), archive_cmp);
+
+	if((table = (struct xorscura_archive_entry *) calloc(n ? n : 1, sizeof(struct xorscura_archive_entry))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_write(): calloc(%lu, %d)\n", (unsigned long) n, (int) sizeof(struct xorscura_archive_entry));
+#endif
+		return(-1);
+	}
+
+	offset = 0;
+	for(i = 0; i < n; i++){
+		if(i && items[i].id == items[i - 1].id){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_archive_write(): Duplicate id: %016llx\n", (unsigned long long) items[i].id);
+#endif
+			free(table);
+			errno = EEXIST;
+			return(-1);
+		}
+
+		// Entries only carry a seed, which is a whole keystream. A short key can't be told apart from that.
+		if(items[i].data.key_count){
+#ifdef DEBUG
+			fprintf(stderr, "xorscura_archive_write(): Entry %016llx has a short key.\n", (unsigned long long) items[i].id);
+#endif
+			free(table);
+			errno = EINVAL;
+			return(-1);
+		}
+
+		table[i].id = htole64(items[i].id);
+		table[i].offset = htole64(offset);
+		table[i].count = htole64(items[i].data.buf_count);
+		table[i].seed = htole32(items[i].data.seed);
+		table[i].algorithm = items[i].data.algorithm;
+		table[i].flags = (uint8_t) items[i].flags;
+
+		offset += items[i].data.buf_count;
+	}
+
+	memset(&header, 0, sizeof(struct xorscura_archive_header));
+	memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = htole32(ARCHIVE_VERSION);
+	header.entry_count = htole32((uint32_t) n);
+	header.table_offset = htole64(sizeof(struct xorscura_archive_header));
+	header.data_offset = htole64(sizeof(struct xorscura_archive_header) + n * sizeof(struct xorscura_archive_entry));
+
+	retval = 0;
+	if(window_write((unsigned char *) &header, sizeof(struct xorscura_archive_header), &fd) == -1 || window_write((unsigned char *) table, n * sizeof(struct xorscura_archive_entry), &fd) == -1){
+		retval = -1;
+	}
+
+	for(i = 0; !retval && i < n; i++){
+		if(window_write(items[i].data.ciphertext_buf, items[i].data.buf_count, &fd) == -1){
+			retval = -1;
+		}
+	}
+
+	free(table);
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive_map()
+ *
+ *	Input: A pointer to the archive to set up, and an archive already in memory, and its size.
+ *
+ *	Output: 0 on success, -1 on error. EINVAL if it isn't an archive, is cut short, or buf isn't aligned.
+ *
+ *	Purpose: Use an archive that's already in memory, such as one linked into the binary. Nothing is copied, so buf
+ *	has to stay put for as long as the archive is used.
+ *
+ *	Note: The header and table are read where they sit, so buf has to be aligned for a uint64_t. A blob linked in
+ *	with ld -b binary, or read into memory at some odd offset, needs aligning (or copying into a malloc()d buffer)
+ *	first.
+ *
+ **********************************************************************************************************************/
+int xorscura_archive_map(struct xorscura_archive *archive, const void *buf, size_t count){
+
+	const struct xorscura_archive_header *header;
+	uint64_t entry_count, table_offset, data_offset;
+
+
+	memset(archive, 0, sizeof(struct xorscura_archive));
+
+	if((uintptr_t) buf % __alignof__(uint64_t)){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_map(): %lx isn't aligned.\n", (unsigned long) buf);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	header = (const struct xorscura_archive_header *) buf;
+	if(count < sizeof(struct xorscura_archive_header) || memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) || le32toh(header->version) != ARCHIVE_VERSION){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_map(): Not an archive.\n");
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	entry_count = le32toh(header->entry_count);
+	table_offset = le64toh(header->table_offset);
+	data_offset = le64toh(header->data_offset);
+
+	// The table has to be aligned, and both it and the data have to fit.
+	if(table_offset % sizeof(uint64_t) || table_offset > count || entry_count > (count - table_offset) / sizeof(struct xorscura_archive_entry) || data_offset < table_offset + entry_count * sizeof(struct xorscura_archive_entry) || data_offset > count){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_map(): Bad header.\n");
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	archive->map = (const unsigned char *) buf;
+	archive->map_count = count;
+	archive->entries = (const struct xorscura_archive_entry *) (archive->map + table_offset);
+	archive->entry_count = (size_t) entry_count;
+	archive->data = archive->map + data_offset;
+	archive->data_count = count - data_offset;
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive_open()
+ *
+ *	Input: A pointer to the archive to set up, and the path of an archive file.
+ *	Output: 0 on success, -1 on error.
+ *
+ *	Purpose: Map an archive file read only, and set it up as xorscura_archive_map() does. Release it with
+ *	xorscura_archive_close().
+ *
+ **********************************************************************************************************************/
+int xorscura_archive_open(struct xorscura_archive *archive, const char *path){
+
+	struct stat file_stat;
+	void *map;
+	int fd, saved_errno;
+
+
+	memset(archive, 0, sizeof(struct xorscura_archive));
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_open(): open(%s, O_RDONLY | O_CLOEXEC)\n", path);
+#endif
+		return(-1);
+	}
+
+	if(fstat(fd, &file_stat) == -1){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_open(): fstat(%d, %lx)\n", fd, (unsigned long) &file_stat);
+#endif
+		goto CLOSE;
+	}
+
+	if((size_t) file_stat.st_size < sizeof(struct xorscura_archive_header)){
+		errno = EINVAL;
+		goto CLOSE;
+	}
+
+	if((map = mmap(NULL, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_open(): mmap(NULL, %lu, PROT_READ, MAP_PRIVATE, %d, 0)\n", (unsigned long) file_stat.st_size, fd);
+#endif
+		goto CLOSE;
+	}
+	close(fd);
+
+	if(xorscura_archive_map(archive, map, (size_t) file_stat.st_size) == -1){
+		saved_errno = errno;
+		munmap(map, (size_t) file_stat.st_size);
+		errno = saved_errno;
+		return(-1);
+	}
+	archive->mapped = 1;
+
+	return(0);
+
+CLOSE:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return(-1);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive_find()
+ *
+ *	Input: A pointer to the archive, the id wanted, a pointer to the xod data structure to fill in, and somewhere for
+ *		the entry's flags (or NULL).
+ *
+ *	Output: 0 if found, 1 if not, -1 if the entry points outside the archive.
+ *		xod->ciphertext_buf, buf_count, seed, and algorithm will describe the secret, ready for xorscura_decrypt()
+ *		(or xorscura_decrypt_lz(), if flags has XORSCURA_ARCHIVE_LZ). The rest of the xod is cleared, except for
+ *		xod->arena.
+ *
+ *	Purpose: Look up a secret. A binary search of the table, with no copying.
+ *
+ *	Note: ciphertext_buf points into the archive, which is read only. Don't decrypt it in place.
+ *
+ **********************************************************************************************************************/
+int xorscura_archive_find(const struct xorscura_archive *archive, uint64_t id, struct xod *data, unsigned int *flags){
+
+	const struct xorscura_archive_entry *entry;
+	size_t low, high, mid;
+	uint64_t entry_id, offset, count;
+
+
+	low = 0;
+	high = archive->entry_count;
+	while(low < high){
+		mid = low + (high - low) / 2;
+		entry_id = le64toh(archive->entries[mid].id);
+
+		if(entry_id < id){
+			low = mid + 1;
+		}else{
+			high = mid;
+		}
+	}
+
+	if(low == archive->entry_count || le64toh(archive->entries[low].id) != id){
+		return(1);
+	}
+	entry = archive->entries + low;
+
+	offset = le64toh(entry->offset);
+	count = le64toh(entry->count);
+	if(offset > archive->data_count || count > archive->data_count - offset){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_archive_find(): Entry %016llx is out of bounds.\n", (unsigned long long) id);
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	data->buf_count = (size_t) count;
+	data->plaintext_buf = NULL;
+	data->key_buf = NULL;
+	data->key_count = 0;
+	data->ciphertext_buf = (unsigned char *) archive->data + offset;
+	data->seed = le32toh(entry->seed);
+	data->alloc_flag = 0;
+	data->algorithm = entry->algorithm;
+
+	if(flags){
+		*flags = entry->flags;
+	}
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_archive_close()
+ *
+ *	Input: A pointer to the archive.
+ *	Output: None.
+ *
+ *	Purpose: Unmap an archive from xorscura_archive_open(). One from xorscura_archive_map() is just forgotten.
+ *
+ **********************************************************************************************************************/
+void xorscura_archive_close(struct xorscura_archive *archive){
+
+	if(archive->mapped){
+		munmap((void *) archive->map, archive->map_count);
+	}
+
+	memset(archive, 0, sizeof(struct xorscura_archive));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * seed search
+ *
+ *	Seeds are only 32 bits, so anyone holding a ciphertext and a few bytes of its plaintext can try them all. This
+ *	is that search, for auditing how long it takes.
+ *
+ *	Only the first four bytes of keystream are generated for each seed, SEARCH_LANES seeds at a time across the
+ *	lanes of a vector. A seed has to match those (or as many of them as there are) to get past the screen. The few
+ *	that do are checked over the full count with keystream_cmp(), which stops at the first byte that's wrong.
+ *
+ *	random_r: Every step of the generator is an add mod 2^32, so the first word out after the discards is a fixed
+ *	linear combination of the words prng_fill() starts from. search_coeff() works the coefficients out once, by
+ *	running each unit vector through the discards. Then a seed costs one dot product instead of 693 steps. Better
+ *	still, the fill words of seed + 1 are those of seed plus 16807^i, mod 2^31 - 1, so stepping a lane from one seed
+ *	to the next is an add and a conditional subtract per word, with no multiply mod anything. That only holds while
+ *	the int32 value of the seed counts up by one, so the range is split at 2^31. Seed 0 is seeded as 1, and is
+ *	checked on its own.
+ *
+ *	chacha8: Each lane runs block 0 for its own seed, and keeps only the first word.
+ *
+ *	The kernels are generic vector code. search_select() compiles the same code once more for each wider instruction
+ *	set, and picks whichever this cpu runs.
+ *
+ **********************************************************************************************************************/
+
+#define SEARCH_LANES	16
+
+// Largest run of seeds handed to a kernel at once, so a scan that finds nothing still comes back now and then.
+#define SEARCH_RUN	(1 << 20)
+
+typedef uint32_t search_vec __attribute__((vector_size(SEARCH_LANES * sizeof(uint32_t))));
+
+// What the kernels screen for: (first keystream word ^ target) & mask == 0. coeff is random_r's linear combination.
+struct seed_screen {
+	uint32_t target;
+	uint32_t mask;
+	uint32_t coeff[PRNG_DEG];
+};
+
+// The first word out of random_r() after seeding, as a linear combination of the PRNG_DEG fill words.
+static void search_coeff(uint32_t *coeff){
+
+	struct xorscura_prng prng;
+	int i, j;
+
+
+	for(i = 0; i < PRNG_DEG; i++){
+		memset(&prng, 0, sizeof(struct xorscura_prng));
+		prng.window[i] = 1;
+
+		for(j = 0; j <= PRNG_DISCARD / PRNG_DEG; j++){
+			prng_next(&prng, NULL);
+		}
+
+		coeff[i] = prng.window[0];
+	}
+}
+
+// The int32 residue prng_fill() works from.
+static uint32_t search_residue(uint32_t seed){
+
+	int64_t residue;
+
+	residue = (int32_t) seed % (int64_t) PRNG_MODULUS;
+	if(residue < 0){
+		residue += PRNG_MODULUS;
+	}
+
+	return((uint32_t) residue);
+}
+
+// Offset of the first seed in [first, first + count) that gets through the screen, or count if none do. All of them
+// have to be non-zero, and on the same side of 2^31.
+__attribute__((always_inline))
+static inline uint32_t search_random_r(const struct seed_screen *screen, uint32_t first, uint32_t count){
+
+	search_vec fill[PRNG_DEG - 1];
+	search_vec step[PRNG_DEG - 1];
+	search_vec seed, sum, hit;
+	search_vec zero = {0};
+	search_vec modulus = zero + PRNG_MODULUS;
+	uint32_t residue;
+	uint32_t done;
+	int i, j;
+
+
+	residue = search_residue(first);
+	for(j = 0; j < SEARCH_LANES; j++){
+		seed[j] = first + j;
+	}
+
+	for(i = 0; i < PRNG_DEG - 1; i++){
+		for(j = 0; j < SEARCH_LANES; j++){
+			fill[i][j] = prng_mulmod((residue + j) % PRNG_MODULUS, prng_powers[i]);
+		}
+		step[i] = zero + prng_mulmod(SEARCH_LANES, prng_powers[i]);
+	}
+
+	for(done = 0; done < count; done += SEARCH_LANES){
+		sum = seed * screen->coeff[PRNG_DEG - 1];
+		for(i = 0; i < PRNG_DEG - 1; i++){
+			sum += fill[i] * screen->coeff[i];
+
+			fill[i] += step[i];
+			fill[i] -= modulus & (search_vec) (fill[i] >= modulus);
+		}
+		seed += SEARCH_LANES;
+
+		hit = (((sum >> 1) ^ screen->target) & screen->mask) == 0;
+		for(j = 0; j < SEARCH_LANES; j++){
+			if(hit[j] && done + j < count){
+				return(done + j);
+			}
+		}
+	}
+
+	return(count);
+}
+
+__attribute__((always_inline))
+static inline uint32_t search_chacha8(const struct seed_screen *screen, uint32_t first, uint32_t count){
+
+	search_vec x[16];
+	search_vec seed, hit;
+	search_vec zero = {0};
+	uint32_t done;
+	int i, j;
+
+
+	for(j = 0; j < SEARCH_LANES; j++){
+		seed[j] = first + j;
+	}
+
+	for(done = 0; done < count; done += SEARCH_LANES){
+		// Block 0 of chacha_next(): the constants, the seed, then zeros.
+		x[0] = zero + 0x61707865;
+		x[1] = zero + 0x3320646e;
+		x[2] = zero + 0x79622d32;
+		x[3] = zero + 0x6b206574;
+		x[4] = seed;
+		for(i = 5; i < 16; i++){
+			x[i] = zero;
+		}
+
+		for(i = 0; i < 8; i += 2){
+			CHACHA_QUARTER(x[0], x[4], x[8], x[12]);
+			CHACHA_QUARTER(x[1], x[5], x[9], x[13]);
+			CHACHA_QUARTER(x[2], x[6], x[10], x[14]);
+			CHACHA_QUARTER(x[3], x[7], x[11], x[15]);
+			CHACHA_QUARTER(x[0], x[5], x[10], x[15]);
+			CHACHA_QUARTER(x[1], x[6], x[11], x[12]);
+			CHACHA_QUARTER(x[2], x[7], x[8], x[13]);
+			CHACHA_QUARTER(x[3], x[4], x[9], x[14]);
+		}
+		x[0] += 0x61707865;
+
+		hit = ((x[0] ^ screen->target) & screen->mask) == 0;
+		for(j = 0; j < SEARCH_LANES; j++){
+			if(hit[j] && done + j < count){
+				return(done + j);
+			}
+		}
+
+		seed += SEARCH_LANES;
+	}
+
+	return(count);
+}
+
+typedef uint32_t (*search_kernel)(const struct seed_screen *screen, uint32_t first, uint32_t count);
+
+static uint32_t search_random_r_generic(const struct seed_screen *screen, uint32_t first, uint32_t count){
+	return(search_random_r(screen, first, count));
+}
+
+static uint32_t search_chacha8_generic(const struct seed_screen *screen, uint32_t first, uint32_t count){
+	return(search_chacha8(screen, first, count));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static uint32_t search_random_r_avx2(const struct seed_screen *screen, uint32_t first, uint32_t count){
+	return(search_random_r(screen, first, count));
+}
+
+__attribute__((target("avx2")))
+static uint32_t search_chacha8_avx2(const struct seed_screen *screen, uint32_t first, uint32_t count){
+	return(search_chacha8(screen, first, count));
+}
+
+__attribute__((target("avx512f")))
+static uint32_t search_random_r_avx512(const struct seed_screen *screen, uint32_t first, uint32_t count){
+	return(search_random_r(screen, first, count));
+}
+
+__attribute__((target("avx512f")))
+static uint32_t search_chacha8_avx512(const struct seed_screen *screen, uint32_t first, uint32_t count){
+	return(search_chacha8(screen, first, count));
+}
+
+#endif
+
+// The widest kernel this cpu runs, for algorithm.
+static search_kernel search_select(unsigned char algorithm){
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx512f")){
+		return(algorithm == XORSCURA_ALG_CHACHA8 ? search_chacha8_avx512 : search_random_r_avx512);
+	}
+
+	if(__builtin_cpu_supports("avx2")){
+		return(algorithm == XORSCURA_ALG_CHACHA8 ? search_chacha8_avx2 : search_random_r_avx2);
+	}
+#endif
+
+	return(algorithm == XORSCURA_ALG_CHACHA8 ? search_chacha8_generic : search_random_r_generic);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_seed_search()
+ *
+ *	Input: The keystream algorithm, count bytes of known plaintext and the ciphertext that goes with them, the first
+ *		and last seeds to try, and a place for the seed found.
+ *
+ *	Output: 0 if a seed in [first, last] turns plain into cipher, 1 if none does, -1 on error.
+ *		seed will hold the lowest seed that does.
+ *
+ *	Purpose: Recover a seed from known plaintext, to measure how long it takes. Split the 2^32 seeds into ranges
+ *	for as many threads as there are cpus.
+ *
+ *	Note: The plaintext can be any prefix of what was encrypted. Four bytes or so is enough to narrow it down to the
+ *	right seed, more or less. A shorter one matches a lot of seeds, and only the lowest of those is reported. So
+ *	does one too short to tell seeds apart. (random_r seeds 0 and 1 give the same keystream, for one.)
+ *
+ **********************************************************************************************************************/
+int xorscura_seed_search(unsigned char algorithm, const unsigned char *plain, const unsigned char *cipher, size_t count, unsigned int first, unsigned int last, unsigned int *seed){
+
+	struct seed_screen screen;
+	search_kernel kernel;
+	uint32_t word;
+	uint64_t next, run;
+	uint32_t offset;
+	size_t i;
+
+
+	if(!count || first > last || (algorithm != XORSCURA_ALG_RANDOM_R && algorithm != XORSCURA_ALG_CHACHA8)){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_seed_search(): Bad arguments!\n");
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	// The target keystream word, as many bytes of it as there are, in the order the keystream lays them down.
+	memset(&screen, 0, sizeof(struct seed_screen));
+	word = 0;
+	for(i = 0; i < count && i < sizeof(uint32_t); i++){
+		((unsigned char *) &word)[i] = plain[i] ^ cipher[i];
+		((unsigned char *) &(screen.mask))[i] = 0xff;
+	}
+	screen.target = word;
+
+	if(algorithm == XORSCURA_ALG_RANDOM_R){
+		search_coeff(screen.coeff);
+
+		if(!first){
+			if(!keystream_cmp(algorithm, 0, 0, plain, cipher, count)){
+				*seed = 0;
+				return(0);
+			}
+			if(!last){
+				return(1);
+			}
+			first = 1;
+		}
+	}
+
+	kernel = search_select(algorithm);
+
+	next = first;
+	while(next <= last){
+		run = (uint64_t) last - next + 1;
+		if(run > SEARCH_RUN){
+			run = SEARCH_RUN;
+		}
+
+		// random_r ranges stop short of 2^31, where the int32 seed jumps.
+		if(algorithm == XORSCURA_ALG_RANDOM_R && next < 0x80000000ULL && next + run > 0x80000000ULL){
+			run = 0x80000000ULL - next;
+		}
+
+		offset = kernel(&screen, (uint32_t) next, (uint32_t) run);
+		if(offset == run){
+			next += run;
+			continue;
+		}
+
+		next += offset;
+		if(!keystream_cmp(algorithm, (unsigned int) next, 0, plain, cipher, count)){
+			*seed = (unsigned int) next;
+			return(0);
+		}
+		next++;
+	}
+
+	return(1);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx
+ *
+ *	A context that remembers the keystreams it has generated. Entries are keyed by (algorithm, seed) and hold the
+ *	first keystream_count bytes of that keystream. A lookup that finds a long enough entry costs a hash probe, and
+ *	the decrypt or compare is then a single pass of the xor kernels with no prng work at all.
+ *
+ *	The cache is bounded by both total bytes and entry count. When either would be exceeded, the least recently
+ *	used entries are wiped and dropped until the new one fits. A keystream that wouldn't fit even in an empty cache
+ *	is generated on the fly as usual, and counted as a bypass.
+ *
+ *	Note: A context isn't thread safe. Give each thread its own.
+ *
+ **********************************************************************************************************************/
+
+struct xorscura_ctx_entry {
+
+	struct xorscura_ctx_entry *hash_next;
+	struct xorscura_ctx_entry *lru_prev;
+	struct xorscura_ctx_entry *lru_next;
+
+	unsigned int seed;
+	unsigned char algorithm;
+
+	size_t keystream_count;
+	unsigned char keystream[];
+};
+
+struct xorscura_ctx {
+
+	struct xorscura_ctx_entry **buckets;
+	size_t bucket_count;
+
+	// Most recently used at the head.
+	struct xorscura_ctx_entry *lru_head;
+	struct xorscura_ctx_entry *lru_tail;
+
+	size_t max_bytes;
+	size_t max_entries;
+
+	struct xorscura_ctx_stats stats;
+};
+
+// Starting size of the bucket array. It doubles whenever the entries outnumber the buckets.
+#define CTX_BUCKETS_MIN	64
+
+static size_t ctx_bucket(struct xorscura_ctx *ctx, unsigned char algorithm, unsigned int seed){
+
+	uint32_t hash;
+
+	hash = (seed ^ ((uint32_t) algorithm << 24)) * 0x9e3779b1;
+	hash ^= hash >> 15;
+
+	return(hash & (ctx->bucket_count - 1));
+}
+
+static void ctx_lru_unlink(struct xorscura_ctx *ctx, struct xorscura_ctx_entry *entry){
+
+	if(entry->lru_prev){
+		entry->lru_prev->lru_next = entry->lru_next;
+	}else{
+		ctx->lru_head = entry->lru_next;
+	}
+
+	if(entry->lru_next){
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}else{
+		ctx->lru_tail = entry->lru_prev;
+	}
+
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void ctx_lru_push(struct xorscura_ctx *ctx, struct xorscura_ctx_entry *entry){
+
+	entry->lru_prev = NULL;
+	entry->lru_next = ctx->lru_head;
+
+	if(ctx->lru_head){
+		ctx->lru_head->lru_prev = entry;
+	}else{
+		ctx->lru_tail = entry;
+	}
+	ctx->lru_head = entry;
+}
+
+// Unhook entry from the bucket chain and the lru list, wipe it, and free it.
+static void ctx_drop(struct xorscura_ctx *ctx, struct xorscura_ctx_entry *entry){
+
+	struct xorscura_ctx_entry **link;
+
+
+	link = &(ctx->buckets[ctx_bucket(ctx, entry->algorithm, entry->seed)]);
+	while(*link != entry){
+		link = &((*link)->hash_next);
+	}
+	*link = entry->hash_next;
+
+	ctx_lru_unlink(ctx, entry);
+
+	ctx->stats.entries--;
+	ctx->stats.bytes -= sizeof(struct xorscura_ctx_entry) + entry->keystream_count;
+
+	explicit_bzero(entry->keystream, entry->keystream_count);
+	free(entry);
+}
+
+// Double the bucket array and rehash everything into it.
+static int ctx_grow(struct xorscura_ctx *ctx){
+
+	struct xorscura_ctx_entry **old_buckets = ctx->buckets;
+	size_t old_count = ctx->bucket_count;
+	struct xorscura_ctx_entry *entry, *next;
+	size_t i, bucket;
+
+
+	if((ctx->buckets = (struct xorscura_ctx_entry **) calloc(old_count * 2, sizeof(struct xorscura_ctx_entry *))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "ctx_grow(): calloc(%d, %d)\n", (int) old_count * 2, (int) sizeof(struct xorscura_ctx_entry *));
+#endif
+		ctx->buckets = old_buckets;
+		return(-1);
+	}
+	ctx->bucket_count = old_count * 2;
+
+	for(i = 0; i < old_count; i++){
+		for(entry = old_buckets[i]; entry; entry = next){
+			next = entry->hash_next;
+			bucket = ctx_bucket(ctx, entry->algorithm, entry->seed);
+			entry->hash_next = ctx->buckets[bucket];
+			ctx->buckets[bucket] = entry;
+		}
+	}
+
+	free(old_buckets);
+
+	return(0);
+}
+
+// Point *keystream at the first count bytes of the (algorithm, seed) keystream, generating and caching it if
+// needed. Returns 1 if *keystream is set, 0 if this keystream can't be cached (too big, or no memory for it), or -1
+// on error.
+static int ctx_lookup(struct xorscura_ctx *ctx, unsigned char algorithm, unsigned int seed, size_t count, unsigned char **keystream){
+
+	struct xorscura_ctx_entry *entry, *old_entry;
+	size_t entry_size;
+	size_t bucket;
+
+
+	bucket = ctx_bucket(ctx, algorithm, seed);
+	for(entry = ctx->buckets[bucket]; entry; entry = entry->hash_next){
+		if(entry->seed == seed && entry->algorithm == algorithm){
+			break;
+		}
+	}
+
+	if(entry && entry->keystream_count >= count){
+		ctx->stats.hits++;
+		ctx_lru_unlink(ctx, entry);
+		ctx_lru_push(ctx, entry);
+		*keystream = entry->keystream;
+		return(1);
+	}
+
+	ctx->stats.misses++;
+
+	// If there is an entry, it's too short to be useful, but it stays until its replacement is ready. It still serves
+	// shorter lookups if the longer one can't be cached.
+	old_entry = entry;
+
+	entry_size = sizeof(struct xorscura_ctx_entry) + count;
+	if(entry_size > ctx->max_bytes){
+		ctx->stats.bypasses++;
+		return(0);
+	}
+
+	// Not fatal. The caller generates the keystream itself, uncached.
+	if((entry = (struct xorscura_ctx_entry *) malloc(entry_size)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "ctx_lookup(): malloc(%d)\n", (int) entry_size);
+#endif
+		return(0);
+	}
+
+	if(keystream_xor(algorithm, seed, 0, entry->keystream, NULL, count) == -1){
+		free(entry);
+		return(-1);
+	}
+
+	if(old_entry){
+		ctx_drop(ctx, old_entry);
+		ctx->stats.evictions++;
+	}
+
+	while(ctx->lru_tail && (ctx->stats.bytes + entry_size > ctx->max_bytes || (ctx->max_entries && ctx->stats.entries >= ctx->max_entries))){
+		ctx_drop(ctx, ctx->lru_tail);
+		ctx->stats.evictions++;
+	}
+
+	entry->seed = seed;
+	entry->algorithm = algorithm;
+	entry->keystream_count = count;
+
+	if(ctx->stats.entries >= ctx->bucket_count){
+		// Not fatal. The chains just get longer.
+		ctx_grow(ctx);
+		bucket = ctx_bucket(ctx, algorithm, seed);
+	}
+
+	entry->hash_next = ctx->buckets[bucket];
+	ctx->buckets[bucket] = entry;
+	ctx_lru_push(ctx, entry);
+
+	ctx->stats.entries++;
+	ctx->stats.bytes += entry_size;
+
+	*keystream = entry->keystream;
+	return(1);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx_new()
+ *
+ *	Input: The most memory, in bytes, the cache may hold (bookkeeping included), and the most entries it may hold.
+ *		A max_entries of 0 means only max_bytes applies.
+ *
+ *	Output: A pointer to the new context, or NULL on error.
+ *
+ *	Purpose: Create a keystream cache. Release it with xorscura_ctx_free().
+ *
+ **********************************************************************************************************************/
+struct xorscura_ctx *xorscura_ctx_new(size_t max_bytes, size_t max_entries){
+
+	struct xorscura_ctx *ctx;
+
+
+	if((ctx = (struct xorscura_ctx *) calloc(1, sizeof(struct xorscura_ctx))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_ctx_new(): calloc(1, %d)\n", (int) sizeof(struct xorscura_ctx));
+#endif
+		return(NULL);
+	}
+
+	if((ctx->buckets = (struct xorscura_ctx_entry **) calloc(CTX_BUCKETS_MIN, sizeof(struct xorscura_ctx_entry *))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_ctx_new(): calloc(%d, %d)\n", CTX_BUCKETS_MIN, (int) sizeof(struct xorscura_ctx_entry *));
+#endif
+		free(ctx);
+		return(NULL);
+	}
+
+	ctx->bucket_count = CTX_BUCKETS_MIN;
+	ctx->max_bytes = max_bytes;
+	ctx->max_entries = max_entries;
+
+	return(ctx);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx_free()
+ *
+ *	Input: A pointer to the context.
+ *	Output: None.
+ *
+ *	Purpose: Wipe every cached keystream and free the context.
+ *
+ **********************************************************************************************************************/
+void xorscura_ctx_free(struct xorscura_ctx *ctx){
+
+	if(!ctx){
+		return;
+	}
+
+	while(ctx->lru_head){
+		ctx_drop(ctx, ctx->lru_head);
+	}
+
+	free(ctx->buckets);
+	free(ctx);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx_decrypt_into()
+ *
+ *	Input: A pointer to the context, a pointer to the xod data structure, and an output buffer.
+ *		(Same xod and out requirements as xorscura_decrypt_into().)
+ *
+ *	Output: 0 on success, -1 on error.
+ *		out will hold the unencrypted data. No null terminator is added.
+ *
+ *	Purpose: xorscura_decrypt_into(), with the keystream coming out of the cache when it can.
+ *
+ **********************************************************************************************************************/
+int xorscura_ctx_decrypt_into(struct xorscura_ctx *ctx, struct xod *data, unsigned char *out){
+
+	unsigned char *keystream;
+	int retval;
+	STATS_OP(XORSCURA_STATS_DECRYPT, data->buf_count);
+
+
+	if(data->key_buf || data->key_count){
+		return(xorscura_decrypt_into(data, out));
+	}
+
+	if((retval = ctx_lookup(ctx, data->algorithm, data->seed, data->buf_count, &keystream)) == -1){
+		return(-1);
+	}
+
+	if(!retval){
+		return(xorscura_decrypt_into(data, out));
+	}
+
+	xor_bytes(out, data->ciphertext_buf, keystream, data->buf_count);
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx_decrypt()
+ *
+ *	Input: A pointer to the context, and a pointer to the xod data structure.
+ *		(Same xod requirements as xorscura_decrypt().)
+ *
+ *	Output: 0 on success, -1 on error.
+ *		xod->plaintext_buf will have a pointer to the unencrypted data.
+ *
+ *	Purpose: xorscura_decrypt(), with the keystream coming out of the cache when it can.
+ *
+ **********************************************************************************************************************/
+int xorscura_ctx_decrypt(struct xorscura_ctx *ctx, struct xod *data){
+
+	unsigned char *tmp_buf;
+	STATS_OP(XORSCURA_STATS_DECRYPT, data->buf_count);
+
+
+	// Again, +1 for the implicit null termination.
+	if((tmp_buf = xod_alloc(data, data->buf_count + 1, ALLOC_PLAINTEXT)) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_ctx_decrypt(): xod_alloc(%lx, %d, ALLOC_PLAINTEXT)\n", (unsigned long) data, (int) data->buf_count + 1);
+#endif
+		return(-1);
+	}
+
+	if(xorscura_ctx_decrypt_into(ctx, data, tmp_buf) == -1){
+		xod_free(data, tmp_buf, ALLOC_PLAINTEXT);
+		return(-1);
+	}
+
+	data->plaintext_buf = tmp_buf;
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx_compare()
+ *
+ *	Input: A pointer to the context, and a pointer to the xod data structure.
+ *		(Same xod requirements as xorscura_compare().)
+ *
+ *	Output: 0 on match, 1 on non-match, -1 on error.
+ *
+ *	Purpose: xorscura_compare(), with the keystream coming out of the cache when it can.
+ *
+ **********************************************************************************************************************/
+int xorscura_ctx_compare(struct xorscura_ctx *ctx, struct xod *data){
+
+	unsigned char *keystream;
+	int retval;
+	STATS_OP(XORSCURA_STATS_COMPARE, data->buf_count);
+
+
+	if(data->key_buf || data->key_count){
+		return(xorscura_compare(data));
+	}
+
+	if((retval = ctx_lookup(ctx, data->algorithm, data->seed, data->buf_count, &keystream)) == -1){
+		return(-1);
+	}
+
+	if(!retval){
+		return(xorscura_compare(data));
+	}
+
+	return(cmp_bytes(data->plaintext_buf, data->ciphertext_buf, keystream, data->buf_count));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_ctx_stats()
+ *
+ *	Input: A pointer to the context, and a pointer to a stats structure to fill.
+ *	Output: None.
+ *
+ *	Purpose: Report cache hits, misses, evictions, and current size.
+ *
+ **********************************************************************************************************************/
+void xorscura_ctx_stats(struct xorscura_ctx *ctx, struct xorscura_ctx_stats *stats){
+
+	*stats = ctx->stats;
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_set
+ *
+ *	A set of secrets, for asking whether a candidate is any one of them. Every secret is indexed by its length and a
+ *	SipHash-2-4 of its plaintext under a random per-set key. A lookup hashes the candidate, and only the secrets that
+ *	share both its length and its hash get an xorscura_compare(). Usually that's one, or none.
+ *
+ *	The hashes are taken while the set is built, by running each secret through a small stack window that is wiped
+ *	afterwards. No secret is ever decrypted in full, and the hashes are useless without the key.
+ *
+ *	Note: The set copies the xods, but not the buffers they point to. Those have to outlive the set.
+ *
+ **********************************************************************************************************************/
+
+struct xorscura_set_entry {
+
+	struct xod data;
+	uint64_t hash;
+
+	// Index of the next entry in this bucket, or SET_END.
+	size_t next;
+};
+
+struct xorscura_set {
+
+	struct xorscura_set_entry *entries;
+	size_t entry_count;
+
+	size_t *buckets;
+	size_t bucket_count;
+
+	// Lengths outside [min_count, max_count] can't be in the set, and never get hashed.
+	size_t min_count;
+	size_t max_count;
+
+	uint64_t key[2];
+};
+
+#define SET_END	((size_t) -1)
+
+// Bytes of plaintext decrypted at a time while hashing a secret.
+#define SET_WINDOW	256
+
+struct siphash {
+	uint64_t v[4];
+	uint64_t tail;
+	size_t count;
+};
+
+#define SIP_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v)	do{ \
+	v[0] += v[1]; v[1] = SIP_ROTL(v[1], 13); v[1] ^= v[0]; v[0] = SIP_ROTL(v[0], 32); \
+	v[2] += v[3]; v[3] = SIP_ROTL(v[3], 16); v[3] ^= v[2]; \
+	v[0] += v[3]; v[3] = SIP_ROTL(v[3], 21); v[3] ^= v[0]; \
+	v[2] += v[1]; v[1] = SIP_ROTL(v[1], 17); v[1] ^= v[2]; v[2] = SIP_ROTL(v[2], 32); \
+}while(0)
+
+static void sip_init(struct siphash *sip, const uint64_t *key){
+
+	sip->v[0] = key[0] ^ 0x736f6d6570736575ULL;
+	sip->v[1] = key[1] ^ 0x646f72616e646f6dULL;
+	sip->v[2] = key[0] ^ 0x6c7967656e657261ULL;
+	sip->v[3] = key[1] ^ 0x7465646279746573ULL;
+	sip->tail = 0;
+	sip->count = 0;
+}
+
+static void sip_word(struct siphash *sip, uint64_t word){
+
+	sip->v[3] ^= word;
+	SIP_ROUND(sip->v);
+	SIP_ROUND(sip->v);
+	sip->v[0] ^= word;
+}
+
+// Feed count more bytes in. Words are read little endian, as SipHash defines them.
+static void sip_update(struct siphash *sip, const unsigned char *buf, size_t count){
+
+	size_t i;
+
+	for(i = 0; i < count; i++){
+		sip->tail |= (uint64_t) buf[i] << (8 * (sip->count & 7));
+		if((++sip->count & 7) == 0){
+			sip_word(sip, sip->tail);
+			sip->tail = 0;
+		}
+	}
+}
+
+static uint64_t sip_final(struct siphash *sip){
+
+	sip_word(sip, sip->tail | (uint64_t) sip->count << 56);
+
+	sip->v[2] ^= 0xff;
+	SIP_ROUND(sip->v);
+	SIP_ROUND(sip->v);
+	SIP_ROUND(sip->v);
+	SIP_ROUND(sip->v);
+
+	return(sip->v[0] ^ sip->v[1] ^ sip->v[2] ^ sip->v[3]);
+}
+
+// Hash a secret without ever holding more than SET_WINDOW bytes of its plaintext. Returns -1 on error.
+static int set_hash_secret(struct xorscura_set *set, struct xod *data, uint64_t *hash){
+
+	struct xorscura_stream stream;
+	struct siphash sip;
+	unsigned char window[SET_WINDOW];
+	size_t done, count;
+
+
+	if(xorscura_stream_init(&stream, data, 0) == -1){
+		return(-1);
+	}
+
+	sip_init(&sip, set->key);
+	for(done = 0; done < data->buf_count; done += count){
+		count = data->buf_count - done < SET_WINDOW ? data->buf_count - done : SET_WINDOW;
+		xorscura_stream_update(&stream, data->ciphertext_buf + done, window, count);
+		sip_update(&sip, window, count);
+	}
+	*hash = sip_final(&sip);
+
+	xorscura_stream_final(&stream);
+	explicit_bzero(window, sizeof(window));
+	explicit_bzero(&sip, sizeof(sip));
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_set_new()
+ *
+ *	Input: An array of n xod data structures, each set up as for xorscura_compare(), minus the plaintext.
+ *
+ *	Output: A pointer to the new set, or NULL on error.
+ *
+ *	Purpose: Build a set out of the secrets in arr. Release it with xorscura_set_free().
+ *
+ **********************************************************************************************************************/
+struct xorscura_set *xorscura_set_new(struct xod *arr, size_t n){
+
+	struct xorscura_set *set;
+	struct xorscura_set_entry *entry;
+	size_t i, bucket;
+
+
+	if((set = (struct xorscura_set *) calloc(1, sizeof(struct xorscura_set))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_set_new(): calloc(1, %d)\n", (int) sizeof(struct xorscura_set));
+#endif
+		return(NULL);
+	}
+
+	// At least as many buckets as entries, in a power of two.
+	set->bucket_count = 1;
+	while(set->bucket_count < n){
+		set->bucket_count <<= 1;
+	}
+
+	if((set->entries = (struct xorscura_set_entry *) calloc(n ? n : 1, sizeof(struct xorscura_set_entry))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_set_new(): calloc(%lu, %d)\n", (unsigned long) n, (int) sizeof(struct xorscura_set_entry));
+#endif
+		xorscura_set_free(set);
+		return(NULL);
+	}
+
+	if((set->buckets = (size_t *) malloc(set->bucket_count * sizeof(size_t))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_set_new(): malloc(%lu)\n", (unsigned long) (set->bucket_count * sizeof(size_t)));
+#endif
+		xorscura_set_free(set);
+		return(NULL);
+	}
+
+	for(i = 0; i < set->bucket_count; i++){
+		set->buckets[i] = SET_END;
+	}
+
+	if(urandom_read((unsigned char *) set->key, sizeof(set->key)) == -1){
+		xorscura_set_free(set);
+		return(NULL);
+	}
+
+	set->min_count = SIZE_MAX;
+	set->max_count = 0;
+
+	for(i = 0; i < n; i++){
+		entry = set->entries + i;
+
+		entry->data = arr[i];
+		entry->data.plaintext_buf = NULL;
+		entry->data.alloc_flag = 0;
+
+		if(set_hash_secret(set, &(entry->data), &(entry->hash)) == -1){
+			xorscura_set_free(set);
+			return(NULL);
+		}
+
+		if(entry->data.buf_count < set->min_count){
+			set->min_count = entry->data.buf_count;
+		}
+		if(entry->data.buf_count > set->max_count){
+			set->max_count = entry->data.buf_count;
+		}
+
+		set->entry_count++;
+	}
+
+	// Entries are pushed onto the front of their bucket, so go backwards to leave each bucket in array order.
+	for(i = n; i--; ){
+		bucket = set->entries[i].hash & (set->bucket_count - 1);
+		set->entries[i].next = set->buckets[bucket];
+		set->buckets[bucket] = i;
+	}
+
+	return(set);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_set_lookup()
+ *
+ *	Input: A pointer to the set, and the candidate plaintext and its length.
+ *		index may be NULL.
+ *
+ *	Output: 0 if the candidate is in the set, 1 if it isn't, -1 on error.
+ *		On a match, *index is where the matching secret sat in the array the set was built from. (The first one,
+ *		if it was in there more than once.)
+ *
+ *	Purpose: xorscura_compare() against every secret in the set at once, for the price of a hash and (almost
+ *	always) at most one compare.
+ *
+ **********************************************************************************************************************/
+int xorscura_set_lookup(struct xorscura_set *set, const unsigned char *candidate, size_t count, size_t *index){
+
+	struct xorscura_set_entry *entry;
+	struct siphash sip;
+	struct xod data;
+	uint64_t hash;
+	size_t i;
+	int retval;
+
+
+	if(count < set->min_count || count > set->max_count){
+		return(1);
+	}
+
+	sip_init(&sip, set->key);
+	sip_update(&sip, candidate, count);
+	hash = sip_final(&sip);
+	explicit_bzero(&sip, sizeof(sip));
+
+	for(i = set->buckets[hash & (set->bucket_count - 1)]; i != SET_END; i = entry->next){
+		entry = set->entries + i;
+
+		if(entry->hash != hash || entry->data.buf_count != count){
+			continue;
+		}
+
+		data = entry->data;
+		data.plaintext_buf = (unsigned char *) candidate;
+
+		if((retval = xorscura_compare(&data)) == -1){
+			return(-1);
+		}
+
+		if(!retval){
+			if(index){
+				*index = i;
+			}
+			return(0);
+		}
+	}
+
+	return(1);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_set_free()
+ *
+ *	Input: A pointer to the set.
+ *	Output: None.
+ *
+ *	Purpose: Wipe the set's hashes and key, and free it. The secrets' own buffers are left alone.
+ *
+ **********************************************************************************************************************/
+void xorscura_set_free(struct xorscura_set *set){
+
+	if(!set){
+		return;
+	}
+
+	if(set->entries){
+		explicit_bzero(set->entries, set->entry_count * sizeof(struct xorscura_set_entry));
+		free(set->entries);
+	}
+	free(set->buckets);
+
+	explicit_bzero(set, sizeof(struct xorscura_set));
+	free(set);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_strtab
+ *
+ *	A table of obfuscated strings, decrypted lazily. Entries are registered once with xorscura_strtab_add(). Nothing
+ *	is decrypted until an entry's first xorscura_strtab_get(), which does the decrypt under the table's lock and then
+ *	publishes the plaintext with a single atomic store. Threads racing on the same entry wait on the lock and find it
+ *	done, so no entry is ever decrypted twice. Every later get is an atomic increment and a load.
+ *
+ *	Every successful get holds a reference until its xorscura_strtab_put(). If the table has a TTL,
+ *	xorscura_strtab_sweep() wipes and frees the plaintext of each entry that has no references and hasn't been used
+ *	within the TTL. The entry's next get decrypts it again.
+ *
+ *	A sweep and a get can race on the same entry. The get bumps the reference count before it checks the state. The
+ *	sweep clears the state before it checks the reference count. Both use sequentially consistent atomics, so at
+ *	least one of them sees the other's write. Either the sweep backs off, or the get takes the locked path and waits.
+ *
+ *	Note: The table copies the xods, but not the buffers they point to. Those have to outlive the table.
+ *
+ **********************************************************************************************************************/
+
+// Entries get a cache line each, so gets of neighbouring strings don't fight over the same line.
+#define STRTAB_ALIGN	64
+
+#define STRTAB_EMPTY	0
+#define STRTAB_READY	1
+
+struct xorscura_strtab_entry {
+
+	struct xod data;
+
+	// Only valid while state is STRTAB_READY.
+	unsigned char *plaintext;
+
+	int state;
+	unsigned int refs;
+
+	// CLOCK_MONOTONIC_COARSE, in milliseconds. Only kept when the table has a TTL.
+	uint64_t last_used;
+} __attribute__((aligned(STRTAB_ALIGN)));
+
+struct xorscura_strtab {
+
+	struct xorscura_strtab_entry *entries;
+	size_t entry_count;
+	size_t capacity;
+
+	// In milliseconds. 0 means entries stay decrypted until the table is freed.
+	uint64_t ttl;
+
+	// Taken by add, by sweep, and by the first get of an entry. A get of a decrypted entry never takes it.
+	pthread_mutex_t lock;
+};
+
+static uint64_t strtab_now(void){
+
+	struct timespec ts;
+
+	// The coarse clock is a plain read of the vDSO page. Tick granularity is plenty for a TTL.
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// The locked half of xorscura_strtab_get(). The caller already holds a reference.
+static int strtab_decrypt(struct xorscura_strtab *tab, struct xorscura_strtab_entry *entry){
+
+	struct xod data;
+	unsigned char *plaintext;
+	int retval = 0;
+
+
+	pthread_mutex_lock(&tab->lock);
+
+	// Someone else may have got here first.
+	if(__atomic_load_n(&entry->state, __ATOMIC_RELAXED) == STRTAB_READY){
+		goto UNLOCK;
+	}
+
+	// One byte extra, for the null terminator.
+	if((plaintext = (unsigned char *) calloc(entry->data.buf_count + 1, sizeof(char))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "strtab_decrypt(): calloc(%d, %d)\n", (int) entry->data.buf_count + 1, (int) sizeof(char));
+#endif
+		retval = -1;
+		goto UNLOCK;
+	}
+
+	data = entry->data;
+	if(xorscura_decrypt_into(&data, plaintext) == -1){
+		free(plaintext);
+		retval = -1;
+		goto UNLOCK;
+	}
+
+	entry->plaintext = plaintext;
+	__atomic_store_n(&entry->state, STRTAB_READY, __ATOMIC_SEQ_CST);
+
+UNLOCK:
+	pthread_mutex_unlock(&tab->lock);
+
+	return(retval);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_strtab_new()
+ *
+ *	Input: The most entries the table will ever hold, and how long, in milliseconds, an unused entry may stay
+ *		decrypted before xorscura_strtab_sweep() wipes it. A ttl_ms of 0 means never.
+ *
+ *	Output: A pointer to the new table, or NULL on error.
+ *
+ *	Purpose: Create a string table. Release it with xorscura_strtab_free().
+ *
+ *	Note: The capacity is fixed so the entries never move, which is what lets a get go without the lock.
+ *
+ **********************************************************************************************************************/
+struct xorscura_strtab *xorscura_strtab_new(size_t capacity, unsigned int ttl_ms){
+
+	struct xorscura_strtab *tab;
+	int retval;
+
+
+	if(!capacity || capacity > SIZE_MAX / sizeof(struct xorscura_strtab_entry)){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_new(): Bad capacity: %lu\n", (unsigned long) capacity);
+#endif
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	if((tab = (struct xorscura_strtab *) calloc(1, sizeof(struct xorscura_strtab))) == NULL){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_new(): calloc(1, %d)\n", (int) sizeof(struct xorscura_strtab));
+#endif
+		return(NULL);
+	}
+
+	if((retval = posix_memalign((void **) &tab->entries, STRTAB_ALIGN, capacity * sizeof(struct xorscura_strtab_entry)))){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_new(): posix_memalign(%lx, %d, %lu)\n", (unsigned long) &tab->entries, STRTAB_ALIGN, (unsigned long) (capacity * sizeof(struct xorscura_strtab_entry)));
+#endif
+		free(tab);
+		errno = retval;
+		return(NULL);
+	}
+
+	if((retval = pthread_mutex_init(&tab->lock, NULL))){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_new(): pthread_mutex_init(%lx, NULL)\n", (unsigned long) &tab->lock);
+#endif
+		free(tab->entries);
+		free(tab);
+		errno = retval;
+		return(NULL);
+	}
+
+	tab->capacity = capacity;
+	tab->ttl = ttl_ms;
+
+	return(tab);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_strtab_add()
+ *
+ *	Input: A pointer to the table, a pointer to an xod set up as for xorscura_decrypt(), and somewhere to put the
+ *		new entry's id.
+ *
+ *	Output: 0 on success, -1 on error. ENOSPC if the table is full.
+ *
+ *	Purpose: Register a string. It won't be decrypted until its first xorscura_strtab_get().
+ *
+ *	Note: Ids are handed out in order, starting at 0. Safe to call while other threads are getting.
+ *
+ **********************************************************************************************************************/
+int xorscura_strtab_add(struct xorscura_strtab *tab, struct xod *data, size_t *id){
+
+	struct xorscura_strtab_entry *entry;
+	size_t i;
+
+
+	if(!data->ciphertext_buf && data->buf_count){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_add(): No ciphertext_buf.\n");
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&tab->lock);
+
+	if((i = tab->entry_count) == tab->capacity){
+		pthread_mutex_unlock(&tab->lock);
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_add(): Table full: %lu\n", (unsigned long) tab->capacity);
+#endif
+		errno = ENOSPC;
+		return(-1);
+	}
+
+	entry = tab->entries + i;
+	memset(entry, 0, sizeof(struct xorscura_strtab_entry));
+	entry->data = *data;
+	entry->data.plaintext_buf = NULL;
+	entry->data.alloc_flag = 0;
+
+	// Published last, so a get never sees a half written entry.
+	__atomic_store_n(&tab->entry_count, i + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&tab->lock);
+
+	*id = i;
+
+	return(0);
+}
+
 
 
 /**********************************************************************************************************************
  *
- * xorscura_encrypt()
+ * xorscura_strtab_get()
  *
- *	Input: A pointer to the xod data structure.
- *		xod->plaintext_buf should have a pointer to the data to encrypt.
- *		xod->buf_count should contain the number of bytes in xod->plaintext_buf.
+ *	Input: A pointer to the table, and an entry id from xorscura_strtab_add().
  *
- *	Output: 0 on success, -1 on error.
- *		xod->ciphertext_buf will have a pointer to the ciphertext data.
- *		xod->key will have a pointer to the key data.
- *		xod->seed will have the prng seed to generate the key.
+ *	Output: The null terminated plaintext, or NULL on error.
  *
- *	Purpose: Encrypt the data pointed to in the plaintext_buf buffer.
+ *	Purpose: Get a string, decrypting it first if this is its first use (or its first since it was swept).
+ *
+ *	Note: Every get that doesn't return NULL must be matched with an xorscura_strtab_put(). The pointer stays
+ *	valid until then.
  *
  **********************************************************************************************************************/
-int xorscura_encrypt(struct xod *data){
+const char *xorscura_strtab_get(struct xorscura_strtab *tab, size_t id){
 
-	char *seed_ptr = (char *) &(data->seed);
-	size_t seed_count;
+	struct xorscura_strtab_entry *entry;
 
-	size_t key_count;
 
-	int retval;
-	int tmp_fd;
+	if(id >= __atomic_load_n(&tab->entry_count, __ATOMIC_ACQUIRE)){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_strtab_get(): Bad id: %lu\n", (unsigned long) id);
+#endif
+		errno = EINVAL;
+		return(NULL);
+	}
+	entry = tab->entries + id;
 
-	int i;
+	// The reference comes first, so a sweep can't wipe the entry between our check of state and our use of it.
+	__atomic_add_fetch(&entry->refs, 1, __ATOMIC_SEQ_CST);
 
-	char prng_state[PRNG_STATELEN];
-	struct random_data *prng_buf;
-	int32_t prng_result;
-	char *prng_result_ptr = (char *) &prng_result;
+	if(__atomic_load_n(&entry->state, __ATOMIC_SEQ_CST) != STRTAB_READY && strtab_decrypt(tab, entry) == -1){
+		__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_RELEASE);
+		return(NULL);
+	}
 
+	if(tab->ttl){
+		__atomic_store_n(&entry->last_used, strtab_now(), __ATOMIC_RELAXED);
+	}
 
-	if(!data){
+	return((const char *) entry->plaintext);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_strtab_put()
+ *
+ *	Input: A pointer to the table, and the id of an entry returned by xorscura_strtab_get().
+ *	Output: None.
+ *
+ *	Purpose: Drop the reference a get took. Once every reference is gone, a sweep may wipe the entry.
+ *
+ **********************************************************************************************************************/
+void xorscura_strtab_put(struct xorscura_strtab *tab, size_t id){
+
+	if(id >= __atomic_load_n(&tab->entry_count, __ATOMIC_ACQUIRE)){
+		return;
+	}
+
+	// Release, so our reads of the plaintext are done before a sweep that sees the count drop can free it.
+	__atomic_sub_fetch(&tab->entries[id].refs, 1, __ATOMIC_RELEASE);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_strtab_sweep()
+ *
+ *	Input: A pointer to the table.
+ *	Output: How many entries were wiped.
+ *
+ *	Purpose: Wipe and free the plaintext of every entry that nobody holds and that hasn't been used within the TTL.
+ *
+ *	Note: Nothing happens on its own. Call this from wherever suits, such as a timer or the top of a main loop.
+ *	Gets of other entries are not held up while it runs.
+ *
+ **********************************************************************************************************************/
+size_t xorscura_strtab_sweep(struct xorscura_strtab *tab){
+
+	struct xorscura_strtab_entry *entry;
+	uint64_t now;
+	size_t wiped = 0;
+	size_t i;
+
+
+	if(!tab->ttl){
+		return(0);
+	}
+
+	now = strtab_now();
+
+	pthread_mutex_lock(&tab->lock);
+
+	for(i = 0; i < tab->entry_count; i++){
+		entry = tab->entries + i;
+
+		if(__atomic_load_n(&entry->state, __ATOMIC_RELAXED) != STRTAB_READY || __atomic_load_n(&entry->refs, __ATOMIC_RELAXED)){
+			continue;
+		}
+
+		// A get may have stamped it after we read the clock. That's still recent.
+		if(now < __atomic_load_n(&entry->last_used, __ATOMIC_RELAXED) + tab->ttl){
+			continue;
+		}
+
+		__atomic_store_n(&entry->state, STRTAB_EMPTY, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&entry->refs, __ATOMIC_SEQ_CST)){
+			__atomic_store_n(&entry->state, STRTAB_READY, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		explicit_bzero(entry->plaintext, entry->data.buf_count);
+		free(entry->plaintext);
+		entry->plaintext = NULL;
+		wiped++;
+	}
+
+	pthread_mutex_unlock(&tab->lock);
+
+	return(wiped);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_strtab_free()
+ *
+ *	Input: A pointer to the table.
+ *	Output: None.
+ *
+ *	Purpose: Wipe every decrypted string, and free the table.
+ *
+ *	Note: Nothing else may be using the table, and every pointer a get returned is invalid afterwards.
+ *
+ **********************************************************************************************************************/
+void xorscura_strtab_free(struct xorscura_strtab *tab){
+
+	size_t i;
+
+
+	if(!tab){
+		return;
+	}
+
+	for(i = 0; i < tab->entry_count; i++){
+		if(tab->entries[i].plaintext){
+			explicit_bzero(tab->entries[i].plaintext, tab->entries[i].data.buf_count);
+			free(tab->entries[i].plaintext);
+		}
+	}
+
+	pthread_mutex_destroy(&tab->lock);
+
+	explicit_bzero(tab->entries, tab->capacity * sizeof(struct xorscura_strtab_entry));
+	free(tab->entries);
+
+	explicit_bzero(tab, sizeof(struct xorscura_strtab));
+	free(tab);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_arena
+ *
+ *	A pool for the buffers libxorscura allocates on an xod's behalf. Point xod->arena at one, and the plaintext,
+ *	ciphertext, and key buffers that encrypt and decrypt hand back come out of it instead of the heap.
+ *	xorscura_free_xod() hands them back to it, wiped.
+ *
+ *	Small buffers come from power of two size classes, 64 bytes to 64KiB with the block header included. Each class
+ *	is carved out of 256KiB slabs, and released blocks go onto a free list for that class. Anything larger gets a
+ *	mapping of its own, unmapped on release. Slabs are only unmapped when the arena is freed.
+ *
+ *	Every block is wiped as it's released, and a fresh slab is zero, so blocks are always handed out zeroed. The same
+ *	goes for xorscura_arena_reset(), which wipes everything the arena has handed out in one pass.
+ *
+ *	XORSCURA_ARENA_MLOCK pins the arena's memory, so secrets never reach swap. XORSCURA_ARENA_NODUMP keeps them out
+ *	of core dumps. Both apply per mapping, as each slab is made.
+ *
+ *	Note: An arena has a lock of its own, so xods in different threads may share one. Giving each thread its own
+ *	keeps them from contending.
+ *
+ **********************************************************************************************************************/
+
+// Block sizes run from 1 << ARENA_CLASS_MIN, doubling for ARENA_CLASSES classes.
+#define ARENA_CLASS_MIN	6
+#define ARENA_CLASSES	11
+#define ARENA_BLOCK_MAX	((size_t) 1 << (ARENA_CLASS_MIN + ARENA_CLASSES - 1))
+
+#define ARENA_SLAB_SIZE	(256 * 1024)
+
+// Sits right in front of every buffer the arena hands out.
+struct arena_block {
+	struct xorscura_arena *arena;
+
+	// Bytes asked for. These are the ones that get wiped.
+	size_t count;
+};
+
+#define ARENA_PAYLOAD_MAX	(ARENA_BLOCK_MAX - sizeof(struct arena_block))
+
+// At the start of each slab. The blocks follow.
+struct arena_slab {
+	struct arena_slab *next;
+	size_t used;
+};
+
+// At the start of each mapping for a buffer too large for any class.
+struct arena_large {
+	struct arena_large *prev;
+	struct arena_large *next;
+	size_t map_size;
+	size_t pad;
+
+	struct arena_block block;
+};
+
+struct xorscura_arena {
+
+	pthread_mutex_t lock;
+	int flags;
+
+	// The free lists are linked through the first bytes of each free block's buffer.
+	unsigned char *free_list[ARENA_CLASSES];
+
+	// In the order they were made. Blocks are carved from current, then whichever follow it.
+	struct arena_slab *slabs;
+	struct arena_slab *current;
+
+	struct arena_large *large;
+};
+
+static size_t arena_class(size_t count){
+
+	size_t need;
+
+
+	need = count + sizeof(struct arena_block);
+	if(need <= ((size_t) 1 << ARENA_CLASS_MIN)){
+		return(0);
+	}
+
+	return((8 * sizeof(unsigned long long) - __builtin_clzll(need - 1)) - ARENA_CLASS_MIN);
+}
+
+// A zeroed mapping, pinned and hidden as the arena's flags ask.
+static void *arena_map(struct xorscura_arena *arena, size_t size){
+
+	void *map;
+	int saved_errno;
+
+
+	if((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
 #ifdef DEBUG
-		fprintf(stderr, "xorscura_encrypt(): No data!\n");
+		fprintf(stderr, "arena_map(): mmap(NULL, %lu, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)\n", (unsigned long) size);
 #endif
-		return(-1);
+		return(NULL);
 	}
 
-	// Initialize prng seed straight from urandom.
-	if((tmp_fd = open("/dev/urandom", O_RDONLY)) == -1){
+	if((arena->flags & XORSCURA_ARENA_MLOCK) && mlock(map, size) == -1){
 #ifdef DEBUG
-		fprintf(stderr, "xorscura_encrypt(): open(\"/dev/urandom\")\n");
+		fprintf(stderr, "arena_map(): mlock(%lx, %lu)\n", (unsigned long) map, (unsigned long) size);
 #endif
-		return(-1);
+		goto UNMAP;
 	}
 
-	seed_count = 0;
-	while((retval = read(tmp_fd, seed_ptr + seed_count, (int) (sizeof(unsigned int) - seed_count))) != (int) (sizeof(data->seed) - seed_count)){
-		if(retval == -1){
+	if((arena->flags & XORSCURA_ARENA_NODUMP) && madvise(map, size, MADV_DONTDUMP) == -1){
 #ifdef DEBUG
-			fprintf(stderr, "xorscura_encrypt(): read(%d, 0x%lx, %d)\n", tmp_fd, (unsigned long) (seed_ptr + seed_count), (int) (sizeof(data->seed) - seed_count));
+		fprintf(stderr, "arena_map(): madvise(%lx, %lu, MADV_DONTDUMP)\n", (unsigned long) map, (unsigned long) size);
 #endif
-		return(-1);
+		goto UNMAP;
+	}
+
+	return(map);
+
+UNMAP:
+	saved_errno = errno;
+	munmap(map, size);
+	errno = saved_errno;
+
+	return(NULL);
+}
+
+static unsigned char *arena_alloc_large(struct xorscura_arena *arena, size_t count){
+
+	struct arena_large *large;
+	size_t map_size;
+	long page_size;
+
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if(count > SIZE_MAX - sizeof(struct arena_large) - page_size){
+		errno = ENOMEM;
+		return(NULL);
+	}
+	map_size = (sizeof(struct arena_large) + count + page_size - 1) & ~((size_t) page_size - 1);
+
+	if((large = (struct arena_large *) arena_map(arena, map_size)) == NULL){
+		return(NULL);
+	}
+
+	large->map_size = map_size;
+	large->next = arena->large;
+	if(arena->large){
+		arena->large->prev = large;
+	}
+	arena->large = large;
+
+	return((unsigned char *) (&large->block + 1));
+}
+
+static unsigned char *arena_alloc_small(struct xorscura_arena *arena, size_t class){
+
+	struct arena_slab *slab;
+	unsigned char *buf;
+	size_t block_size;
+
+
+	if((buf = arena->free_list[class])){
+		memcpy(&arena->free_list[class], buf, sizeof(unsigned char *));
+		memset(buf, 0, sizeof(void *));
+		return(buf);
+	}
+
+	block_size = (size_t) 1 << (class + ARENA_CLASS_MIN);
+
+	// Carve it from the first slab with room, mapping a new one once they're all full.
+	while(!arena->current || arena->current->used + block_size > ARENA_SLAB_SIZE){
+		if(arena->current && arena->current->next){
+			arena->current = arena->current->next;
+			continue;
+		}
+
+		if((slab = (struct arena_slab *) arena_map(arena, ARENA_SLAB_SIZE)) == NULL){
+			return(NULL);
+		}
+		slab->used = sizeof(struct arena_slab);
+
+		if(arena->current){
+			arena->current->next = slab;
+		}else{
+			arena->slabs = slab;
 		}
-		seed_count += retval;
+		arena->current = slab;
 	}
-	seed_count += retval;
-	close(tmp_fd);
 
-	// Initialize the buffers we plan to fill.
-	if((data->ciphertext_buf = (unsigned char *) calloc(data->buf_count, sizeof(char))) == NULL){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_encrypt(): calloc(%d, %d)\n", (int) data->buf_count, (int)sizeof(char));
-#endif
-		return(-1);
+	buf = (unsigned char *) arena->current + arena->current->used + sizeof(struct arena_block);
+	arena->current->used += block_size;
+
+	return(buf);
+}
+
+// A zeroed buffer of count bytes from the arena, or NULL on error.
+static unsigned char *arena_alloc(struct xorscura_arena *arena, size_t count){
+
+	struct arena_block *block;
+	unsigned char *buf;
+
+
+	pthread_mutex_lock(&arena->lock);
+
+	if(count > ARENA_PAYLOAD_MAX){
+		buf = arena_alloc_large(arena, count);
+	}else{
+		buf = arena_alloc_small(arena, arena_class(count));
 	}
-	data->alloc_flag |= ALLOC_CIPHERTEXT;
 
-  if((data->key_buf = (unsigned char *) calloc(data->buf_count, sizeof(char))) == NULL){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_encrypt(): calloc(%d, %d)\n", (int) data->buf_count, (int) sizeof(char));
-#endif
-    return(-1);
-  }
-	data->alloc_flag |= ALLOC_KEY;
+	if(buf){
+		block = (struct arena_block *) buf - 1;
+		block->arena = arena;
+		block->count = count;
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+
+	return(buf);
+}
+
+// Wipe a buffer from arena_alloc(), and give it back to the arena it came from.
+static void arena_release(unsigned char *buf){
+
+	struct xorscura_arena *arena;
+	struct arena_block *block;
+	struct arena_large *large;
+	size_t class;
+
+
+	block = (struct arena_block *) buf - 1;
+	arena = block->arena;
+
+	pthread_mutex_lock(&arena->lock);
+
+	explicit_bzero(buf, block->count);
+
+	if(block->count > ARENA_PAYLOAD_MAX){
+		large = (struct arena_large *) ((unsigned char *) block - offsetof(struct arena_large, block));
+
+		if(large->prev){
+			large->prev->next = large->next;
+		}else{
+			arena->large = large->next;
+		}
+		if(large->next){
+			large->next->prev = large->prev;
+		}
+
+		munmap(large, large->map_size);
+
+	}else{
+		class = arena_class(block->count);
+		memcpy(buf, &arena->free_list[class], sizeof(unsigned char *));
+		arena->free_list[class] = buf;
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+}
+
+// Drops every large mapping, and wipes and rewinds every slab. The caller holds the lock.
+static void arena_clear(struct xorscura_arena *arena){
+
+	struct arena_large *large;
+	struct arena_slab *slab;
+
+
+	while((large = arena->large)){
+		arena->large = large->next;
+		explicit_bzero(&large->block + 1, large->block.count);
+		munmap(large, large->map_size);
+	}
+
+	for(slab = arena->slabs; slab; slab = slab->next){
+		explicit_bzero(slab + 1, slab->used - sizeof(struct arena_slab));
+		slab->used = sizeof(struct arena_slab);
+	}
+	arena->current = arena->slabs;
+
+	memset(arena->free_list, 0, sizeof(arena->free_list));
+}
+
+// A zeroed buffer for the xod, from xod->arena if it has one or the heap if not. Marks it in alloc_flag as flag.
+static unsigned char *xod_alloc(struct xod *data, size_t count, unsigned char flag){
 
-	// Initialize the prng.
-	if((prng_buf = (struct random_data *) calloc(1, sizeof(struct random_data))) == NULL){
+	unsigned char *buf;
+
+
+	if(data->arena){
+		buf = arena_alloc(data->arena, count);
+	}else{
+		buf = (unsigned char *) calloc(count, sizeof(char));
+	}
+
+	if(buf){
+		STATS_ADD(allocs, 1);
+		data->alloc_flag |= flag;
+		if(data->arena){
+			data->alloc_flag |= ALLOC_ARENA(flag);
+		}
+	}
+
+	return(buf);
+}
+
+// If buf is marked in alloc_flag as flag, wipe it, give it back to wherever it came from, and clear the mark.
+static void xod_free(struct xod *data, unsigned char *buf, unsigned char flag){
+
+	if(!(data->alloc_flag & flag)){
+		return;
+	}
+
+	if(data->alloc_flag & ALLOC_ARENA(flag)){
+		arena_release(buf);
+	}else if(buf){
+		explicit_bzero(buf, malloc_usable_size(buf));
+		free(buf);
+	}
+
+	data->alloc_flag &= ~(flag | ALLOC_ARENA(flag));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_arena_new()
+ *
+ *	Input: Zero or more of XORSCURA_ARENA_MLOCK and XORSCURA_ARENA_NODUMP, or'd together.
+ *
+ *	Output: A pointer to the new arena, or NULL on error.
+ *
+ *	Purpose: Create an arena. Release it with xorscura_arena_free().
+ *
+ *	Note: Nothing is mapped until the first allocation. With XORSCURA_ARENA_MLOCK, an allocation past
+ *	RLIMIT_MEMLOCK fails rather than going unpinned.
+ *
+ **********************************************************************************************************************/
+struct xorscura_arena *xorscura_arena_new(int flags){
+
+	struct xorscura_arena *arena;
+	int retval;
+
+
+	if(flags & ~(XORSCURA_ARENA_MLOCK | XORSCURA_ARENA_NODUMP)){
 #ifdef DEBUG
-		fprintf(stderr, "xorscura_encrypt(): calloc(1, %d)\n", (int) sizeof(struct random_data));
+		fprintf(stderr, "xorscura_arena_new(): Bad flags: %x\n", flags);
 #endif
-    return(-1);
+		errno = EINVAL;
+		return(NULL);
 	}
 
-	memset(prng_state, '\0', PRNG_STATELEN);
-	if(initstate_r(data->seed, prng_state, PRNG_STATELEN, prng_buf) == -1){
+	if((arena = (struct xorscura_arena *) calloc(1, sizeof(struct xorscura_arena))) == NULL){
 #ifdef DEBUG
-		fprintf(stderr, "xorscura_encrypt(): initstate_r(0x%x, %lx, %d, %lx)\n", data->seed, (unsigned long) prng_state, PRNG_STATELEN, (unsigned long) prng_buf);
+		fprintf(stderr, "xorscura_arena_new(): calloc(1, %d)\n", (int) sizeof(struct xorscura_arena));
 #endif
-    return(-1);
+		return(NULL);
 	}
 
-	// Generate the next random char, add it to key, and create the cipher.
-	key_count = 0;
-	while(key_count < data->buf_count){
-		if(random_r(prng_buf, &prng_result) == -1){
+	if((retval = pthread_mutex_init(&arena->lock, NULL))){
 #ifdef DEBUG
-			fprintf(stderr, "xorscura_encrypt(): random_r(%lx, %lx)\n", (unsigned long) prng_buf, (unsigned long) &prng_result);
+		fprintf(stderr, "xorscura_arena_new(): pthread_mutex_init(%lx, NULL)\n", (unsigned long) &arena->lock);
 #endif
-			return(-1);
-		}
-
-		for(i = 0; i < (int) sizeof(int32_t); i++){
-			data->key_buf[key_count] = prng_result_ptr[i];
-			data->ciphertext_buf[key_count] = data->plaintext_buf[key_count] ^ data->key_buf[key_count];
-			key_count++;
-			
-			if(key_count == data->buf_count){
-				break;
-			}
-		}
+		free(arena);
+		errno = retval;
+		return(NULL);
 	}
 
-	free(prng_buf);
+	arena->flags = flags;
 
-	return(0);
+	return(arena);
 }
 
 
 
 /**********************************************************************************************************************
  *
- * xorscura_decrypt()
+ * xorscura_arena_reset()
  *
- *	Input: A pointer to the xod data structure.
- *		xod->ciphertext_buf should have a pointer to the ciphertext data.
- *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
- *		xod->key should have a pointer to the key data *OR*
- *		xod->seed should have the prng seed needed to generate the key.
+ *	Input: A pointer to the arena.
+ *	Output: None.
  *
- *	Output: 0 on success, -1 on error.
- *		xod->plaintext_buf will have a pointer to the unencrypted data.
+ *	Purpose: Wipe and take back everything the arena has handed out, all at once. The slabs stay mapped for reuse.
  *
- *	Purpose: Decrypt the data pointed to in the ciphertext_buf buffer.
+ *	Note: Every buffer the arena handed out is invalid afterwards. Any xod still holding one should be memset() to
+ *	zero (or have its alloc_flag cleared) rather than passed to xorscura_free_xod().
  *
  **********************************************************************************************************************/
-int xorscura_decrypt(struct xod *data){
+void xorscura_arena_reset(struct xorscura_arena *arena){
 
-	int i;
+	pthread_mutex_lock(&arena->lock);
+	arena_clear(arena);
+	pthread_mutex_unlock(&arena->lock);
+}
 
 
-	// Check if we have the prng case, or straight xor of arrays.
-	if(!data->key_buf){
-		return(xorscura_decrypt_prng(data));
-	}
 
-	// Making the plaintext buf one char bigger because the common case will be a string. This allows for implicit null termination.
-	// As a result, most of the string functions should work fine against the resulting plaintext.
-	if((data->plaintext_buf = (unsigned char *) calloc(data->buf_count + 1, sizeof(char))) == NULL){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_decrypt(): calloc(%d, %d)\n", (int) data->buf_count + 1, (int) sizeof(char));
-#endif
-		return(-1);
+/**********************************************************************************************************************
+ *
+ * xorscura_arena_free()
+ *
+ *	Input: A pointer to the arena.
+ *	Output: None.
+ *
+ *	Purpose: Wipe everything the arena has handed out, unmap it all, and free the arena.
+ *
+ *	Note: The same as xorscura_arena_reset() goes for buffers still out. Nothing else may be using the arena.
+ *
+ **********************************************************************************************************************/
+void xorscura_arena_free(struct xorscura_arena *arena){
+
+	struct arena_slab *slab;
+
+
+	if(!arena){
+		return;
 	}
-	data->alloc_flag |= ALLOC_PLAINTEXT;
 
-	// Decrypt.
-	for(i = 0; i < (int) data->buf_count; i++){
-		data->plaintext_buf[i] = data->ciphertext_buf[i] ^ data->key_buf[i];
+	arena_clear(arena);
+
+	while((slab = arena->slabs)){
+		arena->slabs = slab->next;
+		munmap(slab, ARENA_SLAB_SIZE);
 	}
 
-	return(0);
+	pthread_mutex_destroy(&arena->lock);
+
+	explicit_bzero(arena, sizeof(struct xorscura_arena));
+	free(arena);
 }
 
 
 
 /**********************************************************************************************************************
  *
- * xorscura_decrypt_prng()
+ * xorscura_stats
  *
- *	Input: A pointer to the xod data structure.
- *		xod->ciphertext_buf should have a pointer to the ciphertext data.
- *		xod->buf_count should contain the number of bytes in xod->ciphertext_buf.
- *		xod->seed should have the prng seed needed to generate the key.
+ *	Counters for production profiles, to say how much of the time went on obfuscation. Off by default, and close to
+ *	free while off: every hook starts with a relaxed load of stats_enabled.
  *
- *	Output: 0 on success, -1 on error.
- *		xod->plaintext_buf will have a pointer to the unencrypted data.
+ *	Each thread counts into a cache line aligned block of its own, made the first time it counts something. Only the
+ *	owner ever writes a block, so an update is a plain load, add, and store, with no lock and no locked instruction.
+ *	The loads and stores are relaxed atomics just so a snapshot from another thread never sees a torn counter.
  *
- *	Purpose: Decrypt the data pointed to in the ciphertext_buf buffer.
+ *	The blocks of live threads are on stats_threads. When a thread exits, its block is added into stats_retired and
+ *	freed, so the parallel workers (which only live for one call) still get counted. A reset doesn't touch any of
+ *	the blocks. It records the totals in stats_baseline instead, and a snapshot subtracts them.
  *
- *	Note: This function is called inside of xorscura_decrypt_prng() after a seed check. There shouldn't be any reason
- *	to call this directly, unless you know what you're doing.
+ *	Note: Each counter is read on its own, so a snapshot taken while other threads are busy can be partway through
+ *	one of their calls. (Counted in calls but not yet in bytes, say.)
  *
  **********************************************************************************************************************/
-int xorscura_decrypt_prng(struct xod *data){
 
-	int i;
+#define STATS_WORDS	(sizeof(struct xorscura_stats) / sizeof(uint64_t))
 
-	size_t key_count;
+// Each thread's block.
+struct stats_thread {
+	struct xorscura_stats stats;
+	unsigned int depth;
+	struct stats_thread *prev;
+	struct stats_thread *next;
+};
 
-	char prng_state[PRNG_STATELEN];
-	struct random_data *prng_buf;
-	int32_t prng_result;
-	char *prng_result_ptr = (char *) &prng_result;
+static __thread struct stats_thread *stats_self = NULL;
 
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads = NULL;
+static struct xorscura_stats stats_retired;
+static struct xorscura_stats stats_baseline;
 
-	// Initialize plaintext buffer. Again, +1 to cover the general case of it being a string, allowing for string
-	// functions to be called directly on the buf by the caller.	
-	if((data->plaintext_buf = (unsigned char *) calloc(data->buf_count + 1, sizeof(char))) == NULL){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_decrypt_prng(): calloc(%d, %d)\n", (int) data->buf_count + 1, sizeof(char));
-#endif
-		return(-1);
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static int stats_key_ok = 0;
+
+// total += the counters in block.
+static void stats_sum(struct xorscura_stats *total, struct xorscura_stats *block){
+
+	uint64_t *dst = (uint64_t *) total;
+	uint64_t *src = (uint64_t *) block;
+	size_t i;
+
+	for(i = 0; i < STATS_WORDS; i++){
+		dst[i] += __atomic_load_n(src + i, __ATOMIC_RELAXED);
 	}
-	data->alloc_flag |= ALLOC_PLAINTEXT;
+}
 
-	// Initialize the prng.
-	if((prng_buf = (struct random_data *) calloc(1, sizeof(struct random_data))) == NULL){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_decrypt_prng(): calloc(1, %d)\n", (int) sizeof(struct random_data));
-#endif
-		return(-1);
+// Everything counted so far, live threads and exited ones. Call with stats_lock held.
+static void stats_total(struct xorscura_stats *total){
+
+	struct stats_thread *self;
+
+
+	memcpy(total, &stats_retired, sizeof(struct xorscura_stats));
+	for(self = stats_threads; self; self = self->next){
+		stats_sum(total, &(self->stats));
 	}
+}
 
-	memset(prng_state, '\0', PRNG_STATELEN);
-	if(initstate_r(data->seed, prng_state, PRNG_STATELEN, prng_buf) == -1){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_decrypt_prng(): initstate_r(0x%x, %lx, %d, %lx)\n", data->seed, (unsigned long) prng_state, PRNG_STATELEN, (unsigned long) prng_buf);
-#endif
-		return(-1);
+// The stats_key destructor, run as a thread exits.
+static void stats_thread_exit(void *arg){
+
+	struct stats_thread *self = (struct stats_thread *) arg;
+
+
+	pthread_mutex_lock(&stats_lock);
+
+	stats_sum(&stats_retired, &(self->stats));
+
+	if(self->prev){
+		self->prev->next = self->next;
+	}else{
+		stats_threads = self->next;
+	}
+	if(self->next){
+		self->next->prev = self->prev;
 	}
 
-	// Grab a key character, decrypt the char of ciphertext, and store it in the plaintext.
-	key_count = 0;
-	while(key_count < data->buf_count){
-		if(random_r(prng_buf, &prng_result) == -1){
-#ifdef DEBUG
-			fprintf(stderr, "xorscura_decrypt_prng(): random_r(%lx, %lx)\n", (unsigned long) prng_buf, (unsigned long) &prng_result);
-#endif
-			return(-1);
-		}
+	pthread_mutex_unlock(&stats_lock);
 
-		for(i = 0; i < (int) sizeof(int32_t); i++){
-			data->plaintext_buf[key_count] = data->ciphertext_buf[key_count] ^ prng_result_ptr[i];
-			key_count++;
+	stats_self = NULL;
+	free(self);
+}
 
-			if(key_count == data->buf_count){
-				break;
-			}
-		}
+static void stats_key_init(void){
+
+	stats_key_ok = !pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+// The calling thread's block, made on first use. NULL if it couldn't be made.
+static struct stats_thread *stats_thread(void){
+
+	struct stats_thread *self;
+
+
+	if(stats_self){
+		return(stats_self);
 	}
 
-	free(prng_buf);
+	pthread_once(&stats_once, stats_key_init);
+	if(!stats_key_ok){
+		return(NULL);
+	}
 
-	return(0);
+	if(posix_memalign((void **) &self, 64, sizeof(struct stats_thread))){
+		return(NULL);
+	}
+	memset(self, 0, sizeof(struct stats_thread));
+
+	if(pthread_setspecific(stats_key, self)){
+		free(self);
+		return(NULL);
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	self->next = stats_threads;
+	if(stats_threads){
+		stats_threads->prev = self;
+	}
+	stats_threads = self;
+	pthread_mutex_unlock(&stats_lock);
+
+	stats_self = self;
+
+	return(self);
 }
 
+static void stats_add(uint64_t *counter, uint64_t count){
 
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + count, __ATOMIC_RELAXED);
+}
 
-/**********************************************************************************************************************
- *
- * xorscura_compare()
- *
- *	Input: A pointer to the xod data structure.
- *		xod->plaintext_buf should have a pointer to the unencrypted data.
- *		xod->buf_count should contain the number of bytes in xod->plaintext_buf.
- *		xod->ciphertext_buf should have a pointer to the ciphertext data.
- *		xod->key should have a pointer to the key data *OR*
- *		xod->seed should have the prng seed needed to generate the key.
- *
- *	Output: 0 on match, 1 on non-match, -1 on error.
- *
- *	Purpose: Compare the plaintext and ciphertext strings in a way that won't leave the secret exposed in memory.
- *
- *	Note: 0 on match is a behavior we chose in an attempt to mimic the behavior of the strcmp() function.
- *
- **********************************************************************************************************************/
-int xorscura_compare(struct xod *data){
+static uint64_t stats_now(void){
 
-	int i;
-	char tmp_char;
+	struct timespec ts;
 
 
-	// Check if we have the prng case, or straight xor of arrays.
-	if(!data->key_buf){
-		return(xorscura_compare_prng(data));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+// Everything past the STATS_ON() checks stays out of line, so the checks are all that gets inlined.
+__attribute__((noinline))
+static void stats_count(size_t offset, uint64_t count){
+
+	struct stats_thread *self;
+
+
+	if((self = stats_thread())){
+		stats_add((uint64_t *) ((unsigned char *) &(self->stats) + offset), count);
 	}
+}
 
-	// Compare.
-	for(i = 0; i < (int) data->buf_count; i++){
-		tmp_char = (data->ciphertext_buf[i] ^ data->key_buf[i]);
-		if((data->plaintext_buf[i]) != tmp_char){
-			return(1);
-		}
+// The depth count keeps the ops that call other ops (decrypt calling decrypt_prng, say) from being counted twice.
+__attribute__((noinline))
+static void stats_start(struct stats_timer *timer){
+
+	if((timer->self = stats_thread()) && !timer->self->depth++){
+		timer->start = stats_now();
 	}
+}
 
-	return(0);
+__attribute__((noinline))
+static void stats_stop(struct stats_timer *timer){
+
+	struct stats_thread *self = timer->self;
+	uint64_t elapsed;
+	int bucket;
+
+
+	if(--self->depth){
+		return;
+	}
+
+	elapsed = stats_now() - timer->start;
+	bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+	if(bucket >= XORSCURA_STATS_BUCKETS){
+		bucket = XORSCURA_STATS_BUCKETS - 1;
+	}
+
+	stats_add(&(self->stats.calls[timer->op]), 1);
+	stats_add(&(self->stats.bytes[timer->op]), timer->bytes);
+	stats_add(&(self->stats.latency[timer->op][bucket]), 1);
+}
+
+static inline struct stats_timer stats_begin(int op, size_t bytes){
+
+	struct stats_timer timer = {NULL, op, bytes, 0};
+
+
+	if(STATS_ON()){
+		stats_start(&timer);
+	}
+
+	return(timer);
+}
+
+static inline void stats_end(struct stats_timer *timer){
+
+	if(timer->self){
+		stats_stop(timer);
+	}
 }
 
 
 
 /**********************************************************************************************************************
  *
- * xorscura_compare_prng()
- *
- *	Input: A pointer to the xod data structure.
- *		xod->plaintext_buf should have a pointer to the unencrypted data.
- *		xod->buf_count should contain the number of bytes in xod->plaintext_buf.
- *		xod->ciphertext_buf should have a pointer to the ciphertext data.
- *		xod->seed should have the prng seed needed to generate the key.
- *
- *	Output: 0 on match, 1 on non-match, -1 on error.
- *
- *	Purpose: Compare the plaintext and ciphertext strings in a way that won't leave the secret exposed in memory.
+ * xorscura_stats_enable()
  *
- *	Note: 0 on match is a behavior we chose in an attempt to mimic the behavior of the strcmp() function.
+ *	Input: Non-zero to start counting, 0 to stop.
+ *	Output: None.
  *
- *	Note: This function is called inside of xorscura_compare_prng() after a seed check. There shouldn't be any reason
- *	to call this directly, unless you know what you're doing.
+ *	Purpose: Turn the counters on or off, for every thread. Stopping keeps what has been counted so far.
  *
  **********************************************************************************************************************/
-int xorscura_compare_prng(struct xod *data){
+void xorscura_stats_enable(int enable){
+
+	__atomic_store_n(&stats_enabled, !!enable, __ATOMIC_RELAXED);
+}
 
-	int i;
 
-	size_t key_count;
 
-	char prng_state[PRNG_STATELEN];
-	struct random_data *prng_buf;
-	int32_t prng_result;
-	char *prng_result_ptr = (char *) &prng_result;
+/**********************************************************************************************************************
+ *
+ * xorscura_stats_snapshot()
+ *
+ *	Input: A pointer to the stats to fill in.
+ *	Output: None.
+ *
+ *	Purpose: Report everything counted since the last xorscura_stats_reset(), added up over all threads.
+ *
+ **********************************************************************************************************************/
+void xorscura_stats_snapshot(struct xorscura_stats *stats){
 
-	char tmp_char;
+	uint64_t *dst = (uint64_t *) stats;
+	uint64_t *base = (uint64_t *) &stats_baseline;
+	size_t i;
 
 
-	// Initialize the prng.
-	if((prng_buf = (struct random_data *) calloc(1, sizeof(struct random_data))) == NULL){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_compare_prng(): calloc(1, %d)\n", (int) sizeof(struct random_data));
-#endif
-		return(-1);
-	}
+	pthread_mutex_lock(&stats_lock);
 
-	memset(prng_state, '\0', PRNG_STATELEN);
-	if(initstate_r(data->seed, prng_state, PRNG_STATELEN, prng_buf) == -1){
-#ifdef DEBUG
-		fprintf(stderr, "xorscura_compare_prng(): initstate_r(0x%x, %lx, %d, %lx)\n", data->seed, (unsigned long) prng_state, PRNG_STATELEN, (unsigned long) prng_buf);
-#endif
-		return(-1);
+	stats_total(stats);
+	for(i = 0; i < STATS_WORDS; i++){
+		dst[i] -= base[i];
 	}
 
-	key_count = 0;
-	while(key_count < data->buf_count){
-		if(random_r(prng_buf, &prng_result) == -1){
-#ifdef DEBUG
-			fprintf(stderr, "xorscura_compare_prng(): random_r(%lx, %lx)\n", (unsigned long) prng_buf, (unsigned long) &prng_result);
-#endif
-			return(-1);
-		}
+	pthread_mutex_unlock(&stats_lock);
+}
 
-		// Generate key char, decrypt cipher char, and compare with plain char.
-		for(i = 0; i < (int) sizeof(int32_t); i++){
-			tmp_char = (data->ciphertext_buf[key_count] ^ prng_result_ptr[i]);
-			if((data->plaintext_buf[key_count]) != tmp_char){
-				free(prng_buf);
-				return(1);
-			}
-			key_count++;
 
-			if(key_count == data->buf_count){
-				break;
-			}
-		}
-	}
 
-	free(prng_buf);
+/**********************************************************************************************************************
+ *
+ * xorscura_stats_reset()
+ *
+ *	Input: None.
+ *	Output: None.
+ *
+ *	Purpose: Start the counters over from zero, for every thread.
+ *
+ **********************************************************************************************************************/
+void xorscura_stats_reset(void){
 
-	return(0);
+	pthread_mutex_lock(&stats_lock);
+	stats_total(&stats_baseline);
+	pthread_mutex_unlock(&stats_lock);
 }
 
 
@@ -399,30 +5364,23 @@ int xorscura_compare_prng(struct xod *data){
  *	Input: A pointer to the xod data structure.
  *	Output: None.
  *
- *	Purpose: Clear the xod data structure. free() anything we malloc()d. Zero/NULL everything out. 
+ *	Purpose: Clear the xod data structure. Wipe and free() anything we malloc()d. Zero/NULL everything out. 
  *
  *	Note: Does not free the xod structure itself.
- *	Note: The buffers we malloc()d will be tracked with bitwise flags in alloc_flag. Those buffers will be free()d.
+ *	Note: The buffers we malloc()d will be tracked with bitwise flags in alloc_flag. Those buffers will be wiped, then
+ *	free()d, or handed back to the arena they came from.
+ *	Note: xod->arena is left as is, so the xod can go around again with the same arena.
  *
  **********************************************************************************************************************/
 void xorscura_free_xod(struct xod *data){
 
-	if(data->alloc_flag & ALLOC_PLAINTEXT){
-		free(data->plaintext_buf);
-		data->alloc_flag &= !ALLOC_PLAINTEXT;
-	}
+	xod_free(data, data->plaintext_buf, ALLOC_PLAINTEXT);
 	data->plaintext_buf = NULL;
 
-	if(data->alloc_flag & ALLOC_CIPHERTEXT){
-		free(data->ciphertext_buf);
-		data->alloc_flag &= !ALLOC_CIPHERTEXT;
-	}
+	xod_free(data, data->ciphertext_buf, ALLOC_CIPHERTEXT);
 	data->ciphertext_buf = NULL;
 
-	if(data->alloc_flag & ALLOC_KEY){
-		free(data->key_buf);
-		data->alloc_flag &= !ALLOC_KEY;
-	}
+	xod_free(data, data->key_buf, ALLOC_KEY);
 	data->key_buf = NULL;
 
 	data->seed = 0;
@@ -438,6 +5396,7 @@ void xorscura_debug_xod(struct xod *data){
   printf("DEBUG: xorscura_debug_xod(): alloc_flag: %d\n", data->alloc_flag);
   printf("DEBUG: xorscura_debug_xod(): buf_count: %d\n", (int) data->buf_count);
   printf("DEBUG: xorscura_debug_xod(): seed: %u\n", data->seed);
+  printf("DEBUG: xorscura_debug_xod(): key_count: %d\n", (int) data->key_count);
 
 	printf("DEBUG: xorscura_debug_xod(): plaintext_buf: %lx\n", (unsigned long) data->plaintext_buf);
 	if(data->plaintext_buf){
@@ -460,7 +5419,7 @@ void xorscura_debug_xod(struct xod *data){
 	printf("DEBUG: xorscura_debug_xod(): key_buf: %lx\n", (unsigned long) data->key_buf);
 	if(data->key_buf){
 		printf("DEBUG: xorscura_debug_xod(): *key_buf: ");
-		for(i = 0; i < data->buf_count; i++){
+		for(i = 0; i < (data->key_count ? data->key_count : data->buf_count); i++){
 			printf("%02x", data->key_buf[i]);
 		}
 		printf("\n");
@@ -469,3 +5428,77 @@ void xorscura_debug_xod(struct xod *data){
 }
 
 
+
+/**********************************************************************************************************************
+ *
+ * xorscura_kernel()
+ *
+ *	Input: None.
+ *	Output: A pointer to a static string naming the xor kernel in use. ("scalar", "sse2", "avx2", or "avx512f".)
+ *
+ *	Purpose: Report which xor kernel was selected for this cpu. Handy for benchmarks and bug reports.
+ *
+ **********************************************************************************************************************/
+const char *xorscura_kernel(void){
+
+	select_kernels();
+
+	return(__atomic_load_n(&kernel_name, __ATOMIC_RELAXED));
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_parallel_set()
+ *
+ *	Input: A pointer to the new parallel mode settings.
+ *		config->threads is the most threads to split a buffer across, counting the caller's. 0 means one per
+ *		online cpu, and 1 turns parallel mode off.
+ *		config->chunk_size is the unit buffers are split into. No thread gets less than one chunk.
+ *		config->threshold is the smallest buf_count worth splitting.
+ *
+ *	Output: 0 on success, -1 (EINVAL) if chunk_size is 0.
+ *
+ *	Purpose: Turn parallel mode on or off, and tune it. The settings are process wide and apply to xorscura_encrypt()
+ *	and every decrypt. Compares stay on the calling thread, since they stop at the first difference.
+ *
+ *	Note: A seed mode thread has to jump its random_r keystream to the start of its chunks, which costs some tens
+ *	of microseconds. Keep chunk_size in the megabytes for random_r. chacha8 seeks for free.
+ *
+ **********************************************************************************************************************/
+int xorscura_parallel_set(const struct xorscura_parallel *config){
+
+	if(!config->chunk_size){
+#ifdef DEBUG
+		fprintf(stderr, "xorscura_parallel_set(): chunk_size can't be 0!\n");
+#endif
+		errno = EINVAL;
+		return(-1);
+	}
+
+	__atomic_store_n(&parallel_threads, config->threads, __ATOMIC_RELAXED);
+	__atomic_store_n(&parallel_chunk_size, config->chunk_size, __ATOMIC_RELAXED);
+	__atomic_store_n(&parallel_threshold, config->threshold, __ATOMIC_RELAXED);
+
+	return(0);
+}
+
+
+
+/**********************************************************************************************************************
+ *
+ * xorscura_parallel_get()
+ *
+ *	Input: A pointer to a struct xorscura_parallel to fill.
+ *	Output: None.
+ *
+ *	Purpose: Report the current parallel mode settings.
+ *
+ **********************************************************************************************************************/
+void xorscura_parallel_get(struct xorscura_parallel *config){
+
+	config->threads = __atomic_load_n(&parallel_threads, __ATOMIC_RELAXED);
+	config->chunk_size = __atomic_load_n(&parallel_chunk_size, __ATOMIC_RELAXED);
+	config->threshold = __atomic_load_n(&parallel_threshold, __ATOMIC_RELAXED);
+}
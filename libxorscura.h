@@ -1,17 +1,35 @@
 
+#ifndef LIBXORSCURA_H
+#define LIBXORSCURA_H
+
+// g++ defines this on its own.
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 
 #include <errno.h>
+#include <endian.h>
 #include <error.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 
+// For C++. (See also xorscura.hpp.)
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
 	 From initstate() manpage:
 	 Current "optimal" values for the size of the state array n are 8, 32, 64, 128, and 256 bytes;
@@ -22,11 +40,38 @@
 // Uncomment to enable verbose error messages.
 //#define DEBUG
 
+// Keystream algorithms for the xod algorithm field. These values are stored alongside ciphertexts, so they are
+// never renumbered or reused. New algorithms get new numbers.
+#define XORSCURA_ALG_RANDOM_R	0	// glibc random_r(), TYPE_4. Sequential, and the default.
+#define XORSCURA_ALG_CHACHA8	1	// ChaCha, 8 rounds, keyed by the seed. Counter based: O(1) seeking.
+
+// Keystream generator state. The fields are private to libxorscura. They're only out here so the state can be
+// embedded in a struct xorscura_stream on the caller's stack.
+#define XORSCURA_PRNG_DEG	63
+#define XORSCURA_KEYSTREAM_WORDS	64
+
+struct xorscura_prng {
+	uint32_t window[XORSCURA_PRNG_DEG];
+};
+
+struct xorscura_keystream {
+	unsigned char algorithm;
+	unsigned int seed;
+	struct xorscura_prng prng;
+	uint64_t counter;
+};
+
 // Bitwise flags for use in the xod alloc_flag value.
 #define ALLOC_PLAINTEXT	1
 #define ALLOC_CIPHERTEXT	2
 #define ALLOC_KEY	4
 
+// The longest key xod->key_count can ask for. See struct xod.
+#define XORSCURA_KEY_MAX	4096
+
+// See xorscura_arena_new().
+struct xorscura_arena;
+
 // xorscura object data
 struct xod {
 
@@ -42,8 +87,23 @@ struct xod {
 	// Or flip this flag, then we'll free() the memory in xorscura_free_xod().
 	unsigned char alloc_flag;
 
+	// Which keystream the seed drives. (XORSCURA_ALG_*) A calloc()d xod gets XORSCURA_ALG_RANDOM_R.
+	unsigned char algorithm;
+
+	// If set, the buffers libxorscura allocates for this xod come from here, rather than the heap. A calloc()d xod
+	// gets the heap.
+	struct xorscura_arena *arena;
+
+	// If set, the key is only this many bytes (at most XORSCURA_KEY_MAX), repeated over the data. key_buf then holds
+	// just key_count bytes. In seed mode the key is the first key_count bytes of the keystream, so a seed works on
+	// either kind of ciphertext as long as key_count goes with it. 0 (a calloc()d xod) is a key as long as the data.
+	size_t key_count;
+
 };
 
+// Fill xod->seed from /dev/urandom. xorscura_encrypt() does this on its own.
+int xorscura_seed(struct xod *data);
+
 int xorscura_encrypt(struct xod *data);
 int xorscura_decrypt(struct xod *data);
 
@@ -57,9 +117,244 @@ int xorscura_compare(struct xod *data);
 int xorscura_decrypt_prng(struct xod *data);
 int xorscura_compare_prng(struct xod *data);
 
-// Clears out the xod data structure. Does not free the struct itself.
+// Decrypt only bytes [offset, offset + count) of the ciphertext into a new count + 1 byte plaintext_buf.
+// Seed mode jumps straight to offset instead of generating the whole keystream before it.
+int xorscura_decrypt_range(struct xod *data, size_t offset, size_t count);
+
+// Zero allocation decrypts. The _into() versions write to a caller supplied buffer (no null terminator) and leave
+// the xod alone. xorscura_decrypt_inplace() overwrites ciphertext_buf with the plaintext.
+int xorscura_decrypt_into(struct xod *data, unsigned char *out);
+int xorscura_decrypt_range_into(struct xod *data, size_t offset, size_t count, unsigned char *out);
+int xorscura_decrypt_inplace(struct xod *data);
+
+// Decrypt or compare a whole array of xods. Short random_r strings are seeded several at a time, which makes bulk
+// decoding of a string table much cheaper than a loop over xorscura_decrypt(). results[i] gets what
+// xorscura_compare() would return for arr[i].
+int xorscura_decrypt_batch(struct xod *arr, size_t n);
+int xorscura_compare_batch(struct xod *arr, size_t n, int *results);
+
+// A read only handle on one secret, for many threads to decrypt and compare against at once with no locking. The
+// functions take it const and write only to their own outputs. It points at the xod's ciphertext and key, which have
+// to outlive it. Fields are private. decrypt writes buf_count bytes (no null terminator) to out.
+struct xorscura_secret {
+	const unsigned char *ciphertext_buf;
+	const unsigned char *key_buf;
+	size_t key_count;
+	size_t buf_count;
+	unsigned int seed;
+	unsigned char algorithm;
+} __attribute__((aligned(64)));
+
+int xorscura_secret_init(struct xorscura_secret *secret, const struct xod *data);
+int xorscura_secret_decrypt(const struct xorscura_secret *secret, unsigned char *out);
+int xorscura_secret_decrypt_range(const struct xorscura_secret *secret, size_t offset, size_t count, unsigned char *out);
+int xorscura_secret_compare(const struct xorscura_secret *secret, const unsigned char *plain, size_t count);
+
+// Parallel mode, for big buffers. Off (threads = 1) by default. Once on, encrypts and decrypts of at least
+// threshold bytes are cut into chunk_size pieces and split across threads (0 = one per cpu). Process wide.
+struct xorscura_parallel {
+	unsigned int threads;
+	size_t chunk_size;
+	size_t threshold;
+};
+
+int xorscura_parallel_set(const struct xorscura_parallel *config);
+void xorscura_parallel_get(struct xorscura_parallel *config);
+
+// Incremental processing for data that doesn't fit (or doesn't arrive) in one piece. init picks the keystream up
+// from the xod (key_buf, or seed and algorithm) at a byte offset, update xors the next chunk, and final wipes the
+// state. Fields are private.
+struct xorscura_stream {
+	struct xorscura_keystream ks;
+	const unsigned char *key_buf;
+	size_t offset;
+
+	uint32_t block[XORSCURA_KEYSTREAM_WORDS];
+	size_t block_count;
+	size_t block_pos;
+
+	// A short key (xod->key_count) made from the seed lives here. Last, so init and final only touch what's used.
+	size_t key_count;
+	unsigned char cycle[XORSCURA_KEY_MAX];
+};
+
+int xorscura_stream_init(struct xorscura_stream *stream, struct xod *data, size_t offset);
+int xorscura_stream_update(struct xorscura_stream *stream, const unsigned char *in, unsigned char *out, size_t count);
+int xorscura_stream_compare(struct xorscura_stream *stream, const unsigned char *plain, const unsigned char *cipher, size_t count);
+void xorscura_stream_final(struct xorscura_stream *stream);
+
+// Decrypt a window (at most 64KiB, 0 for the most) at a time, into a buffer on the stack. Each window goes to the sink
+// in order and is wiped once the sink returns. The sink returns 0 to carry on, or -1 to stop with an error. The fd
+// version write()s each window to fd. Memory use stays the same however large buf_count is.
+typedef int (*xorscura_sink)(const unsigned char *buf, size_t count, void *arg);
+
+int xorscura_decrypt_window(struct xod *data, size_t window, xorscura_sink sink, void *arg);
+int xorscura_decrypt_fd(struct xod *data, int fd);
+
+// Decrypt straight into a fresh mapping, for running in place. The mapping ends up read only, or read and execute
+// with IMAGE_EXEC. With IMAGE_FD, it's backed by a memfd holding exactly the plaintext, for fexecve(). Unload wipes
+// and releases it all.
+#define XORSCURA_IMAGE_EXEC	1
+#define XORSCURA_IMAGE_FD	2
+
+struct xorscura_image {
+	void *addr;
+	size_t size;	// Of the mapping. At least count, rounded up to a page.
+	size_t count;	// Of the plaintext.
+	int fd;	// The memfd, or -1.
+};
+
+int xorscura_image_load(struct xod *data, int flags, struct xorscura_image *image);
+void xorscura_image_unload(struct xorscura_image *image);
+
+// Known plaintext seed recovery, for auditing. Tries every seed in [first, last] (inclusive) against count bytes of
+// plaintext and the ciphertext they encrypted to. Returns 0 with the lowest seed that fits, 1 if none do, -1 on
+// error. Vectorized, but single threaded: give each thread its own range.
+int xorscura_seed_search(unsigned char algorithm, const unsigned char *plain, const unsigned char *cipher, size_t count, unsigned int first, unsigned int last, unsigned int *seed);
+
+// Compress, then obfuscate, with a built in LZ77 codec. encrypt_lz leaves buf_count at the ciphertext's (compressed)
+// length. decrypt_lz decrypts and decompresses in one pass, and reports the plaintext's length through count. The
+// compress functions are the codec on its own, for compressing ahead of a stream.
+size_t xorscura_compress_bound(size_t count);
+size_t xorscura_compress(const unsigned char *in, size_t count, unsigned char *out);
+int xorscura_encrypt_lz(struct xod *data);
+int xorscura_decrypt_lz(struct xod *data, size_t *count);
+
+// An archive of many secrets in one file, used in place from a read only mapping. A header, then a table of entries
+// sorted by id, then the ciphertexts. All little endian. Open (or map, for one already in memory), then find by id,
+// which fills in an xod pointing into the archive. Ids can be anything unique. xorscura_archive_id() makes them from
+// names. Write sorts the items by id, and fails with EEXIST on a duplicate. Map wants buf aligned for a uint64_t, and
+// fails with EINVAL if it isn't.
+#define XORSCURA_ARCHIVE_LZ	1	// Entry flag: the ciphertext is from xorscura_encrypt_lz().
+
+struct xorscura_archive_header {
+	char magic[8];	// "XORSCURA"
+	uint32_t version;
+	uint32_t entry_count;
+	uint64_t table_offset;
+	uint64_t data_offset;
+};
+
+struct xorscura_archive_entry {
+	uint64_t id;
+	uint64_t offset;	// Into the data.
+	uint64_t count;
+	uint32_t seed;
+	uint8_t algorithm;
+	uint8_t flags;
+	uint8_t pad[2];
+};
+
+struct xorscura_archive {
+	const unsigned char *map;
+	size_t map_count;
+	int mapped;	// Whether close should munmap().
+
+	const struct xorscura_archive_entry *entries;
+	size_t entry_count;
+	const unsigned char *data;
+	size_t data_count;
+};
+
+struct xorscura_archive_item {
+	uint64_t id;
+	unsigned int flags;
+	struct xod data;
+};
+
+uint64_t xorscura_archive_id(const char *name);
+int xorscura_archive_write(int fd, struct xorscura_archive_item *items, size_t n);
+int xorscura_archive_map(struct xorscura_archive *archive, const void *buf, size_t count);
+int xorscura_archive_open(struct xorscura_archive *archive, const char *path);
+int xorscura_archive_find(const struct xorscura_archive *archive, uint64_t id, struct xod *data, unsigned int *flags);
+void xorscura_archive_close(struct xorscura_archive *archive);
+
+// A keystream cache. Repeat decrypts and compares of the same seeds skip the prng entirely on a hit.
+// Bounded by max_bytes and (unless 0) max_entries, with least recently used eviction. One per thread.
+struct xorscura_ctx;
+
+struct xorscura_ctx_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t bypasses;	// Keystreams too large to cache at all.
+	size_t entries;
+	size_t bytes;
+};
+
+struct xorscura_ctx *xorscura_ctx_new(size_t max_bytes, size_t max_entries);
+void xorscura_ctx_free(struct xorscura_ctx *ctx);
+int xorscura_ctx_decrypt(struct xorscura_ctx *ctx, struct xod *data);
+int xorscura_ctx_decrypt_into(struct xorscura_ctx *ctx, struct xod *data, unsigned char *out);
+int xorscura_ctx_compare(struct xorscura_ctx *ctx, struct xod *data);
+void xorscura_ctx_stats(struct xorscura_ctx *ctx, struct xorscura_ctx_stats *stats);
+
+// A set of secrets, for checking a candidate against all of them at once. Built from xods set up as for
+// xorscura_compare() (the plaintext_buf is ignored), indexed by length and a keyed hash of each secret. A lookup
+// returns 0 if the candidate is in the set (and its position in arr through index, if not NULL), 1 if not, and -1
+// on error. The set points at the xods' buffers rather than copying them.
+struct xorscura_set;
+
+struct xorscura_set *xorscura_set_new(struct xod *arr, size_t n);
+int xorscura_set_lookup(struct xorscura_set *set, const unsigned char *candidate, size_t count, size_t *index);
+void xorscura_set_free(struct xorscura_set *set);
+
+// A table of obfuscated strings, each decrypted (and null terminated) on its first get rather than up front. Safe to
+// share between threads: a get of an already decrypted entry takes no lock, and no entry is ever decrypted twice.
+// Every get that doesn't return NULL must be matched with a put. With a ttl_ms, a sweep wipes each entry that nobody
+// holds and that hasn't been used for that long, and returns how many it wiped. The capacity is fixed at creation.
+struct xorscura_strtab;
+
+struct xorscura_strtab *xorscura_strtab_new(size_t capacity, unsigned int ttl_ms);
+int xorscura_strtab_add(struct xorscura_strtab *tab, struct xod *data, size_t *id);
+const char *xorscura_strtab_get(struct xorscura_strtab *tab, size_t id);
+void xorscura_strtab_put(struct xorscura_strtab *tab, size_t id);
+size_t xorscura_strtab_sweep(struct xorscura_strtab *tab);
+void xorscura_strtab_free(struct xorscura_strtab *tab);
+
+// A pool of wiped, size classed buffers for xods to allocate from. Set xod->arena to use one. Reset wipes and reclaims
+// everything it has handed out at once. MLOCK pins its memory, and NODUMP keeps it out of core dumps.
+#define XORSCURA_ARENA_MLOCK	1
+#define XORSCURA_ARENA_NODUMP	2
+
+struct xorscura_arena *xorscura_arena_new(int flags);
+void xorscura_arena_reset(struct xorscura_arena *arena);
+void xorscura_arena_free(struct xorscura_arena *arena);
+
+// Counters for attributing time to libxorscura, off until enabled. Each thread counts into its own block, and a
+// snapshot adds them all up (threads that have exited included) as of the last reset. Calls, bytes, and latency are
+// per op, counting only the outermost libxorscura call. latency[op][i] counts the calls that took [2^i, 2^(i + 1))
+// nanoseconds, with the last bucket taking everything longer. STREAM is each stream update or compare chunk.
+#define XORSCURA_STATS_ENCRYPT	0
+#define XORSCURA_STATS_DECRYPT	1
+#define XORSCURA_STATS_COMPARE	2
+#define XORSCURA_STATS_STREAM	3
+#define XORSCURA_STATS_OPS	4
+#define XORSCURA_STATS_BUCKETS	40
+
+struct xorscura_stats {
+	uint64_t calls[XORSCURA_STATS_OPS];
+	uint64_t bytes[XORSCURA_STATS_OPS];
+	uint64_t latency[XORSCURA_STATS_OPS][XORSCURA_STATS_BUCKETS];
+	uint64_t prng_words;	// 32 bit keystream words generated, including discards and stepped over words.
+	uint64_t allocs;	// Buffers allocated for xods.
+};
+
+void xorscura_stats_enable(int enable);
+void xorscura_stats_snapshot(struct xorscura_stats *stats);
+void xorscura_stats_reset(void);
+
+// Clears out the xod data structure, wiping the buffers libxorscura allocated. Does not free the struct itself.
 void xorscura_free_xod(struct xod *data);
 
 // Prints values of the xod data structure.
 void xorscura_debug_xod(struct xod *data);
 
+// Name of the xor kernel (scalar, sse2, avx2, avx512f) chosen for this cpu at runtime.
+const char *xorscura_kernel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,15 +29,34 @@
 
 #include "libxorscura.h"
 
+#include <ftw.h>
+#include <semaphore.h>
+
+#include <sys/mman.h>
+
+
+// Batch mode. The most files being read or written at once, across all of the worker threads.
+#define BATCH_IO	4
+
 
 void usage(){
 
-	fprintf(stderr, "Usage: %s [-e|-d|-x|-h] [-C] [-p PLAINTEXT] [-c CIPHERTEXT] [-k KEY] [-s SEED]\n", program_invocation_short_name);
+	fprintf(stderr, "Usage: %s [-e|-d|-x|-A|-B|-h] [-C] [-z] [-a ALGORITHM] [-j THREADS] [-L LENGTH] [-p PLAINTEXT] [-c CIPHERTEXT] [-k KEY] [-s SEED] [-i FILE] [-o FILE] [-K FILE] [--stats] [FILE...]\n", program_invocation_short_name);
 	fprintf(stderr, "\t-e\t:\tEncrypt. (Requires PLAINTEXT and KEY.)\n");
 	fprintf(stderr, "\t-d\t:\tDecrypt. (Requires CIPHERTEXT and KEY.)\n");
 	fprintf(stderr, "\t-x\t:\tCompare. (Requires PLAINTEXT, CIPHERTEXT, and KEY.)\n");
+	fprintf(stderr, "\t-A\t:\tArchive. Encrypt each FILE into one archive FILE. (Requires -o.)\n");
+	fprintf(stderr, "\t-B\t:\tBatch. Encrypt each FILE, and each file under each DIR, into DIR given by -o. (Requires -o.)\n");
 	fprintf(stderr, "\t-h\t:\tHelp!\n");
 	fprintf(stderr, "\t-C\t:\tOutput as a C style byte array.\n");
+	fprintf(stderr, "\t-z\t:\tCompress PLAINTEXT before encrypting, and decompress after decrypting. (Not for compare.)\n");
+	fprintf(stderr, "\t-a\t:\tKeystream ALGORITHM driven by SEED. (random_r or chacha8. Default is random_r.)\n");
+	fprintf(stderr, "\t-j\t:\tWorker THREADS for a batch. (Default is one per cpu.)\n");
+	fprintf(stderr, "\t-L\t:\tShort KEY of LENGTH bytes (1 to %d), repeated over the data.\n", XORSCURA_KEY_MAX);
+	fprintf(stderr, "\t-i\t:\tRead raw input from FILE. (PLAINTEXT for encrypt and compare, CIPHERTEXT for decrypt.)\n");
+	fprintf(stderr, "\t-o\t:\tWrite raw output to FILE. (CIPHERTEXT for encrypt, PLAINTEXT for decrypt.)\n");
+	fprintf(stderr, "\t-K\t:\tRaw KEY FILE. Written by encrypt (which then requires -o), read by decrypt and compare.\n");
+	fprintf(stderr, "\t--stats\t:\tReport libxorscura's counters and latency histograms to STDERR on the way out.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Purpose: Useful tool / library for obscuring strings in your binaries with the help of xor.\n");
 	fprintf(stderr, "\n");
@@ -51,6 +70,21 @@ void usage(){
 	fprintf(stderr, "- The SEED argument can be used instead of KEY. This will be used as the seed to random() in place of KEY\n");
 	fprintf(stderr, "  for decrypt and compare operations. This allows you to save memory in your binary by storing only\n");
 	fprintf(stderr, "  CIPHERTEXT and SEED. SEED format is expected as a uint.\n");
+	fprintf(stderr, "- ALGORITHM picks what SEED generates. random_r is the original keystream. chacha8 is counter based, so any\n");
+	fprintf(stderr, "  part of it can be generated without the rest. Decrypt and compare must use the same ALGORITHM as encrypt.\n");
+	fprintf(stderr, "- The file switches skip the hex encoding entirely, for large inputs. FILE inputs are mmap()d. When encrypt\n");
+	fprintf(stderr, "  writes to a FILE, only SEED is reported. A compare with -i reads CIPHERTEXT from STDIN unless -c is given.\n");
+	fprintf(stderr, "- With -z, encrypt reports the compressed PLAINTEXT, and the KEY and CIPHERTEXT are of that. Decrypt with -z\n");
+	fprintf(stderr, "  holds the whole PLAINTEXT in memory, so the CIPHERTEXT has to come from -c or -i.\n");
+	fprintf(stderr, "- With -L, encrypt reports a KEY of only LENGTH bytes, however long the PLAINTEXT. Decrypt and compare take\n");
+	fprintf(stderr, "  a KEY that short as is. With SEED instead, they need the same -L.\n");
+	fprintf(stderr, "- An archive entry is named for its FILE's basename, and its id is xorscura_archive_id() of that name. The\n");
+	fprintf(stderr, "  ids are reported. -z and -a apply to each entry.\n");
+	fprintf(stderr, "- A batch writes each CIPHERTEXT to the same relative path under the output DIR (a FILE argument goes\n");
+	fprintf(stderr, "  in at the top), and reports a manifest of SEED, ALGORITHM, compression, size, stored size, and path\n");
+	fprintf(stderr, "  for each, one per line. No KEY is made. -z and -a apply to each file. At most %d files are being read\n", BATCH_IO);
+	fprintf(stderr, "  or written at once, however many THREADS there are.\n");
+	fprintf(stderr, "  Nothing is written if two inputs would end up with the same path, and no file already in DIR is overwritten.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Example:\n");
 	fprintf(stderr, "\n");
@@ -59,42 +93,203 @@ void usage(){
 }
 
 
+// Batch mode. One FILE, and what became of it.
+struct batch_file {
+	char *path;
+	char *name;	// The path relative to the FILE or DIR argument it came from, and so under the output DIR.
+	unsigned int seed;
+	size_t count;
+	size_t stored_count;	// Of the ciphertext. Less than count with -z.
+	int error;	// The errno it failed with, or 0.
+};
+
+struct batch {
+	struct batch_file *files;
+	size_t file_count;
+	size_t file_max;
+	size_t next;	// The next file for a worker to take.
+
+	char *output;
+	int algorithm;
+	int compress;
+	sem_t io;
+};
+
+// Bytes moved per read / stream update. The CLI never holds more than a few of these, whatever the input size.
+#define CHUNK_SIZE	65536
+
+// Where PLAINTEXT or CIPHERTEXT comes from: a hex string off the command line, an mmap()d file, or a seekable
+// file descriptor.
+struct source {
+	char *hex;
+	size_t hex_pos;
+	size_t hex_bytes;
+
+	unsigned char *map;
+	size_t map_count;
+	size_t map_pos;
+
+	int fd;
+	off_t fd_start;
+};
+
+// Output formatting for the encrypt report. cells[b] is the separator, numeric prefix, and hex digits for byte b,
+// cell_count chars in all, so formatting a byte is a single fixed size copy.
+#define CELL_SIZE	8
+
+struct style {
+	char *open_str;
+	char *close_str;
+	char *numeric_str;
+	char *separating_str;
+
+	unsigned char cells[256][CELL_SIZE];
+	size_t cell_count;
+	size_t separating_count;
+};
+
+// Buffered output for the encrypt report. Everything goes out through write_all() in WRITER_SIZE pieces.
+#define WRITER_SIZE	(1024 * 1024)
+
+struct writer {
+	int fd;
+	unsigned char *buf;
+	size_t pos;
+};
+
+// hex_table[c] is the value of hex digit c, or -1 if c isn't one.
+signed char hex_table[256];
+
+// Fill in hex_table. Call before anything below.
+void hex_init(void);
+// returns the number of bytes in a "postscript raw hex" string, or -1 if it isn't one.
+ssize_t hex_count(char *hex);
 // returns the size of the newly malloc()d bin, or -1 on error.
 int ps2bin(char *ps, unsigned char **bin);
-int fill_from_stdin(unsigned char **bin);
+// returns the XORSCURA_ALG_* value for name, or -1 if there isn't one.
+int algorithm_by_name(char *name);
+char *algorithm_name(int algorithm);
+// A KEY as long as the CIPHERTEXT is a whole key. A shorter one is a short key, which sets data->key_count. Returns
+// -1 if key_size is neither, or isn't the LENGTH already in data->key_count.
+int key_fit(struct xod *data, size_t key_size);
+
+// Source handling. All return -1 on error. source_read() returns the bytes read, 0 at the end. source_chunk() is
+// source_read() that points *chunk straight into the mapping for file sources, rather than copying into buf.
+int source_from_hex(struct source *src, char *hex);
+int source_from_stdin(struct source *src);
+int source_from_file(struct source *src, char *path);
+ssize_t source_read(struct source *src, unsigned char *buf, size_t count);
+ssize_t source_chunk(struct source *src, unsigned char *buf, size_t count, unsigned char **chunk);
+// Like source_read() for hex sources, but buf ^= the decoded bytes, in the same pass that decodes them.
+ssize_t source_hex_xor(struct source *src, unsigned char *buf, size_t count);
+int source_rewind(struct source *src);
+off_t source_size(struct source *src);
+// Swap src for a source over its whole contents, compressed. *buf gets the malloc()d compressed bytes.
+int source_compress(struct source *src, unsigned char **buf);
+
+// Build style->cells. Returns -1 if the style strings don't fit in a cell.
+int style_init(struct style *style);
+
+// The writer. All return -1 on error. writer_bytes() formats a chunk of the encrypt report. index is where this
+// chunk starts in the overall data.
+int writer_init(struct writer *writer, int fd);
+int writer_flush(struct writer *writer);
+int writer_str(struct writer *writer, char *str);
+int writer_bytes(struct writer *writer, struct style *style, unsigned char *buf, size_t count, size_t index);
+
+// Encrypt each of paths into an archive at output. Reports each entry's id. Returns -1 on error.
+int archive_files(char **paths, int count, char *output, int algorithm, int compress);
+
+// Encrypt each file in paths (walking any directories) into the directory output, on threads worker threads (0
+// for one per cpu). Reports a manifest line for each. Returns the number of files that failed, or -1 on error.
+int batch_files(char **paths, int count, char *output, int algorithm, int compress, int threads);
+int batch_add(struct batch *batch, const char *path, const char *name);
+int batch_walk(const char *path, const struct stat *file_stat, int type, struct FTW *ftw_buf);
+// Returns -1 (EEXIST) if two files in the batch would be written to the same name.
+int batch_unique(struct batch *batch);
+int batch_name_cmp(const void *a, const void *b);
+void *batch_worker(void *arg);
+int batch_encrypt(struct batch *batch, struct batch_file *file);
+// Read all of path into a new malloc()d *buf.
+int read_file(char *path, unsigned char **buf, size_t *count);
+// mkdir() each directory leading up to the last '/' in path.
+int make_parents(char *path);
+
+// Print the libxorscura counters to STDERR. Registered with atexit() by --stats.
+void stats_report(void);
+
+// Open FILE for raw output, or -1 on error.
+int open_output(char *path);
+// write() all of buf, or -1 on error.
+int write_all(int fd, unsigned char *buf, size_t count);
 
 
 
 int main(int argc, char **argv){
 
 	struct xod *data;
+	struct xorscura_stream stream;
+
+	struct source plaintext;
+	struct source ciphertext;
+
+	unsigned char *chunk_buf;
+	unsigned char *cipher_chunk_buf;
+	unsigned char *key_chunk_buf;
+	unsigned char *chunk_ptr;
+
+	struct xorscura_stream key_stream;
+	struct source key_file;
+	int output_fd = STDOUT_FILENO;
+	int key_fd = -1;
+	size_t chunk_count;
+	size_t total_count;
+	ssize_t read_count;
 
 	int retval;
-	int i;
 
 	int opt;
 
+#define OPT_STATS	256
+	struct option long_options[] = {
+		{"stats", no_argument, NULL, OPT_STATS},
+		{NULL, 0, NULL, 0}
+	};
+
 #define ENCRYPT	0
 #define DECRYPT	1
 #define COMPARE	2
+#define ARCHIVE	3
+#define BATCH	4
 	unsigned int operation = ENCRYPT;
 
 #define PS_STYLE 0
 #define C_STYLE 1
 	int output = PS_STYLE;
 
-	char *open_str;
-	char *close_str;
-	char *numeric_str;
-	char *separating_str;
+	struct style style;
+	struct writer writer;
+	char line_buf[64];
 
 	char *cli_plaintext = NULL;
 	char *cli_ciphertext = NULL;
 	char *cli_key = NULL;
 	char *cli_seed = NULL;
+	int cli_algorithm = XORSCURA_ALG_RANDOM_R;
+	char *cli_input = NULL;
+	char *cli_output = NULL;
+	char *cli_keyfile = NULL;
+	int cli_compress = 0;
+	unsigned char *compressed_buf = NULL;
+	int cli_stats = 0;
+	int cli_threads = 0;
+	size_t cli_key_count = 0;
+	size_t key_total;
 
 
-	while((opt = getopt(argc, argv, "edxhCp:c:k:s:")) != -1){
+	hex_init();
+
+	while((opt = getopt_long(argc, argv, "edxABhCza:j:L:p:c:k:s:i:o:K:", long_options, NULL)) != -1){
 		switch (opt){
 			case 'h':
 				usage();
@@ -116,10 +311,51 @@ int main(int argc, char **argv){
 				operation = COMPARE;
 				break;
 
+			case 'A':
+				if(operation){
+					usage();
+				}
+				operation = ARCHIVE;
+				break;
+
+			case 'B':
+				if(operation){
+					usage();
+				}
+				operation = BATCH;
+				break;
+
 			case 'C':
 				output = C_STYLE;
 				break;
 
+			case 'z':
+				cli_compress = 1;
+				break;
+
+			case 'a':
+				if((cli_algorithm = algorithm_by_name(optarg)) == -1){
+					fprintf(stderr, "Error: Unknown ALGORITHM: %s\n", optarg);
+					usage();
+				}
+				break;
+
+			case 'j':
+				if((cli_threads = atoi(optarg)) < 1){
+					fprintf(stderr, "Error: THREADS must be at least 1.\n");
+					usage();
+				}
+				break;
+
+			case 'L':
+				errno = 0;
+				cli_key_count = strtoul(optarg, NULL, 10);
+				if(errno || !cli_key_count || cli_key_count > XORSCURA_KEY_MAX){
+					fprintf(stderr, "Error: LENGTH must be from 1 to %d.\n", XORSCURA_KEY_MAX);
+					usage();
+				}
+				break;
+
 			case 'p':
 				cli_plaintext = optarg;
 				break;
@@ -136,63 +372,197 @@ int main(int argc, char **argv){
 				cli_seed = optarg;
 				break;
 
+			case 'i':
+				cli_input = optarg;
+				break;
+
+			case 'o':
+				cli_output = optarg;
+				break;
+
+			case 'K':
+				cli_keyfile = optarg;
+				break;
+
+			case OPT_STATS:
+				cli_stats = 1;
+				break;
+
 			default:
 				usage();
 		}
 	}
 
+	// From here on, so the report covers every way out, error() included.
+	if(cli_stats){
+		xorscura_stats_enable(1);
+		if(atexit(stats_report)){
+			error(-1, errno, "atexit(%lx)", (unsigned long) stats_report);
+		}
+	}
+
+	// An archive is all FILEs and no hex, so it gets its own path.
+	if(operation == ARCHIVE){
+		if(!cli_output || optind == argc || cli_plaintext || cli_ciphertext || cli_key || cli_seed || cli_input || cli_keyfile || cli_key_count){
+			fprintf(stderr, "Error: An archive takes an output FILE, and input FILEs only.\n");
+			usage();
+		}
+
+		if(archive_files(argv + optind, argc - optind, cli_output, cli_algorithm, cli_compress) == -1){
+			error(-1, errno, "archive_files(%lx, %d, %s, %d, %d)", (unsigned long) (argv + optind), argc - optind, cli_output, cli_algorithm, cli_compress);
+		}
+
+		return(0);
+	}
+
+	// So is a batch.
+	if(operation == BATCH){
+		if(!cli_output || optind == argc || cli_plaintext || cli_ciphertext || cli_key || cli_seed || cli_input || cli_keyfile || cli_key_count){
+			fprintf(stderr, "Error: A batch takes an output DIR, and input FILEs and DIRs only.\n");
+			usage();
+		}
+
+		if((retval = batch_files(argv + optind, argc - optind, cli_output, cli_algorithm, cli_compress, cli_threads)) == -1){
+			error(-1, errno, "batch_files(%lx, %d, %s, %d, %d, %d)", (unsigned long) (argv + optind), argc - optind, cli_output, cli_algorithm, cli_compress, cli_threads);
+		}
+
+		if(retval){
+			error(-1, 0, "%d of the FILEs failed.", retval);
+		}
+
+		return(0);
+	}
+
+	if(optind != argc){
+		usage();
+	}
+
 	// Initialize and fill out the appropriate buffers.
 	if((data = (struct xod *) calloc(1, sizeof(struct xod))) == NULL){
 		error(-1, errno, "calloc(1, %d)", (int) sizeof(struct xod));
 	}
+	data->algorithm = (unsigned char) cli_algorithm;
+	data->key_count = cli_key_count;
+
+	if((chunk_buf = (unsigned char *) malloc(CHUNK_SIZE)) == NULL){
+		error(-1, errno, "malloc(%d)", CHUNK_SIZE);
+	}
 
-	// Both ENCRYPT and COMPARE will need PLAINTEXT.
+	if((cipher_chunk_buf = (unsigned char *) malloc(CHUNK_SIZE)) == NULL){
+		error(-1, errno, "malloc(%d)", CHUNK_SIZE);
+	}
+
+	if((key_chunk_buf = (unsigned char *) malloc(CHUNK_SIZE)) == NULL){
+		error(-1, errno, "malloc(%d)", CHUNK_SIZE);
+	}
+
+	if(operation == COMPARE && cli_compress){
+		fprintf(stderr, "Error: Compare doesn't take -z.\n");
+		usage();
+	}
+
+	if(operation == COMPARE && cli_output){
+		fprintf(stderr, "Error: Compare doesn't take -o. There's nothing to write.\n");
+		usage();
+	}
+
+	if(operation == ENCRYPT && cli_keyfile && !cli_output){
+		fprintf(stderr, "Error: Writing a KEY FILE requires an output FILE.\n");
+		usage();
+	}
+
+	// Both ENCRYPT and COMPARE will need PLAINTEXT. When it comes from stdin it's read a chunk at a time, and is
+	// only spooled to a temp file if stdin can't be rewound.
 	if(operation == ENCRYPT || operation == COMPARE){
-		if(cli_plaintext){
-			if((retval = ps2bin(cli_plaintext, &(data->plaintext_buf))) == -1){
-				error(-1, errno, "ps2bin(%lx, %lx)", (unsigned long) cli_plaintext, (unsigned long) &(data->plaintext_buf));
+		if(cli_plaintext && cli_input){
+			fprintf(stderr, "Error: Either PLAINTEXT or an input FILE, not both.\n");
+			usage();
+		}
+
+		if(cli_input){
+			if(source_from_file(&plaintext, cli_input) == -1){
+				error(-1, errno, "source_from_file(%lx, %s)", (unsigned long) &plaintext, cli_input);
+			}
+		}else if(cli_plaintext){
+			if(source_from_hex(&plaintext, cli_plaintext) == -1){
+				error(-1, errno, "source_from_hex(%lx, %lx)", (unsigned long) &plaintext, (unsigned long) cli_plaintext);
 			}
-			data->buf_count = (size_t) retval;
 		}else{
-			if((retval = fill_from_stdin(&(data->plaintext_buf))) == -1){
-				error(-1, errno, "fill_from_stdin(%lx)", (unsigned long) &(data->plaintext_buf));
+			if(source_from_stdin(&plaintext) == -1){
+				error(-1, errno, "source_from_stdin(%lx)", (unsigned long) &plaintext);
 			}
-			data->buf_count = (size_t) retval;
 		}
+
+		// From here on, the compressed bytes are the PLAINTEXT.
+		if(cli_compress && source_compress(&plaintext, &compressed_buf) == -1){
+			error(-1, errno, "source_compress(%lx, %lx)", (unsigned long) &plaintext, (unsigned long) &compressed_buf);
+		}
+
+		data->buf_count = (size_t) source_size(&plaintext);
 	}
 
 	// Both DECRYPT and COMPARE will need CIPHERTEXT and KEY (or SEED).
 	if(operation == DECRYPT || operation == COMPARE){
-		if(cli_ciphertext){
-			if((retval = ps2bin(cli_ciphertext, &(data->ciphertext_buf))) == -1){
-				error(-1, errno, "ps2bin(%lx, %lx)", (unsigned long) cli_ciphertext, (unsigned long) &(data->ciphertext_buf));
+		if(operation == DECRYPT && cli_input){
+			if(cli_ciphertext){
+				fprintf(stderr, "Error: Either CIPHERTEXT or an input FILE, not both.\n");
+				usage();
+			}
+
+			if(source_from_file(&ciphertext, cli_input) == -1){
+				error(-1, errno, "source_from_file(%lx, %s)", (unsigned long) &ciphertext, cli_input);
+			}
+			data->buf_count = (size_t) source_size(&ciphertext);
+
+		}else if(cli_ciphertext || cli_input){
+
+			// With PLAINTEXT coming from a FILE, STDIN is free to carry the CIPHERTEXT for a compare.
+			if(cli_ciphertext){
+				if(source_from_hex(&ciphertext, cli_ciphertext) == -1){
+					error(-1, errno, "source_from_hex(%lx, %lx)", (unsigned long) &ciphertext, (unsigned long) cli_ciphertext);
+				}
+			}else if(source_from_stdin(&ciphertext) == -1){
+				error(-1, errno, "source_from_stdin(%lx)", (unsigned long) &ciphertext);
 			}
 
-			if(operation == COMPARE && retval != (int) data->buf_count){
+			if(operation == COMPARE && (size_t) source_size(&ciphertext) != data->buf_count){
 				printf("PLAINTEXT and CIPHERTEXT differ. (Different lengths.)\n");
 				return(0);
 			}
 
-			data->buf_count = (size_t) retval;
+			data->buf_count = (size_t) source_size(&ciphertext);
 
 		}else{
 			fprintf(stderr, "Error: No CIPHERTEXT provided.\n");
 			usage();
 		}
 
-		if(cli_key || cli_seed){
-			if(cli_key && cli_seed){
+		if(cli_key || cli_seed || cli_keyfile){
+			if((cli_key != NULL) + (cli_seed != NULL) + (cli_keyfile != NULL) > 1){
 				fprintf(stderr, "Error: Either KEY or SEED must be provided for this operation, not both.\n");
 				usage();
 			}
 
-			if(cli_key){
+			if(cli_keyfile){
+				if(source_from_file(&key_file, cli_keyfile) == -1){
+					error(-1, errno, "source_from_file(%lx, %s)", (unsigned long) &key_file, cli_keyfile);
+				}
+
+				if(key_fit(data, (size_t) source_size(&key_file)) == -1){
+					fprintf(stderr, "Error: KEY and CIPHERTEXT are different lengths, and KEY isn't a short key of LENGTH.\n");
+					usage();
+				}
+
+				// An empty file has no mapping, but then there's no key to read either.
+				data->key_buf = key_file.map ? key_file.map : key_chunk_buf;
+
+			}else if(cli_key){
 				if((retval = ps2bin(cli_key, &(data->key_buf))) == -1){
 					error(-1, errno, "ps2bin(%lx, %lx)", (unsigned long) cli_key, (unsigned long) &(data->key_buf));
 				}
 
-				if(retval != (int) data->buf_count){
-					fprintf(stderr, "Error: KEY and CIPHERTEXT are different lengths.\n");
+				if(key_fit(data, (size_t) retval) == -1){
+					fprintf(stderr, "Error: KEY and CIPHERTEXT are different lengths, and KEY isn't a short key of LENGTH.\n");
 					usage();
 				}
 
@@ -213,71 +583,263 @@ int main(int argc, char **argv){
 
 	if(operation == ENCRYPT){
 
-		open_str = "";
-		close_str = "";
-		numeric_str = "";
-		separating_str = "";
+		style.open_str = "";
+		style.close_str = "";
+		style.numeric_str = "";
+		style.separating_str = "";
 
 		if(output == C_STYLE){
-			open_str = "{";
-			close_str = "}";
-			numeric_str = "0x";
-			separating_str = ",";
+			style.open_str = "{";
+			style.close_str = "}";
+			style.numeric_str = "0x";
+			style.separating_str = ",";
 		}
 
-		// Encrypt.
-		if(xorscura_encrypt(data) == -1){
-			error(-1, errno, "xorscura_encrypt(%lx)", (unsigned long) data);
+		if(style_init(&style) == -1){
+			error(-1, EINVAL, "style_init(%lx)", (unsigned long) &style);
 		}
 
-		// Report.
-		printf("plaintext: %s", open_str);
-		for(i = 0; i < (int) data->buf_count; i++){
-			if(i){
-				printf("%s", separating_str);
+		if(xorscura_seed(data) == -1){
+			error(-1, errno, "xorscura_seed(%lx)", (unsigned long) data);
+		}
+
+		if(cli_output){
+
+			if((output_fd = open_output(cli_output)) == -1){
+				error(-1, errno, "open_output(%s)", cli_output);
+			}
+
+			if(cli_keyfile && (key_fd = open_output(cli_keyfile)) == -1){
+				error(-1, errno, "open_output(%s)", cli_keyfile);
+			}
+
+			if(xorscura_stream_init(&stream, data, 0) == -1 || xorscura_stream_init(&key_stream, data, 0) == -1){
+				error(-1, errno, "xorscura_stream_init(%lx, %lx, 0)", (unsigned long) &stream, (unsigned long) data);
+			}
+
+			// A short key is written the once, up front.
+			if(key_fd != -1 && data->key_count){
+				xorscura_stream_update(&key_stream, NULL, key_chunk_buf, data->key_count);
+				if(write_all(key_fd, key_chunk_buf, data->key_count) == -1){
+					error(-1, errno, "write_all(%d, %lx, %d)", key_fd, (unsigned long) key_chunk_buf, (int) data->key_count);
+				}
+			}
+
+			// Encrypt straight from the input, one chunk at a time.
+			while((read_count = source_chunk(&plaintext, chunk_buf, CHUNK_SIZE, &chunk_ptr)) > 0){
+				xorscura_stream_update(&stream, chunk_ptr, cipher_chunk_buf, (size_t) read_count);
+				if(write_all(output_fd, cipher_chunk_buf, (size_t) read_count) == -1){
+					error(-1, errno, "write_all(%d, %lx, %d)", output_fd, (unsigned long) cipher_chunk_buf, (int) read_count);
+				}
+
+				if(key_fd != -1 && !data->key_count){
+					xorscura_stream_update(&key_stream, NULL, key_chunk_buf, (size_t) read_count);
+					if(write_all(key_fd, key_chunk_buf, (size_t) read_count) == -1){
+						error(-1, errno, "write_all(%d, %lx, %d)", key_fd, (unsigned long) key_chunk_buf, (int) read_count);
+					}
+				}
+			}
+			if(read_count == -1){
+				error(-1, errno, "source_chunk(%lx, %lx, %d, %lx)", (unsigned long) &plaintext, (unsigned long) chunk_buf, CHUNK_SIZE, (unsigned long) &chunk_ptr);
 			}
-			printf("%s%02x", numeric_str, (unsigned int) (unsigned char) data->plaintext_buf[i]);
+
+			xorscura_stream_final(&stream);
+			xorscura_stream_final(&key_stream);
+
+			if(close(output_fd) == -1 || (key_fd != -1 && close(key_fd) == -1)){
+				error(-1, errno, "close()");
+			}
+
+			// Report.
+			printf("seed: %u\n", data->seed);
+			if(data->algorithm != XORSCURA_ALG_RANDOM_R){
+				printf("algorithm: %s\n", algorithm_name(data->algorithm));
+			}
+			if(data->key_count){
+				printf("length: %lu\n", (unsigned long) data->key_count);
+			}
+
+			goto CLEANUP;
+		}
+
+		// Report. Each of the three lines is its own pass over the data.
+		if(writer_init(&writer, STDOUT_FILENO) == -1){
+			error(-1, errno, "writer_init(%lx, %d)", (unsigned long) &writer, STDOUT_FILENO);
+		}
+
+		writer_str(&writer, cli_compress ? "compressed: " : "plaintext: ");
+		writer_str(&writer, style.open_str);
+		total_count = 0;
+		while((read_count = source_read(&plaintext, chunk_buf, CHUNK_SIZE)) > 0){
+			if(writer_bytes(&writer, &style, chunk_buf, (size_t) read_count, total_count) == -1){
+				error(-1, errno, "writer_bytes(%lx, %lx, %lx, %d, %lu)", (unsigned long) &writer, (unsigned long) &style, (unsigned long) chunk_buf, (int) read_count, (unsigned long) total_count);
+			}
+			total_count += (size_t) read_count;
+		}
+		if(read_count == -1){
+			error(-1, errno, "source_read(%lx, %lx, %d)", (unsigned long) &plaintext, (unsigned long) chunk_buf, CHUNK_SIZE);
+		}
+		writer_str(&writer, style.close_str);
+
+		snprintf(line_buf, sizeof(line_buf), "\nseed: %u\n", data->seed);
+		writer_str(&writer, line_buf);
+		if(data->algorithm != XORSCURA_ALG_RANDOM_R){
+			writer_str(&writer, "algorithm: ");
+			writer_str(&writer, algorithm_name(data->algorithm));
+			writer_str(&writer, "\n");
+		}
+		if(data->key_count){
+			snprintf(line_buf, sizeof(line_buf), "length: %lu\n", (unsigned long) data->key_count);
+			writer_str(&writer, line_buf);
+		}
+
+		// The key is the raw keystream. A short key is just its first key_count bytes.
+		if(xorscura_stream_init(&stream, data, 0) == -1){
+			error(-1, errno, "xorscura_stream_init(%lx, %lx, 0)", (unsigned long) &stream, (unsigned long) data);
 		}
-		printf("%s\n", close_str);
 
-		printf("seed: %u\n", data->seed);
+		key_total = data->key_count ? data->key_count : total_count;
 
-		printf("key: %s", open_str);
-		for(i = 0; i < (int) data->buf_count; i++){
-			if(i){
-				printf("%s", separating_str);
+		writer_str(&writer, "key: ");
+		writer_str(&writer, style.open_str);
+		chunk_count = 0;
+		while(chunk_count < key_total){
+			read_count = (ssize_t) (key_total - chunk_count < CHUNK_SIZE ? key_total - chunk_count : CHUNK_SIZE);
+			xorscura_stream_update(&stream, NULL, chunk_buf, (size_t) read_count);
+			if(writer_bytes(&writer, &style, chunk_buf, (size_t) read_count, chunk_count) == -1){
+				error(-1, errno, "writer_bytes(%lx, %lx, %lx, %d, %lu)", (unsigned long) &writer, (unsigned long) &style, (unsigned long) chunk_buf, (int) read_count, (unsigned long) chunk_count);
 			}
-			printf("%s%02x", numeric_str, (unsigned int) (unsigned char) data->key_buf[i]);
+			chunk_count += (size_t) read_count;
+		}
+		writer_str(&writer, style.close_str);
+		writer_str(&writer, "\n");
+		xorscura_stream_final(&stream);
+
+		// Encrypt.
+		if(source_rewind(&plaintext) == -1){
+			error(-1, errno, "source_rewind(%lx)", (unsigned long) &plaintext);
 		}
-		printf("%s\n", close_str);
 
-		printf("cipher: %s", open_str);
-		for(i = 0; i < (int) data->buf_count; i++){
-			if(i){
-				printf("%s", separating_str);
+		if(xorscura_stream_init(&stream, data, 0) == -1){
+			error(-1, errno, "xorscura_stream_init(%lx, %lx, 0)", (unsigned long) &stream, (unsigned long) data);
+		}
+
+		writer_str(&writer, "cipher: ");
+		writer_str(&writer, style.open_str);
+		chunk_count = 0;
+		while((read_count = source_read(&plaintext, chunk_buf, CHUNK_SIZE)) > 0){
+			xorscura_stream_update(&stream, chunk_buf, chunk_buf, (size_t) read_count);
+			if(writer_bytes(&writer, &style, chunk_buf, (size_t) read_count, chunk_count) == -1){
+				error(-1, errno, "writer_bytes(%lx, %lx, %lx, %d, %lu)", (unsigned long) &writer, (unsigned long) &style, (unsigned long) chunk_buf, (int) read_count, (unsigned long) chunk_count);
 			}
-			printf("%s%02x", numeric_str, (unsigned int) (unsigned char) data->ciphertext_buf[i]);
+			chunk_count += (size_t) read_count;
+		}
+		if(read_count == -1){
+			error(-1, errno, "source_read(%lx, %lx, %d)", (unsigned long) &plaintext, (unsigned long) chunk_buf, CHUNK_SIZE);
+		}
+		writer_str(&writer, style.close_str);
+		writer_str(&writer, "\n");
+		xorscura_stream_final(&stream);
+
+		// writer_str() only fails when it can't flush, and this flush would fail the same way.
+		if(writer_flush(&writer) == -1){
+			error(-1, errno, "writer_flush(%lx)", (unsigned long) &writer);
 		}
-		printf("%s\n", close_str);
+		explicit_bzero(writer.buf, WRITER_SIZE);
+		free(writer.buf);
 
 
 	}else if(operation == DECRYPT){
 
-		// Decrypt.
-		if(xorscura_decrypt(data) == -1){
-			error(-1, errno, "xorscura_decrypt(%lx)", (unsigned long) data);
+		if(cli_output && (output_fd = open_output(cli_output)) == -1){
+			error(-1, errno, "open_output(%s)", cli_output);
 		}
 
-		// Report.
-		printf("%s", data->plaintext_buf);
+		// Decompressing needs the whole CIPHERTEXT up front, and makes the whole PLAINTEXT in one go.
+		if(cli_compress){
+			if(ciphertext.hex){
+				if(ps2bin(cli_ciphertext, &(data->ciphertext_buf)) == -1){
+					error(-1, errno, "ps2bin(%lx, %lx)", (unsigned long) cli_ciphertext, (unsigned long) &(data->ciphertext_buf));
+				}
+			}else{
+				data->ciphertext_buf = ciphertext.map;
+			}
+
+			if(xorscura_decrypt_lz(data, &total_count) == -1){
+				error(-1, errno, "xorscura_decrypt_lz(%lx, %lx)", (unsigned long) data, (unsigned long) &total_count);
+			}
+
+			if(write_all(output_fd, data->plaintext_buf, total_count) == -1){
+				error(-1, errno, "write_all(%d, %lx, %lu)", output_fd, (unsigned long) data->plaintext_buf, (unsigned long) total_count);
+			}
+
+			if(cli_output && close(output_fd) == -1){
+				error(-1, errno, "close(%d)", output_fd);
+			}
+
+			if(ciphertext.hex){
+				free(data->ciphertext_buf);
+			}
+			data->ciphertext_buf = NULL;
+
+			goto CLEANUP;
+		}
+
+		// Decrypt, and report, a chunk at a time.
+		if(xorscura_stream_init(&stream, data, 0) == -1){
+			error(-1, errno, "xorscura_stream_init(%lx, %lx, 0)", (unsigned long) &stream, (unsigned long) data);
+		}
+
+		while(1){
+
+			// Hex CIPHERTEXT is decoded straight over the keystream, rather than into a buffer of its own first.
+			if(ciphertext.hex){
+				read_count = (ssize_t) (ciphertext.hex_bytes - ciphertext.hex_pos / 2);
+				if(read_count > CHUNK_SIZE){
+					read_count = CHUNK_SIZE;
+				}
+				xorscura_stream_update(&stream, NULL, chunk_buf, (size_t) read_count);
+				read_count = source_hex_xor(&ciphertext, chunk_buf, (size_t) read_count);
+			}else if((read_count = source_chunk(&ciphertext, chunk_buf, CHUNK_SIZE, &chunk_ptr)) > 0){
+				xorscura_stream_update(&stream, chunk_ptr, chunk_buf, (size_t) read_count);
+			}
+
+			if(read_count <= 0){
+				break;
+			}
+
+			if(write_all(output_fd, chunk_buf, (size_t) read_count) == -1){
+				error(-1, errno, "write_all(%d, %lx, %d)", output_fd, (unsigned long) chunk_buf, (int) read_count);
+			}
+		}
+		if(read_count == -1){
+			error(-1, errno, "source_chunk(%lx, %lx, %d, %lx)", (unsigned long) &ciphertext, (unsigned long) chunk_buf, CHUNK_SIZE, (unsigned long) &chunk_ptr);
+		}
+		xorscura_stream_final(&stream);
+
+		if(cli_output && close(output_fd) == -1){
+			error(-1, errno, "close(%d)", output_fd);
+		}
 
 
 	}else if(operation == COMPARE){
 
-		// Compare.
-		if((retval = xorscura_compare(data)) == -1){
-			error(-1, errno, "xorscura_compare(%lx)", (unsigned long) data);
+		// Compare, a chunk at a time. Both sources are known to be the same length.
+		if(xorscura_stream_init(&stream, data, 0) == -1){
+			error(-1, errno, "xorscura_stream_init(%lx, %lx, 0)", (unsigned long) &stream, (unsigned long) data);
+		}
+
+		retval = 0;
+		while(!retval && (read_count = source_chunk(&plaintext, chunk_buf, CHUNK_SIZE, &chunk_ptr)) > 0){
+			if(source_read(&ciphertext, cipher_chunk_buf, (size_t) read_count) != read_count){
+				error(-1, errno, "source_read(%lx, %lx, %d)", (unsigned long) &ciphertext, (unsigned long) cipher_chunk_buf, (int) read_count);
+			}
+			retval = xorscura_stream_compare(&stream, chunk_ptr, cipher_chunk_buf, (size_t) read_count);
+		}
+		if(read_count == -1){
+			error(-1, errno, "source_chunk(%lx, %lx, %d, %lx)", (unsigned long) &plaintext, (unsigned long) chunk_buf, CHUNK_SIZE, (unsigned long) &chunk_ptr);
 		}
+		xorscura_stream_final(&stream);
 
 		// Report.
 		if(retval){
@@ -287,8 +849,26 @@ int main(int argc, char **argv){
 		}
 	}
 
+CLEANUP:
+
 	// We're at the end, so we don't need to free() this stuff, but I'd prefer to be verbose as this could 
 	// also be used as example code.
+	explicit_bzero(chunk_buf, CHUNK_SIZE);
+	explicit_bzero(key_chunk_buf, CHUNK_SIZE);
+	free(chunk_buf);
+	free(cipher_chunk_buf);
+	free(key_chunk_buf);
+
+	// A key that came from a KEY FILE belongs to the mapping, not the xod.
+	if(cli_keyfile && operation != ENCRYPT){
+		data->key_buf = NULL;
+	}
+
+	if(compressed_buf){
+		explicit_bzero(compressed_buf, data->buf_count);
+		free(compressed_buf);
+	}
+
 	xorscura_free_xod(data);
 	free(data);
 	data = NULL;
@@ -297,69 +877,979 @@ int main(int argc, char **argv){
 }
 
 
-// Take the "postscript raw hex" format and turn it into a binary aray.
-int ps2bin(char *ps, unsigned char **bin){
+void hex_init(void){
 
-	int count;
 	int i;
 
-	char buf[3];
-	buf[2] = '\0';
+	memset(hex_table, -1, sizeof(hex_table));
+	for(i = 0; i < 10; i++){
+		hex_table['0' + i] = i;
+	}
+	for(i = 0; i < 6; i++){
+		hex_table['a' + i] = 10 + i;
+		hex_table['A' + i] = 10 + i;
+	}
+}
+
+ssize_t hex_count(char *hex){
+
+	size_t i;
+
+	for(i = 0; hex[i]; i++){
+		if(hex_table[(unsigned char) hex[i]] < 0){
+			return(-1);
+		}
+	}
+
+	if(i % 2){
+		return(-1);
+	}
+
+	return((ssize_t) (i / 2));
+}
+
+// Take the "postscript raw hex" format and turn it into a binary aray.
+int ps2bin(char *ps, unsigned char **bin){
 
-	count = strlen(ps);
+	ssize_t count;
+	ssize_t i;
 
-	if(count % 2){
+
+	if((count = hex_count(ps)) == -1){
 		fprintf(stderr, "ps2bin(): Bad format of string: %s\n", ps);
 		return(-1);
 	}
-	count /= 2;
 
 	if((*bin = (unsigned char *) malloc(count)) == NULL){
-		fprintf(stderr, "ps2bin(): malloc(%d)", count);
+		fprintf(stderr, "ps2bin(): malloc(%d)", (int) count);
 		return(-1);
 	}
 
 	for(i = 0; i < count; i++){
-		memcpy(buf, ps + (i*2), 2);
-		(*bin)[i] = (char) strtol(buf, NULL, 16);
+		(*bin)[i] = (unsigned char) (hex_table[(unsigned char) ps[i * 2]] << 4 | hex_table[(unsigned char) ps[i * 2 + 1]]);
 	}
 
-	return(count);
+	return((int) count);
 }
 
-// Read plaintext from stdin.
-int fill_from_stdin(unsigned char **bin){
+// Set up a source that decodes a "postscript raw hex" string as it's read.
+int source_from_hex(struct source *src, char *hex){
 
-	long pagesize;
-	size_t buffer_pages;
+	ssize_t count;
 
-	int retval;
-	int count;
+	if((count = hex_count(hex)) == -1){
+		fprintf(stderr, "source_from_hex(): Bad format of string: %s\n", hex);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	memset(src, 0, sizeof(struct source));
+	src->hex = hex;
+	src->hex_bytes = (size_t) count;
+	src->fd = -1;
+
+	return(0);
+}
+
+// Set up a source for stdin. If it can be rewound, it's read in place. Otherwise it's copied to a temp file a
+// chunk at a time, which keeps memory use flat no matter how much comes in.
+int source_from_stdin(struct source *src){
+
+	struct stat stdin_stat;
+
+	FILE *spool;
+	unsigned char buf[CHUNK_SIZE];
+	ssize_t retval;
+
+
+	memset(src, 0, sizeof(struct source));
+
+	if(fstat(STDIN_FILENO, &stdin_stat) == -1){
+		fprintf(stderr, "source_from_stdin(): fstat(STDIN_FILENO, 0x%lx)", (unsigned long) &stdin_stat);
+		return(-1);
+	}
 
-	if((pagesize = sysconf(_SC_PAGESIZE)) == -1){
-		fprintf(stderr, "fill_from_stdin(): sysconf(_SC_PAGESIZE)");
+	if(S_ISREG(stdin_stat.st_mode) && (src->fd_start = lseek(STDIN_FILENO, 0, SEEK_CUR)) != -1){
+		src->fd = STDIN_FILENO;
+		return(0);
 	}
 
-	if((*bin = (unsigned char *) malloc(pagesize)) == NULL){
-		fprintf(stderr, "fill_from_stdin(): malloc(%ld)", pagesize);
+	if((spool = tmpfile()) == NULL){
+		fprintf(stderr, "source_from_stdin(): tmpfile()");
+		return(-1);
 	}
-	buffer_pages = 1;
+	src->fd = fileno(spool);
+	src->fd_start = 0;
 
-	count = 0;
-	while((retval = read(STDIN_FILENO, *bin + count, (pagesize * buffer_pages) - count))){
+	while((retval = read(STDIN_FILENO, buf, CHUNK_SIZE))){
 		if(retval == -1){
-			fprintf(stderr, "fill_from_stdin(): read(STDIN_FILENO, 0x%lx, %ld)", (unsigned long) (*bin + count), (pagesize * buffer_pages) - count);
+			if(errno == EINTR){
+				continue;
+			}
+			fprintf(stderr, "source_from_stdin(): read(STDIN_FILENO, 0x%lx, %d)", (unsigned long) buf, CHUNK_SIZE);
 			return(-1);
 		}
-		count += retval;
 
-		if(!(count % pagesize)){
-			buffer_pages++;
-			if((*bin = realloc(*bin, pagesize * buffer_pages)) == NULL){
-				fprintf(stderr, "fill_from_stdin(): realloc(0x%lx, %ld)", (unsigned long) *bin, pagesize * buffer_pages);
-			}
+		if(write(src->fd, buf, retval) != retval){
+			fprintf(stderr, "source_from_stdin(): write(%d, 0x%lx, %d)", src->fd, (unsigned long) buf, (int) retval);
+			return(-1);
+		}
+	}
+
+	return(source_rewind(src));
+}
+
+// Set up a source that reads FILE through a read only mapping.
+int source_from_file(struct source *src, char *path){
+
+	struct stat file_stat;
+	int fd;
+
+
+	memset(src, 0, sizeof(struct source));
+	src->fd = -1;
+
+	if((fd = open(path, O_RDONLY)) == -1){
+		fprintf(stderr, "source_from_file(): open(%s, O_RDONLY)", path);
+		return(-1);
+	}
+
+	if(fstat(fd, &file_stat) == -1){
+		fprintf(stderr, "source_from_file(): fstat(%d, 0x%lx)", fd, (unsigned long) &file_stat);
+		close(fd);
+		return(-1);
+	}
+	src->map_count = (size_t) file_stat.st_size;
+
+	// mmap() won't take a zero length. An empty file just stays unmapped.
+	if(src->map_count){
+		if((src->map = (unsigned char *) mmap(NULL, src->map_count, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+			fprintf(stderr, "source_from_file(): mmap(NULL, %lu, PROT_READ, MAP_PRIVATE, %d, 0)", (unsigned long) src->map_count, fd);
+			close(fd);
+			return(-1);
 		}
+
+		madvise(src->map, src->map_count, MADV_SEQUENTIAL);
 	}
 
-	return(count);
+	close(fd);
+
+	return(0);
+}
+
+// Read up to count bytes from the source. Only comes up short at the end.
+ssize_t source_read(struct source *src, unsigned char *buf, size_t count){
+
+	size_t read_count;
+	ssize_t retval;
+
+	unsigned char *hex;
+
+
+	read_count = 0;
+
+	if(src->hex){
+		hex = (unsigned char *) src->hex + src->hex_pos;
+		while(read_count < count && hex[read_count * 2]){
+			buf[read_count] = (unsigned char) (hex_table[hex[read_count * 2]] << 4 | hex_table[hex[read_count * 2 + 1]]);
+			read_count++;
+		}
+		src->hex_pos += read_count * 2;
+		return((ssize_t) read_count);
+	}
+
+	if(src->fd == -1){
+		read_count = src->map_count - src->map_pos < count ? src->map_count - src->map_pos : count;
+		memcpy(buf, src->map + src->map_pos, read_count);
+		src->map_pos += read_count;
+		return((ssize_t) read_count);
+	}
+
+	while(read_count < count){
+		if((retval = read(src->fd, buf + read_count, count - read_count)) == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return(-1);
+		}
+
+		if(!retval){
+			break;
+		}
+		read_count += (size_t) retval;
+	}
+
+	return((ssize_t) read_count);
+}
+
+// Like source_read(), but a mapped source hands back a pointer into the mapping instead of copying.
+ssize_t source_chunk(struct source *src, unsigned char *buf, size_t count, unsigned char **chunk){
+
+	size_t read_count;
+
+
+	if(src->map){
+		read_count = src->map_count - src->map_pos < count ? src->map_count - src->map_pos : count;
+		*chunk = src->map + src->map_pos;
+		src->map_pos += read_count;
+		return((ssize_t) read_count);
+	}
+
+	*chunk = buf;
+	return(source_read(src, buf, count));
+}
+
+ssize_t source_hex_xor(struct source *src, unsigned char *buf, size_t count){
+
+	size_t read_count;
+	unsigned char *hex;
+
+
+	hex = (unsigned char *) src->hex + src->hex_pos;
+
+	read_count = 0;
+	while(read_count < count && hex[read_count * 2]){
+		buf[read_count] ^= (unsigned char) (hex_table[hex[read_count * 2]] << 4 | hex_table[hex[read_count * 2 + 1]]);
+		read_count++;
+	}
+	src->hex_pos += read_count * 2;
+
+	return((ssize_t) read_count);
+}
+
+int source_compress(struct source *src, unsigned char **buf){
+
+	unsigned char *in;
+	size_t count;
+	off_t size;
+
+
+	if((size = source_size(src)) == -1){
+		return(-1);
+	}
+	count = (size_t) size;
+
+	if((*buf = (unsigned char *) malloc(xorscura_compress_bound(count))) == NULL){
+		fprintf(stderr, "source_compress(): malloc(%lu)", (unsigned long) xorscura_compress_bound(count));
+		return(-1);
+	}
+
+	// A mapping can be compressed where it is. Anything else gets read in whole first.
+	in = src->map;
+	if(!in && count){
+		if((in = (unsigned char *) malloc(count)) == NULL){
+			fprintf(stderr, "source_compress(): malloc(%lu)", (unsigned long) count);
+			return(-1);
+		}
+
+		if(source_read(src, in, count) != (ssize_t) count){
+			fprintf(stderr, "source_compress(): source_read(%lx, %lx, %lu)", (unsigned long) src, (unsigned long) in, (unsigned long) count);
+			return(-1);
+		}
+	}
+
+	count = xorscura_compress(in, count, *buf);
+
+	if(in != src->map){
+		explicit_bzero(in, (size_t) size);
+		free(in);
+	}
+
+	// Now it's a mapping of the compressed bytes.
+	memset(src, 0, sizeof(struct source));
+	src->fd = -1;
+	src->map = *buf;
+	src->map_count = count;
+
+	return(0);
+}
+
+// Back to the start, for another pass.
+int source_rewind(struct source *src){
+
+	if(src->hex){
+		src->hex_pos = 0;
+		return(0);
+	}
+
+	if(src->fd == -1){
+		src->map_pos = 0;
+		return(0);
+	}
+
+	if(lseek(src->fd, src->fd_start, SEEK_SET) == -1){
+		return(-1);
+	}
+
+	return(0);
+}
+
+// Total bytes the source will produce.
+off_t source_size(struct source *src){
+
+	struct stat fd_stat;
+
+
+	if(src->hex){
+		return((off_t) src->hex_bytes);
+	}
+
+	if(src->fd == -1){
+		return((off_t) src->map_count);
+	}
+
+	if(fstat(src->fd, &fd_stat) == -1){
+		return(-1);
+	}
+
+	return(fd_stat.st_size - src->fd_start);
+}
+
+int style_init(struct style *style){
+
+	size_t numeric_count;
+	unsigned int i;
+
+	const char *digits = "0123456789abcdef";
+
+
+	style->separating_count = strlen(style->separating_str);
+	numeric_count = strlen(style->numeric_str);
+	style->cell_count = style->separating_count + numeric_count + 2;
+
+	if(style->cell_count > CELL_SIZE){
+		fprintf(stderr, "style_init(): A cell of %lu chars won't fit in %d.\n", (unsigned long) style->cell_count, CELL_SIZE);
+		return(-1);
+	}
+
+	memset(style->cells, 0, sizeof(style->cells));
+	for(i = 0; i < 256; i++){
+		memcpy(style->cells[i], style->separating_str, style->separating_count);
+		memcpy(style->cells[i] + style->separating_count, style->numeric_str, numeric_count);
+		style->cells[i][style->cell_count - 2] = digits[i >> 4];
+		style->cells[i][style->cell_count - 1] = digits[i & 0xf];
+	}
+
+	return(0);
+}
+
+int writer_init(struct writer *writer, int fd){
+
+	if((writer->buf = (unsigned char *) malloc(WRITER_SIZE)) == NULL){
+		fprintf(stderr, "writer_init(): malloc(%d)", WRITER_SIZE);
+		return(-1);
+	}
+
+	writer->fd = fd;
+	writer->pos = 0;
+
+	return(0);
+}
+
+int writer_flush(struct writer *writer){
+
+	if(write_all(writer->fd, writer->buf, writer->pos) == -1){
+		return(-1);
+	}
+	writer->pos = 0;
+
+	return(0);
+}
+
+int writer_str(struct writer *writer, char *str){
+
+	size_t count = strlen(str);
+
+	if(writer->pos + count > WRITER_SIZE && writer_flush(writer) == -1){
+		return(-1);
+	}
+
+	// Anything bigger than the whole buffer skips it.
+	if(count > WRITER_SIZE){
+		return(write_all(writer->fd, (unsigned char *) str, count));
+	}
+
+	memcpy(writer->buf + writer->pos, str, count);
+	writer->pos += count;
+
+	return(0);
+}
+
+int writer_bytes(struct writer *writer, struct style *style, unsigned char *buf, size_t count, size_t index){
+
+	size_t i;
+
+
+	// The very first byte of the data goes out without its separator.
+	i = 0;
+	if(!index && count){
+		if(writer->pos + CELL_SIZE > WRITER_SIZE && writer_flush(writer) == -1){
+			return(-1);
+		}
+		memcpy(writer->buf + writer->pos, style->cells[buf[0]] + style->separating_count, CELL_SIZE - style->separating_count);
+		writer->pos += style->cell_count - style->separating_count;
+		i = 1;
+	}
+
+	// Whole CELL_SIZE copies, even though only cell_count of each is kept. The next cell lands on the leftovers.
+	for(; i < count; i++){
+		if(writer->pos + CELL_SIZE > WRITER_SIZE && writer_flush(writer) == -1){
+			return(-1);
+		}
+		memcpy(writer->buf + writer->pos, style->cells[buf[i]], CELL_SIZE);
+		writer->pos += style->cell_count;
+	}
+
+	return(0);
+}
+
+// Keystream algorithms the -a switch knows about.
+struct algorithm_entry {
+	char *name;
+	int algorithm;
+} algorithm_table[] = {
+	{"random_r", XORSCURA_ALG_RANDOM_R},
+	{"chacha8", XORSCURA_ALG_CHACHA8},
+	{NULL, -1}
+};
+
+// Look up an algorithm by name.
+int algorithm_by_name(char *name){
+
+	int i;
+
+	for(i = 0; algorithm_table[i].name; i++){
+		if(!strcmp(name, algorithm_table[i].name)){
+			return(algorithm_table[i].algorithm);
+		}
+	}
+
+	return(-1);
+}
+
+// Fit a KEY of key_size bytes to data.
+int key_fit(struct xod *data, size_t key_size){
+
+	// -L already said how long it is.
+	if(data->key_count){
+		return(key_size == data->key_count ? 0 : -1);
+	}
+
+	if(key_size == data->buf_count){
+		return(0);
+	}
+
+	if(!key_size || key_size > XORSCURA_KEY_MAX){
+		return(-1);
+	}
+	data->key_count = key_size;
+
+	return(0);
+}
+
+// And the other way around.
+char *algorithm_name(int algorithm){
+
+	int i;
+
+	for(i = 0; algorithm_table[i].name; i++){
+		if(algorithm_table[i].algorithm == algorithm){
+			return(algorithm_table[i].name);
+		}
+	}
+
+	return("unknown");
+}
+
+// Raw output goes to a new file, readable only by us until the caller says otherwise.
+int archive_files(char **paths, int count, char *output, int algorithm, int compress){
+
+	struct xorscura_archive_item *items;
+	struct xod *data;
+	struct source src;
+	char *name;
+	int output_fd;
+	int i, retval;
+
+
+	if((items = (struct xorscura_archive_item *) calloc(count, sizeof(struct xorscura_archive_item))) == NULL){
+		fprintf(stderr, "archive_files(): calloc(%d, %d)\n", count, (int) sizeof(struct xorscura_archive_item));
+		return(-1);
+	}
+
+	for(i = 0; i < count; i++){
+		if(source_from_file(&src, paths[i]) == -1){
+			return(-1);
+		}
+
+		name = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+		items[i].id = xorscura_archive_id(name);
+
+		data = &(items[i].data);
+		data->plaintext_buf = src.map;
+		data->buf_count = src.map_count;
+		data->algorithm = (unsigned char) algorithm;
+
+		if(compress){
+			items[i].flags = XORSCURA_ARCHIVE_LZ;
+			retval = xorscura_encrypt_lz(data);
+		}else{
+			retval = xorscura_encrypt(data);
+		}
+		if(retval == -1){
+			fprintf(stderr, "archive_files(): %s(%lx)\n", compress ? "xorscura_encrypt_lz" : "xorscura_encrypt", (unsigned long) data);
+			return(-1);
+		}
+
+		// The archive only keeps the seed. The key can go now, and the plaintext is the mapping's.
+		explicit_bzero(data->key_buf, data->buf_count);
+		free(data->key_buf);
+		data->key_buf = NULL;
+		data->alloc_flag &= ~ALLOC_KEY;
+		data->plaintext_buf = NULL;
+
+		if(src.map){
+			munmap(src.map, src.map_count);
+		}
+
+		printf("%016llx: %s\n", (unsigned long long) items[i].id, name);
+	}
+
+	if((output_fd = open_output(output)) == -1){
+		return(-1);
+	}
+
+	if(xorscura_archive_write(output_fd, items, (size_t) count) == -1){
+		if(errno == EEXIST){
+			fprintf(stderr, "Error: Two FILEs have the same name.\n");
+		}
+		close(output_fd);
+		unlink(output);
+		return(-1);
+	}
+
+	if(close(output_fd) == -1){
+		return(-1);
+	}
+
+	for(i = 0; i < count; i++){
+		xorscura_free_xod(&(items[i].data));
+	}
+	free(items);
+
+	return(0);
+}
+
+// batch_walk() adds to walk_batch. nftw() has no way to pass it through. walk_root_count is how much of each path to
+// skip to get its name: the root, and the '/' after it.
+struct batch *walk_batch;
+size_t walk_root_count;
+
+int batch_files(char **paths, int count, char *output, int algorithm, int compress, int threads){
+
+	struct batch batch;
+	struct batch_file *file;
+	pthread_t *tids;
+	char *root;
+	int i, started, failed;
+
+
+	memset(&batch, 0, sizeof(struct batch));
+	batch.output = output;
+	batch.algorithm = algorithm;
+	batch.compress = compress;
+
+	// Gather up every file first, so the workers only ever take the next index.
+	walk_batch = &batch;
+	for(i = 0; i < count; i++){
+		if((root = strdup(paths[i])) == NULL){
+			fprintf(stderr, "batch_files(): strdup(%s)\n", paths[i]);
+			return(-1);
+		}
+
+		walk_root_count = strlen(root);
+		while(walk_root_count > 1 && root[walk_root_count - 1] == '/'){
+			root[--walk_root_count] = '\0';
+		}
+
+		// Only a root of "/" still ends in one.
+		if(walk_root_count && root[walk_root_count - 1] != '/'){
+			walk_root_count++;
+		}
+
+		if(nftw(root, batch_walk, 64, FTW_PHYS) == -1){
+			fprintf(stderr, "batch_files(): nftw(%s, %lx, 64, FTW_PHYS)\n", root, (unsigned long) batch_walk);
+			return(-1);
+		}
+
+		free(root);
+	}
+
+	// Before anything is written, as with an archive.
+	if(batch_unique(&batch) == -1){
+		return(-1);
+	}
+
+	if(!threads){
+		threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(threads < 1){
+		threads = 1;
+	}
+	if((size_t) threads > batch.file_count){
+		threads = batch.file_count ? (int) batch.file_count : 1;
+	}
+
+	if(sem_init(&batch.io, 0, BATCH_IO) == -1){
+		fprintf(stderr, "batch_files(): sem_init(%lx, 0, %d)\n", (unsigned long) &batch.io, BATCH_IO);
+		return(-1);
+	}
+
+	if((tids = (pthread_t *) calloc(threads, sizeof(pthread_t))) == NULL){
+		fprintf(stderr, "batch_files(): calloc(%d, %d)\n", threads, (int) sizeof(pthread_t));
+		return(-1);
+	}
+
+	for(started = 0; started < threads; started++){
+		if(pthread_create(tids + started, NULL, batch_worker, &batch)){
+			break;
+		}
+	}
+
+	// If no thread would start, this one does the lot.
+	if(!started){
+		batch_worker(&batch);
+	}
+
+	for(i = 0; i < started; i++){
+		pthread_join(tids[i], NULL);
+	}
+
+	// The manifest, in the order the files were given.
+	failed = 0;
+	for(i = 0; (size_t) i < batch.file_count; i++){
+		file = batch.files + i;
+
+		if(file->error){
+			fprintf(stderr, "Error: %s: %s\n", file->path, strerror(file->error));
+			failed++;
+		}else{
+			printf("%u\t%s\t%s\t%lu\t%lu\t%s\n", file->seed, algorithm_name(algorithm), compress ? "lz" : "-", (unsigned long) file->count, (unsigned long) file->stored_count, file->name);
+		}
+
+		free(file->path);
+		free(file->name);
+	}
+
+	sem_destroy(&batch.io);
+	free(batch.files);
+	free(tids);
+
+	return(failed);
+}
+
+int batch_add(struct batch *batch, const char *path, const char *name){
+
+	struct batch_file *tmp;
+	size_t max;
+
+
+	if(batch->file_count == batch->file_max){
+		max = batch->file_max ? 2 * batch->file_max : 64;
+		if((tmp = (struct batch_file *) realloc(batch->files, max * sizeof(struct batch_file))) == NULL){
+			fprintf(stderr, "batch_add(): realloc(%lx, %lu)\n", (unsigned long) batch->files, (unsigned long) (max * sizeof(struct batch_file)));
+			return(-1);
+		}
+		batch->files = tmp;
+		batch->file_max = max;
+	}
+
+	tmp = batch->files + batch->file_count;
+	memset(tmp, 0, sizeof(struct batch_file));
+
+	if((tmp->path = strdup(path)) == NULL || (tmp->name = strdup(name)) == NULL){
+		free(tmp->path);
+		fprintf(stderr, "batch_add(): strdup(%s)\n", path);
+		return(-1);
+	}
+
+	batch->file_count++;
+
+	return(0);
+}
+
+// Regular files only. A FILE argument is named for its basename, anything found under a DIR for the rest of its path.
+int batch_walk(const char *path, const struct stat *file_stat, int type, struct FTW *ftw_buf){
+
+	if(type == FTW_DNR || type == FTW_NS){
+		fprintf(stderr, "Error: %s: Can't be read.\n", path);
+		return(-1);
+	}
+
+	if(type != FTW_F || !S_ISREG(file_stat->st_mode)){
+		return(0);
+	}
+
+	return(batch_add(walk_batch, path, ftw_buf->level ? path + walk_root_count : path + ftw_buf->base));
+}
+
+int batch_unique(struct batch *batch){
+
+	struct batch_file **sorted;
+	size_t i;
+	int retval = 0;
+
+
+	if(batch->file_count < 2){
+		return(0);
+	}
+
+	if((sorted = (struct batch_file **) calloc(batch->file_count, sizeof(struct batch_file *))) == NULL){
+		fprintf(stderr, "batch_unique(): calloc(%lu, %d)\n", (unsigned long) batch->file_count, (int) sizeof(struct batch_file *));
+		return(-1);
+	}
+
+	// Sort pointers rather than the files themselves, which keeps the manifest in the order the files were given.
+	for(i = 0; i < batch->file_count; i++){
+		sorted[i] = batch->files + i;
+	}
+	qsort(sorted, batch->file_count, sizeof(struct batch_file *), batch_name_cmp);
+
+	for(i = 1; i < batch->file_count; i++){
+		if(!strcmp(sorted[i - 1]->name, sorted[i]->name)){
+			fprintf(stderr, "Error: %s and %s would both be written to %s/%s.\n", sorted[i - 1]->path, sorted[i]->path, batch->output, sorted[i]->name);
+			retval = -1;
+		}
+	}
+
+	free(sorted);
+
+	if(retval){
+		errno = EEXIST;
+	}
+
+	return(retval);
+}
+
+int batch_name_cmp(const void *a, const void *b){
+	return(strcmp((*(struct batch_file * const *) a)->name, (*(struct batch_file * const *) b)->name));
+}
+
+void *batch_worker(void *arg){
+
+	struct batch *batch = (struct batch *) arg;
+	size_t i;
+
+
+	while((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->file_count){
+		errno = 0;
+		if(batch_encrypt(batch, batch->files + i) == -1){
+			batch->files[i].error = errno ? errno : EIO;
+		}
+	}
+
+	return(NULL);
+}
+
+// Read, compress, encrypt in place, write. Only the reading and writing take one of the batch->io slots.
+int batch_encrypt(struct batch *batch, struct batch_file *file){
+
+	struct xod data;
+	struct xorscura_stream stream;
+	unsigned char *buf = NULL;
+	unsigned char *lz_buf = NULL;
+	unsigned char *out;
+	size_t out_count;
+	char *out_path = NULL;
+	int fd;
+	int retval = -1;
+	int tmp;
+
+
+	sem_wait(&batch->io);
+	tmp = read_file(file->path, &buf, &(file->count));
+	sem_post(&batch->io);
+	if(tmp == -1){
+		return(-1);
+	}
+
+	out = buf;
+	out_count = file->count;
+	if(batch->compress){
+		if((out_count = xorscura_compress_bound(file->count)) < file->count){
+			errno = ENOMEM;
+			goto CLEANUP;
+		}
+
+		if((lz_buf = (unsigned char *) malloc(out_count)) == NULL){
+			goto CLEANUP;
+		}
+
+		out_count = xorscura_compress(buf, file->count, lz_buf);
+		out = lz_buf;
+	}
+
+	// Only the seed is kept, so there's no KEY to make. The keystream goes straight over the bytes in place.
+	memset(&data, 0, sizeof(struct xod));
+	data.algorithm = (unsigned char) batch->algorithm;
+	if(xorscura_seed(&data) == -1 || xorscura_stream_init(&stream, &data, 0) == -1){
+		goto CLEANUP;
+	}
+	xorscura_stream_update(&stream, out, out, out_count);
+	xorscura_stream_final(&stream);
+
+	file->seed = data.seed;
+	file->stored_count = out_count;
+
+	if(asprintf(&out_path, "%s/%s", batch->output, file->name) == -1){
+		out_path = NULL;
+		goto CLEANUP;
+	}
+
+	// Never over the top of a file that's already there, whether it's from an earlier run or another argument.
+	sem_wait(&batch->io);
+	if(make_parents(out_path) != -1 && (fd = open(out_path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) != -1){
+		retval = write_all(fd, out, out_count);
+		if(close(fd) == -1){
+			retval = -1;
+		}
+	}
+	sem_post(&batch->io);
+
+CLEANUP:
+	tmp = errno;
+
+	// With -z, buf is still the plaintext.
+	explicit_bzero(buf, file->count);
+	free(buf);
+	free(lz_buf);
+	free(out_path);
+
+	errno = tmp;
+
+	return(retval);
+}
+
+int read_file(char *path, unsigned char **buf, size_t *count){
+
+	struct stat file_stat;
+	ssize_t read_count;
+	size_t done;
+	int fd;
+
+
+	if((fd = open(path, O_RDONLY)) == -1){
+		return(-1);
+	}
+
+	if(fstat(fd, &file_stat) == -1){
+		close(fd);
+		return(-1);
+	}
+	*count = (size_t) file_stat.st_size;
+
+	// +1 so an empty file still gets a buffer.
+	if((*buf = (unsigned char *) malloc(*count + 1)) == NULL){
+		close(fd);
+		return(-1);
+	}
+
+	done = 0;
+	while(done < *count){
+		if((read_count = read(fd, *buf + done, *count - done)) <= 0){
+			if(read_count == -1 && errno == EINTR){
+				continue;
+			}
+
+			// A file that shrank out from under us.
+			if(!read_count){
+				errno = EIO;
+			}
+			free(*buf);
+			*buf = NULL;
+			close(fd);
+			return(-1);
+		}
+		done += (size_t) read_count;
+	}
+
+	close(fd);
+
+	return(0);
+}
+
+int make_parents(char *path){
+
+	char *ptr;
+
+
+	for(ptr = strchr(path + 1, '/'); ptr; ptr = strchr(ptr + 1, '/')){
+		*ptr = '\0';
+		if(mkdir(path, S_IRWXU) == -1 && errno != EEXIST){
+			*ptr = '/';
+			return(-1);
+		}
+		*ptr = '/';
+	}
+
+	return(0);
+}
+
+int open_output(char *path){
+
+	int fd;
+
+	if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1){
+		fprintf(stderr, "open_output(): open(%s, O_WRONLY | O_CREAT | O_TRUNC, 0600)\n", path);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+int write_all(int fd, unsigned char *buf, size_t count){
+
+	ssize_t retval;
+	size_t write_count;
+
+	write_count = 0;
+	while(write_count < count){
+		if((retval = write(fd, buf + write_count, count - write_count)) == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return(-1);
+		}
+		write_count += (size_t) retval;
+	}
+
+	return(0);
+}
+
+void stats_report(void){
+
+	struct xorscura_stats stats;
+	char *op_names[XORSCURA_STATS_OPS] = {"encrypt", "decrypt", "compare", "stream"};
+	int op, i;
+
+
+	xorscura_stats_snapshot(&stats);
+
+	fprintf(stderr, "stats: prng_words: %llu\n", (unsigned long long) stats.prng_words);
+	fprintf(stderr, "stats: allocs: %llu\n", (unsigned long long) stats.allocs);
+
+	for(op = 0; op < XORSCURA_STATS_OPS; op++){
+		if(!stats.calls[op]){
+			continue;
+		}
+
+		fprintf(stderr, "stats: %s: calls: %llu bytes: %llu\n", op_names[op], (unsigned long long) stats.calls[op], (unsigned long long) stats.bytes[op]);
+
+		// Each bucket as the range of nanoseconds it covers.
+		for(i = 0; i < XORSCURA_STATS_BUCKETS; i++){
+			if(stats.latency[op][i]){
+				fprintf(stderr, "stats: %s: latency_ns: [%llu, %llu): %llu\n", op_names[op], i ? 1ULL << i : 0ULL, 1ULL << (i + 1), (unsigned long long) stats.latency[op][i]);
+			}
+		}
+	}
 }
@@ -0,0 +1,398 @@
+/**********************************************************************************************************************
+ *
+ * xorscura.hpp
+ *
+ *	A header only C++ (14 or later) layer over libxorscura, for string literals that are encrypted by the compiler.
+ *	No trip through the cli, and no arrays pasted in by hand:
+ *
+ *		const auto &password = XORSCURA_SECRET("I <3 PONIES!!!");
+ *
+ *		if(!password.compare(input, strlen(input))){
+ *			...
+ *		}
+ *
+ *		auto greeting = XORSCURA_SECRET("hello, world").decrypt();
+ *		puts(greeting.c_str());
+ *
+ *	XORSCURA_SECRET() builds a static constexpr xorscura::secret, so the encrypt happens at compile time and only the
+ *	ciphertext and seed end up in the binary. There's nothing to set up at run time. (XORSCURA_SECRET_ALG() picks the
+ *	algorithm.) The keystream is the library's own, bit for bit, so secret::xod() hands a secret straight to any of
+ *	the C functions, and a seed and ciphertext from the cli can be checked against it.
+ *
+ *	Decrypts and compares are specialized for each size: the keystream goes into a buffer of exactly N bytes on the
+ *	stack, and the xor over it is unrolled in full. Nothing is allocated. decrypt() returns an xorscura::plain, which
+ *	wipes itself when it goes out of scope. compare() never writes the plaintext anywhere at all.
+ *
+ *	Note: The unrolling is meant for strings. Big blobs belong in the C API, which has vector kernels for them.
+ *
+ **********************************************************************************************************************/
+
+#ifndef XORSCURA_HPP
+#define XORSCURA_HPP
+
+#if __cplusplus < 201402L
+#error "xorscura.hpp needs C++14 or later."
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "libxorscura.h"
+
+
+namespace xorscura {
+
+namespace detail {
+
+// The parameters of glibc's TYPE_4 random_r(). (See "keystream generator" in libxorscura.c.)
+constexpr std::uint32_t prng_modulus = 2147483647;
+constexpr int prng_discard = 10 * XORSCURA_PRNG_DEG;
+
+constexpr std::size_t chacha_blocklen = 64;
+
+constexpr std::uint32_t mulmod(std::uint32_t a, std::uint32_t b){
+	return(static_cast<std::uint32_t>(static_cast<std::uint64_t>(a) * b % prng_modulus));
+}
+
+constexpr std::uint32_t rotl(std::uint32_t x, int n){
+	return((x << n) | (x >> (32 - n)));
+}
+
+constexpr void chacha_quarter(std::uint32_t *x, int a, int b, int c, int d){
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = rotl(x[d], 16);
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = rotl(x[b], 12);
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = rotl(x[d], 8);
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = rotl(x[b], 7);
+}
+
+// The keystream for (algorithm, seed), a byte at a time from the start. The same code runs in the compiler, to
+// encrypt, and at run time, to decrypt. Bytes come out of each 32 bit word in memory order, as they do in the
+// library.
+class keystream {
+
+	public:
+
+		constexpr keystream(unsigned char algorithm, unsigned int seed) : algorithm_(algorithm), seed_(seed){
+
+			std::uint32_t power = 16807;
+			std::int64_t residue = 0;
+			int i = 0;
+
+
+			if(algorithm_ != XORSCURA_ALG_RANDOM_R){
+				return;
+			}
+
+			// srandom_r(): Park-Miller steps from the int32 value of the seed, oldest first, then the seed itself.
+			if(!seed){
+				seed = 1;
+			}
+
+			residue = static_cast<std::int32_t>(seed) % static_cast<std::int64_t>(prng_modulus);
+			if(residue < 0){
+				residue += prng_modulus;
+			}
+
+			for(i = 0; i < XORSCURA_PRNG_DEG - 1; i++){
+				window_[i] = mulmod(static_cast<std::uint32_t>(residue), power);
+				power = mulmod(power, 16807);
+			}
+			window_[XORSCURA_PRNG_DEG - 1] = seed;
+
+			for(i = 0; i < prng_discard / XORSCURA_PRNG_DEG; i++){
+				next_block();
+			}
+			block_count_ = 0;
+		}
+
+		constexpr unsigned char next(){
+
+			std::size_t word = 0;
+			std::size_t shift = 0;
+
+
+			if(block_pos_ == block_count_){
+				next_block();
+			}
+
+			word = block_pos_ / 4;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			shift = 24 - 8 * (block_pos_ % 4);
+#else
+			shift = 8 * (block_pos_ % 4);
+#endif
+			block_pos_++;
+
+			return(static_cast<unsigned char>(block_[word] >> shift));
+		}
+
+		void wipe(){
+			explicit_bzero(this, sizeof(keystream));
+		}
+
+	private:
+
+		// Refill block_ with the next 63 random_r() results, or the next 64 byte chacha8 block.
+		constexpr void next_block(){
+
+			std::uint32_t x[16] = {};
+			std::uint32_t in[16] = {};
+			std::uint32_t prev = 0;
+			int i = 0;
+
+
+			if(algorithm_ == XORSCURA_ALG_RANDOM_R){
+				prev = window_[XORSCURA_PRNG_DEG - 1];
+				for(i = 0; i < XORSCURA_PRNG_DEG; i++){
+					prev += window_[i];
+					window_[i] = prev;
+					block_[i] = prev >> 1;
+				}
+				block_count_ = XORSCURA_PRNG_DEG * 4;
+
+			}else{
+				in[0] = 0x61707865;
+				in[1] = 0x3320646e;
+				in[2] = 0x79622d32;
+				in[3] = 0x6b206574;
+				in[4] = seed_;
+				in[12] = static_cast<std::uint32_t>(counter_);
+				in[13] = static_cast<std::uint32_t>(counter_ >> 32);
+
+				for(i = 0; i < 16; i++){
+					x[i] = in[i];
+				}
+
+				for(i = 0; i < 8; i += 2){
+					chacha_quarter(x, 0, 4, 8, 12);
+					chacha_quarter(x, 1, 5, 9, 13);
+					chacha_quarter(x, 2, 6, 10, 14);
+					chacha_quarter(x, 3, 7, 11, 15);
+					chacha_quarter(x, 0, 5, 10, 15);
+					chacha_quarter(x, 1, 6, 11, 12);
+					chacha_quarter(x, 2, 7, 8, 13);
+					chacha_quarter(x, 3, 4, 9, 14);
+				}
+
+				for(i = 0; i < 16; i++){
+					block_[i] = x[i] + in[i];
+				}
+				counter_++;
+				block_count_ = chacha_blocklen;
+			}
+
+			block_pos_ = 0;
+		}
+
+		unsigned char algorithm_;
+		unsigned int seed_;
+
+		std::uint32_t window_[XORSCURA_PRNG_DEG] = {};
+		std::uint64_t counter_ = 0;
+
+		std::uint32_t block_[XORSCURA_KEYSTREAM_WORDS] = {};
+		std::size_t block_count_ = 0;
+		std::size_t block_pos_ = 0;
+};
+
+// FNV-1a, for turning where a secret is (and when it was built) into its seed.
+constexpr unsigned int hash(const char *str, unsigned int basis){
+
+	std::uint32_t h = 2166136261u ^ basis;
+
+	while(*str){
+		h = (h ^ static_cast<unsigned char>(*str++)) * 16777619u;
+	}
+
+	return(h);
+}
+
+} // namespace detail
+
+
+
+// The decrypted bytes of a secret<N>, on the stack, with a null terminator after them. Wiped when it goes out of
+// scope. It can be moved (which wipes the one moved from) but not copied.
+template <std::size_t N>
+class plain {
+
+	public:
+
+		plain(){
+		}
+
+		plain(plain &&other){
+			memcpy(buf_, other.buf_, N + 1);
+			other.wipe();
+		}
+
+		plain(const plain &) = delete;
+		plain &operator=(const plain &) = delete;
+
+		~plain(){
+			wipe();
+		}
+
+		const char *c_str() const { return(reinterpret_cast<const char *>(buf_)); }
+		const unsigned char *data() const { return(buf_); }
+		unsigned char *data() { return(buf_); }
+		static constexpr std::size_t size() { return(N); }
+
+		void wipe(){
+			explicit_bzero(buf_, N + 1);
+		}
+
+	private:
+
+		unsigned char buf_[N + 1] = {};
+};
+
+
+
+// One string literal of N bytes (not counting its null terminator), encrypted with the Algorithm keystream from
+// seed. The constructor is constexpr, so a constexpr secret is encrypted by the compiler. (XORSCURA_SECRET() makes
+// them.) Everything else happens at run time.
+template <std::size_t N, unsigned char Algorithm = XORSCURA_ALG_RANDOM_R>
+class secret {
+
+	static_assert(N > 0, "xorscura::secret needs at least one byte.");
+	static_assert(Algorithm == XORSCURA_ALG_RANDOM_R || Algorithm == XORSCURA_ALG_CHACHA8, "xorscura::secret needs a known XORSCURA_ALG_*.");
+
+	public:
+
+		constexpr secret(const char (&str)[N + 1], unsigned int seed) : seed_(seed){
+
+			detail::keystream ks(Algorithm, seed);
+			std::size_t i = 0;
+
+
+			for(i = 0; i < N; i++){
+				cipher_[i] = static_cast<unsigned char>(str[i]) ^ ks.next();
+			}
+		}
+
+		static constexpr std::size_t size() { return(N); }
+		static constexpr unsigned char algorithm() { return(Algorithm); }
+		constexpr unsigned int seed() const { return(seed_); }
+		constexpr const unsigned char *ciphertext() const { return(cipher_); }
+
+		// Decrypt into out, which has room for N bytes. No null terminator is added.
+		void decrypt(unsigned char *out) const {
+
+			unsigned char key[N];
+
+
+			fill_key(key);
+			xor_key(out, key, std::make_index_sequence<N>());
+			explicit_bzero(key, N);
+		}
+
+		plain<N> decrypt() const {
+
+			plain<N> out;
+
+
+			decrypt(out.data());
+
+			return(out);
+		}
+
+		// 0 if candidate is the plaintext, 1 if it isn't, as with xorscura_compare(). The plaintext is never written
+		// anywhere. A candidate of a different length is a non-match, found without generating any keystream.
+		int compare(const void *candidate, std::size_t count) const {
+
+			unsigned char key[N];
+			unsigned char diff;
+
+
+			if(count != N){
+				return(1);
+			}
+
+			fill_key(key);
+			diff = cmp_key(static_cast<const unsigned char *>(candidate), key, std::make_index_sequence<N>());
+			explicit_bzero(key, N);
+
+			return(diff != 0);
+		}
+
+		// A seed mode xod over the ciphertext, for the C API. Nothing is allocated, and nothing needs freeing unless
+		// a C function allocates it. The C API doesn't take its buffers const, but apart from
+		// xorscura_decrypt_inplace() it only reads ciphertext_buf. Don't hand this one to that.
+		struct xod xod() const {
+
+			struct xod data = {};
+
+
+			data.ciphertext_buf = const_cast<unsigned char *>(cipher_);
+			data.buf_count = N;
+			data.seed = seed_;
+			data.algorithm = Algorithm;
+
+			return(data);
+		}
+
+	private:
+
+		// The seed is read through a volatile, so a compiler that can see the whole constexpr secret still can't fold
+		// the decrypt down to the plaintext and store that instead.
+		void fill_key(unsigned char *key) const {
+
+			detail::keystream ks(Algorithm, *static_cast<const volatile unsigned int *>(&seed_));
+			std::size_t i;
+
+
+			for(i = 0; i < N; i++){
+				key[i] = ks.next();
+			}
+			ks.wipe();
+		}
+
+		template <std::size_t... I>
+		void xor_key(unsigned char *out, const unsigned char *key, std::index_sequence<I...>) const {
+
+			using unroll = int[];
+
+			(void) unroll{0, ((void) (out[I] = cipher_[I] ^ key[I]), 0)...};
+		}
+
+		template <std::size_t... I>
+		unsigned char cmp_key(const unsigned char *candidate, const unsigned char *key, std::index_sequence<I...>) const {
+
+			using unroll = int[];
+			unsigned char diff = 0;
+
+			(void) unroll{0, ((void) (diff |= candidate[I] ^ cipher_[I] ^ key[I]), 0)...};
+
+			return(diff);
+		}
+
+		unsigned char cipher_[N] = {};
+		unsigned int seed_;
+};
+
+} // namespace xorscura
+
+
+
+// Every XORSCURA_SECRET() gets its own seed, from where it is in the source and XORSCURA_BUILD_SEED. That defaults to
+// the build's date and time, which changes the seeds with every build. Define it (as an unsigned int) before
+// including this header for reproducible builds.
+#ifndef XORSCURA_BUILD_SEED
+#define XORSCURA_BUILD_SEED	::xorscura::detail::hash(__DATE__ " " __TIME__, 0)
+#endif
+
+#define XORSCURA_SEED()	::xorscura::detail::hash(__FILE__, XORSCURA_BUILD_SEED ^ (__LINE__ * 2654435761u) ^ (__COUNTER__ * 40503u))
+
+// A reference to a static constexpr xorscura::secret of the string literal str. The plaintext never makes it into
+// the binary.
+#define XORSCURA_SECRET_ALG(algorithm, str) \
+	([]() -> const ::xorscura::secret<sizeof(str) - 1, (algorithm)> & { \
+		static constexpr ::xorscura::secret<sizeof(str) - 1, (algorithm)> xorscura_secret_(str, XORSCURA_SEED()); \
+		return(xorscura_secret_); \
+	}())
+
+#define XORSCURA_SECRET(str)	XORSCURA_SECRET_ALG(XORSCURA_ALG_RANDOM_R, str)
+
+#endif